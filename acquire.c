@@ -0,0 +1,356 @@
+/*
+ * Synchronized acquisition of ADC inputs from several MCP2221 chips.
+ *
+ * One scheduler drives all chips: at every tick, STATUSSET requests
+ * are submitted to all of them back to back, so the samples of one
+ * tick are taken as close in time as the bus allows.  Every sample
+ * gets a latency-compensated timestamp, learned per device.
+ *
+ * Samples of all chips are merged into one stream, ordered by time.
+ * A sample is written out only when no request in flight can produce
+ * an earlier one: the moment of a sample is never before its request
+ * was submitted.  A request which hangs longer than HOLD_NSEC stops
+ * holding the output back; if its sample finally comes earlier than
+ * the last one written, it is dropped and counted, so the stream
+ * stays ordered.
+ *
+ * Skew of a chip is the difference between its sample and the mean
+ * of all samples of the same tick.  Its mean shows a constant offset
+ * (for example, position in the submission order), and its deviation
+ * shows how well the chips are aligned.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mcp2221.h"
+#include "async.h"
+#include "timestamp.h"
+#include "util.h"
+
+#define MAX_QUEUE       (HID_ASYNC_MAXDEV * 16) // samples waiting for output
+#define HOLD_NSEC       100000000ULL        // longest wait for a hanging request
+#define DRAIN_NSEC      1000000000ULL       // wait for requests in flight at exit
+
+typedef struct {
+    hid_device_t *dev;
+    hid_request_t req;                  // STATUSSET request
+    tstamp_t *ts;                       // timestamp estimator
+    int pending;                        // request is in flight
+    unsigned long tick;                 // tick of the request
+    unsigned long nsamples;             // samples received
+    unsigned long nmissed;              // ticks skipped, request still in flight
+    unsigned long nfailed;              // failed requests
+    unsigned long nlate;                // replies after their tick was closed
+    unsigned long ndropped;             // samples earlier than already written
+    unsigned long nskew;                // samples with skew measured
+    double skew_sum, skew_sum2;         // skew relative to the tick, usec
+    double skew_max;                    // largest skew by absolute value
+    double err_sum;                     // uncertainty of timestamps, usec
+} chip_t;
+
+typedef struct {
+    unsigned long long t;               // time of sample, nsec
+    unsigned long long err;             // uncertainty, nsec
+    unsigned long tick;                 // tick of the request
+    int chip;                           // index in chips[]
+    uint16_t adc[3];
+} sample_t;
+
+static chip_t chips[HID_ASYNC_MAXDEV];
+static int nchips;
+
+static sample_t queue[MAX_QUEUE];       // samples not yet written
+static int nqueued;
+static unsigned long long emitted;      // time of the last sample written
+
+static unsigned long ntick;             // ticks started
+static unsigned long long tick_time[HID_ASYNC_MAXDEV]; // samples of the current tick
+static char tick_have[HID_ASYNC_MAXDEV];
+
+static double spread_sum, spread_max;   // of samples within a tick, usec
+static unsigned long nspread;
+
+static unsigned long long start_time;
+static FILE *out;
+
+static int compare_samples(const void *a, const void *b)
+{
+    const sample_t *x = a, *y = b;
+
+    return (x->t > y->t) - (x->t < y->t);
+}
+
+//
+// Write out the samples which are earlier than the given time.
+//
+static void emit(unsigned long long watermark)
+{
+    int i, n;
+
+    qsort(queue, nqueued, sizeof(sample_t), compare_samples);
+    for (n=0; n<nqueued && queue[n].t < watermark; n++) {
+        const sample_t *s = &queue[n];
+
+        fprintf(out, "%.6f,%.6f,%s,%lu,%u,%u,%u\n",
+            (s->t - start_time) / 1e9, s->err / 1e9,
+            hid_async_serial(chips[s->chip].dev), s->tick,
+            s->adc[0], s->adc[1], s->adc[2]);
+        emitted = s->t;
+    }
+    for (i=n; i<nqueued; i++)
+        queue[i - n] = queue[i];
+    nqueued -= n;
+}
+
+//
+// Samples earlier than this moment cannot come anymore,
+// except from requests which hang longer than HOLD_NSEC.
+//
+static unsigned long long watermark()
+{
+    unsigned long long w = ~0ULL;
+    unsigned long long now = time_nsec();
+    int i;
+
+    for (i=0; i<nchips; i++)
+        if (chips[i].pending && chips[i].req.t_send < w &&
+            chips[i].req.t_send + HOLD_NSEC > now)
+            w = chips[i].req.t_send;
+    return w;
+}
+
+//
+// Account skew of every chip in the current tick.
+//
+static void close_tick()
+{
+    double mean = 0, lo = 0, hi = 0, skew;
+    int i, n = 0;
+
+    for (i=0; i<nchips; i++) {
+        if (!tick_have[i])
+            continue;
+        mean += tick_time[i];
+        if (n == 0 || tick_time[i] < lo)
+            lo = tick_time[i];
+        if (n == 0 || tick_time[i] > hi)
+            hi = tick_time[i];
+        n++;
+    }
+    if (n > 1) {
+        mean /= n;
+        for (i=0; i<nchips; i++) {
+            if (!tick_have[i])
+                continue;
+            skew = (tick_time[i] - mean) / 1e3;
+            chips[i].skew_sum += skew;
+            chips[i].skew_sum2 += skew * skew;
+            if (fabs(skew) > fabs(chips[i].skew_max))
+                chips[i].skew_max = skew;
+            chips[i].nskew++;
+        }
+        spread_sum += (hi - lo) / 1e3;
+        if ((hi - lo) / 1e3 > spread_max)
+            spread_max = (hi - lo) / 1e3;
+        nspread++;
+    }
+    memset(tick_have, 0, sizeof(tick_have));
+}
+
+//
+// Reply to STATUSSET has been received.
+//
+static void status_done(hid_request_t *req)
+{
+    chip_t *chip = req->arg;
+    mcp_reply_status_t *status = (mcp_reply_status_t*) req->reply;
+    int index = chip - chips;
+    unsigned long long t, err;
+    sample_t *s;
+
+    chip->pending = 0;
+    if (req->status < 0 || status->command_code != MCP_CMD_STATUSSET) {
+        chip->nfailed++;
+        return;
+    }
+    ts_update(chip->ts, req->t_send, req->t_written, req->t_recv, &t, &err);
+    if (t < emitted) {
+        // Later samples are already written.
+        chip->ndropped++;
+        return;
+    }
+    if (nqueued >= MAX_QUEUE) {
+        // Write out the earliest sample to make room.
+        qsort(queue, nqueued, sizeof(sample_t), compare_samples);
+        emit(queue[0].t + 1);
+        if (t < emitted) {
+            chip->ndropped++;
+            return;
+        }
+    }
+    s = &queue[nqueued++];
+    s->t = t;
+    s->err = err;
+    s->tick = chip->tick;
+    s->chip = index;
+    s->adc[0] = status->adc_ch0;
+    s->adc[1] = status->adc_ch1;
+    s->adc[2] = status->adc_ch2;
+
+    chip->nsamples++;
+    chip->err_sum += s->err / 1e3;
+    if (chip->tick + 1 == ntick) {
+        tick_time[index] = s->t;
+        tick_have[index] = 1;
+    } else {
+        chip->nlate++;
+    }
+}
+
+//
+// Open the chips: "all", or a list of serial numbers.
+//
+static void open_chips(int vid, int pid, const char *list)
+{
+    char serial[64];
+    const char *p;
+    int len;
+
+    if (strcmp(list, "all") == 0) {
+        hid_device_t *devs[HID_ASYNC_MAXDEV];
+        int i;
+
+        nchips = hid_async_open_all(vid, pid, devs, HID_ASYNC_MAXDEV);
+        for (i=0; i<nchips; i++)
+            chips[i].dev = devs[i];
+        if (nchips == 0) {
+            fprintf(stderr, "No MCP2221 chip detected.\n");
+            exit(-1);
+        }
+        return;
+    }
+
+    for (p = list; *p; p += len) {
+        if (*p == ',')
+            p++;
+        len = strcspn(p, ",");
+        if (len == 0 || len >= (int) sizeof(serial) || nchips >= HID_ASYNC_MAXDEV) {
+            fprintf(stderr, "Bad list of chips: %s\n", list);
+            exit(-1);
+        }
+        memcpy(serial, p, len);
+        serial[len] = 0;
+        chips[nchips].dev = hid_async_open(vid, pid, serial);
+        if (!chips[nchips].dev) {
+            fprintf(stderr, "No MCP2221 chip with serial number %s.\n", serial);
+            exit(-1);
+        }
+        nchips++;
+    }
+}
+
+//
+// Poll ADC inputs of several chips with given interval,
+// and write the merged stream of samples.
+//
+void mcp_acquire(int vid, int pid, const char *list, const char *output, int interval_msec)
+{
+    unsigned long long interval = interval_msec * 1000000ULL;
+    unsigned long long next, drain;
+    int i, npending;
+
+    open_chips(vid, pid, list);
+    for (i=0; i<nchips; i++) {
+        chips[i].ts = ts_create(hid_async_serial(chips[i].dev));
+        chips[i].req.callback = status_done;
+        chips[i].req.arg = &chips[i];
+        chips[i].req.data[0] = MCP_CMD_STATUSSET;
+        fprintf(stderr, "Acquire chip %s\n", hid_async_serial(chips[i].dev));
+    }
+
+    out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            perror(output);
+            exit(-1);
+        }
+    }
+    fprintf(out, "time,err,serial,tick,adc0,adc1,adc2\n");
+
+    catch_stop_signals();
+    start_time = next = time_nsec();
+    while (!stop_flag) {
+        if (time_nsec() >= next) {
+            close_tick();
+            ntick++;
+
+            // Submit to all chips back to back.
+            // Skip the chips which did not answer the previous request.
+            for (i=0; i<nchips; i++) {
+                if (chips[i].pending) {
+                    chips[i].nmissed++;
+                    continue;
+                }
+                chips[i].pending = 1;
+                chips[i].tick = ntick - 1;
+                hid_async_submit(chips[i].dev, &chips[i].req);
+            }
+            next += interval;
+            if (next < time_nsec())
+                next = time_nsec() + interval;
+        }
+        hid_async_wait(next);
+        emit(watermark());
+    }
+
+    // Let the requests in flight complete.
+    drain = time_nsec() + DRAIN_NSEC;
+    for (;;) {
+        for (npending=0, i=0; i<nchips; i++)
+            npending += chips[i].pending;
+        if (npending == 0 || time_nsec() >= drain)
+            break;
+        hid_async_wait(drain);
+    }
+    close_tick();
+    emit(~0ULL);
+    if (out != stdout)
+        fclose(out);
+
+    fprintf(stderr, "Acquired %lu ticks from %d chips, spread within tick %.0f usec mean, %.0f usec max.\n",
+        ntick, nchips, nspread ? spread_sum / nspread : 0, spread_max);
+    for (i=0; i<nchips; i++) {
+        chip_t *c = &chips[i];
+        double mean = c->nskew ? c->skew_sum / c->nskew : 0;
+        double var = c->nskew ? c->skew_sum2 / c->nskew - mean * mean : 0;
+
+        fprintf(stderr, "%s: %lu samples, %lu missed, %lu failed, %lu late, %lu dropped; skew %+.0f usec mean, %.0f usec deviation, %+.0f usec max; uncertainty %.0f usec mean.\n",
+            hid_async_serial(c->dev), c->nsamples, c->nmissed, c->nfailed, c->nlate, c->ndropped,
+            mean, var > 0 ? sqrt(var) : 0, c->skew_max,
+            c->nsamples ? c->err_sum / c->nsamples : 0);
+        ts_destroy(c->ts);
+        hid_async_close(c->dev);
+    }
+}
@@ -0,0 +1,315 @@
+/*
+ * Asynchronous requests to MCP2221 chips, via libusb-1.0.
+ *
+ * Every device has a queue of requests.  Only the head of the queue
+ * is in flight: the chip answers one report at a time.  Two transfers
+ * per device are allocated on open and reused for all requests;
+ * they point directly to data[] and reply[] of the request.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+#include "async.h"
+#include "usbdev.h"
+#include "util.h"
+
+#define HID_INTERFACE       2               // HID interface index
+#define BULK_WRITE_ENDPOINT 0x03            // output to HID device
+#define BULK_READ_ENDPOINT  0x83            // input from HID device
+#define MAX_POLLFDS         16              // descriptors for hid_async_wait()
+
+struct hid_device {
+    hid_device_t *next;                     // list of opened devices
+    libusb_device_handle *handle;           // libusb device
+    struct libusb_transfer *out;            // transfer for request
+    struct libusb_transfer *in;             // transfer for reply
+    hid_request_t *head, *tail;             // queue of requests
+    struct libusb_transfer *active;         // transfer in flight, or 0
+    int busy;                               // head request is in flight
+    int closing;                            // do not start new requests
+    int bus, address;                       // location on USB
+    char serial[64];                        // serial number
+};
+
+static libusb_context *ctx;                 // shared by all devices
+static hid_device_t *devices;               // opened devices
+
+static void start(hid_device_t *dev);
+
+//
+// Remove the head request from queue, invoke the callback,
+// then start next request.  Callbacks are called in order
+// of submission, even when the next request fails at once.
+//
+static void complete(hid_device_t *dev, int status)
+{
+    hid_request_t *req = dev->head;
+
+    dev->busy = 0;
+    dev->active = 0;
+    dev->head = req->next;
+    if (!dev->head)
+        dev->tail = 0;
+    req->next = 0;
+    req->status = status;
+
+    if (status < 0 && trace_flag)
+        fprintf(stderr, "%s: Request %#x failed\n", dev->serial, req->data[0]);
+    req->callback(req);
+    start(dev);
+}
+
+//
+// Reply has been received.
+//
+static void reply_done(struct libusb_transfer *transfer)
+{
+    hid_device_t *dev = transfer->user_data;
+
+    dev->head->t_recv = time_nsec();
+    complete(dev, (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+        transfer->actual_length == 64) ? 0 : -1);
+}
+
+//
+// Request has been sent: wait for the reply.
+//
+static void request_done(struct libusb_transfer *transfer)
+{
+    hid_device_t *dev = transfer->user_data;
+    unsigned long long elapsed;
+    unsigned limit;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        complete(dev, -1);
+        return;
+    }
+    // Reply must come within the deadline of the whole request.
+    dev->head->t_written = time_nsec();
+    elapsed = (dev->head->t_written - dev->head->t_send) / 1000000;
+    limit = hid_get_deadline(dev->head->data[0]);
+    libusb_fill_bulk_transfer(dev->in, dev->handle, BULK_READ_ENDPOINT,
+        dev->head->reply, 64, reply_done, dev, (elapsed < limit) ? limit - elapsed : 1);
+    if (libusb_submit_transfer(dev->in) < 0) {
+        complete(dev, -1);
+        return;
+    }
+    dev->active = dev->in;
+}
+
+//
+// Send the head request, when the device is idle.
+//
+static void start(hid_device_t *dev)
+{
+    if (dev->busy || dev->closing || !dev->head)
+        return;
+
+    dev->head->t_send = time_nsec();
+    dev->head->t_written = 0;
+    dev->head->t_recv = 0;
+    libusb_fill_bulk_transfer(dev->out, dev->handle, BULK_WRITE_ENDPOINT,
+        dev->head->data, 64, request_done, dev, hid_get_deadline(dev->head->data[0]));
+    if (libusb_submit_transfer(dev->out) < 0) {
+        complete(dev, -1);
+        return;
+    }
+    dev->active = dev->out;
+    dev->busy = 1;
+}
+
+void hid_async_submit(hid_device_t *dev, hid_request_t *req)
+{
+    req->next = 0;
+    if (dev->tail)
+        dev->tail->next = req;
+    else
+        dev->head = req;
+    dev->tail = req;
+    start(dev);
+}
+
+//
+// Is the device already opened?
+//
+static int is_opened(libusb_device *device)
+{
+    int bus = libusb_get_bus_number(device);
+    int address = libusb_get_device_address(device);
+    hid_device_t *dev;
+
+    for (dev = devices; dev; dev = dev->next)
+        if (dev->bus == bus && dev->address == address)
+            return 1;
+    return 0;
+}
+
+hid_device_t *hid_async_open(int vid, int pid, const char *serial)
+{
+    libusb_device_handle *handle;
+    hid_device_t *dev;
+    char found[64];
+
+    if (!ctx) {
+        int error = libusb_init(&ctx);
+        if (error < 0) {
+            fprintf(stderr, "libusb init failed: %d: %s\n",
+                error, libusb_strerror(error));
+            exit(-1);
+        }
+    }
+
+    handle = usb_open_device(ctx, vid, pid, serial, is_opened, found, sizeof(found));
+    if (!handle)
+        return 0;
+
+    if (libusb_kernel_driver_active(handle, HID_INTERFACE))
+        libusb_detach_kernel_driver(handle, HID_INTERFACE);
+    int error = libusb_claim_interface(handle, HID_INTERFACE);
+    if (error < 0) {
+        fprintf(stderr, "Failed to claim USB interface: %d: %s\n",
+            error, libusb_strerror(error));
+        libusb_close(handle);
+        return 0;
+    }
+
+    dev = calloc(1, sizeof(*dev));
+    if (!dev) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    dev->handle = handle;
+    dev->bus = libusb_get_bus_number(libusb_get_device(handle));
+    dev->address = libusb_get_device_address(libusb_get_device(handle));
+    strcpy(dev->serial, found);
+    dev->out = libusb_alloc_transfer(0);
+    dev->in = libusb_alloc_transfer(0);
+    if (!dev->out || !dev->in) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    dev->next = devices;
+    devices = dev;
+    return dev;
+}
+
+int hid_async_open_all(int vid, int pid, hid_device_t **list, int maxdev)
+{
+    int n;
+
+    for (n = 0; n < maxdev; n++) {
+        list[n] = hid_async_open(vid, pid, "");
+        if (!list[n])
+            break;
+    }
+    return n;
+}
+
+void hid_async_close(hid_device_t *dev)
+{
+    hid_device_t **link;
+
+    // Let the transfer in flight finish, then fail the rest.
+    dev->closing = 1;
+    if (dev->busy) {
+        libusb_cancel_transfer(dev->active);
+        while (dev->busy)
+            libusb_handle_events(ctx);
+    }
+    while (dev->head)
+        complete(dev, -1);
+
+    for (link = &devices; *link; link = &(*link)->next) {
+        if (*link == dev) {
+            *link = dev->next;
+            break;
+        }
+    }
+    libusb_free_transfer(dev->out);
+    libusb_free_transfer(dev->in);
+    libusb_release_interface(dev->handle, HID_INTERFACE);
+    libusb_close(dev->handle);
+    free(dev);
+
+    if (!devices) {
+        libusb_exit(ctx);
+        ctx = 0;
+    }
+}
+
+const char *hid_async_serial(hid_device_t *dev)
+{
+    return dev->serial;
+}
+
+int hid_async_pollfds(struct pollfd *fds, int maxfds)
+{
+    const struct libusb_pollfd **list;
+    int n;
+
+    if (!ctx)
+        return 0;
+    list = libusb_get_pollfds(ctx);
+    if (!list)
+        return 0;
+    for (n = 0; list[n] && n < maxfds; n++) {
+        fds[n].fd = list[n]->fd;
+        fds[n].events = list[n]->events;
+        fds[n].revents = 0;
+    }
+    libusb_free_pollfds(list);
+    return n;
+}
+
+int hid_async_timeout()
+{
+    struct timeval tv;
+
+    if (!ctx || libusb_get_next_timeout(ctx, &tv) != 1)
+        return -1;
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+void hid_async_dispatch()
+{
+    struct timeval tv = { 0, 0 };
+
+    if (ctx)
+        libusb_handle_events_timeout(ctx, &tv);
+}
+
+void hid_async_wait(unsigned long long until)
+{
+    struct pollfd fds[MAX_POLLFDS];
+    unsigned long long now = time_nsec();
+    int nfds, timeout, t;
+
+    nfds = hid_async_pollfds(fds, MAX_POLLFDS);
+    timeout = (until > now) ? (until - now + 999999) / 1000000 : 0;
+    t = hid_async_timeout();
+    if (t >= 0 && t < timeout)
+        timeout = t;
+    poll(fds, nfds, timeout);
+    hid_async_dispatch();
+}
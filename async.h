@@ -0,0 +1,133 @@
+/*
+ * Asynchronous requests to MCP2221 chips, for embedding in event loops.
+ *
+ * The application owns the loop: it asks for file descriptors
+ * to watch and a timeout, waits in poll() together with its own
+ * sockets and timers, and then calls hid_async_dispatch().
+ * Completion callbacks are invoked from hid_async_dispatch(),
+ * on the caller's thread.  One thread can serve many devices:
+ *
+ *      hid_device_t *dev = hid_async_open(0x04d8, 0x00dd, "");
+ *      hid_request_t req = { .callback = done };
+ *
+ *      req.data[0] = MCP_CMD_STATUSSET;
+ *      hid_async_submit(dev, &req);
+ *      for (;;) {
+ *          struct pollfd fds[16];
+ *          int nfds = hid_async_pollfds(fds, 16);
+ *          poll(fds, nfds, hid_async_timeout());
+ *          hid_async_dispatch();
+ *      }
+ *
+ * Requests are owned by the caller and must stay valid until
+ * the callback is invoked.  Nothing is allocated per request.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <poll.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HID_ASYNC_MAXDEV    64          // devices opened at once
+
+typedef struct hid_device hid_device_t;
+typedef struct hid_request hid_request_t;
+
+//
+// Request to the device.
+// Fill data[] and callback, then submit.
+// Every command must have a reply; RESET is not allowed here.
+//
+struct hid_request {
+    hid_request_t *next;                // link in device queue
+    void (*callback)(hid_request_t *req);   // called on completion
+    void *arg;                          // for use by the caller
+    int status;                         // 0 = success, -1 = failed
+    unsigned char data[64];             // request
+    unsigned char reply[64];            // reply
+    unsigned long long t_send;          // request submitted to USB, by time_nsec()
+    unsigned long long t_written;       // request delivered to the device
+    unsigned long long t_recv;          // reply received
+};
+
+//
+// Open the device with given VID/PID and serial number.
+// Empty serial means the first device, which is not opened yet,
+// so calling it repeatedly opens all attached devices.
+// Return NULL when no device found.
+//
+hid_device_t *hid_async_open(int vid, int pid, const char *serial);
+
+//
+// Open all attached devices with given VID/PID, up to maxdev.
+// Return number of devices stored in list[].
+//
+int hid_async_open_all(int vid, int pid, hid_device_t **list, int maxdev);
+
+//
+// Close the device.  Pending requests are completed with status -1.
+// Must not be called from a completion callback.
+//
+void hid_async_close(hid_device_t *dev);
+
+//
+// Get serial number of the device.
+//
+const char *hid_async_serial(hid_device_t *dev);
+
+//
+// Queue the request.  Requests to one device are executed in order.
+//
+void hid_async_submit(hid_device_t *dev, hid_request_t *req);
+
+//
+// Get file descriptors to watch.  The set can change when devices
+// are opened or closed, so call it before every poll().
+// Return number of descriptors stored.
+//
+int hid_async_pollfds(struct pollfd *fds, int maxfds);
+
+//
+// Get timeout for poll() in milliseconds, or -1 when no timeout needed.
+//
+int hid_async_timeout(void);
+
+//
+// Handle events without blocking, and invoke completion callbacks.
+//
+void hid_async_dispatch(void);
+
+//
+// Wait for USB events, but not past the given time (by time_nsec()),
+// and dispatch them.  For loops which have no descriptors of their own.
+//
+void hid_async_wait(unsigned long long until);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ASYNC_H */
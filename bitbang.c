@@ -0,0 +1,259 @@
+/*
+ * Bit-bang engine for slow serial protocols on GP0-GP3 pins.
+ *
+ * A transaction is first compiled into a list of SETGPIO and
+ * GETGPIO reports, and then sent to the chip as one batch.
+ * While compiling, changes of several pins between two clock edges
+ * are merged into one SETGPIO report, and steps which change
+ * nothing are dropped.  The batch goes out back to back, so every
+ * report takes one USB round trip, without the overhead of
+ * a separate tool invocation per pin change.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcp2221.h"
+#include "util.h"
+
+#define NPINS       4
+#define UNKNOWN     0xff            // pin state before the first report
+
+//
+// Compiled transaction.
+//
+typedef struct {
+    uint8_t value[NPINS];           // pin outputs after the last report
+    uint8_t dir[NPINS];             // pin directions after the last report
+    uint8_t want_value[NPINS];      // requested outputs
+    uint8_t want_dir[NPINS];        // requested directions
+    unsigned char *reqs;            // reports, 64 bytes each
+    unsigned char *replies;         // room for replies, 64 bytes each
+    signed char *sample;            // for every report: pin to sample, or -1
+    unsigned nreports;              // number of reports
+    unsigned size;                  // allocated reports
+    unsigned touched;               // pins updated since the last step
+    unsigned nredundant;            // updates which changed nothing
+} bitbang_t;
+
+static void bb_init(bitbang_t *bb)
+{
+    memset(bb, 0, sizeof(*bb));
+    memset(bb->value, UNKNOWN, sizeof(bb->value));
+    memset(bb->dir, UNKNOWN, sizeof(bb->dir));
+    memset(bb->want_value, UNKNOWN, sizeof(bb->want_value));
+    memset(bb->want_dir, UNKNOWN, sizeof(bb->want_dir));
+}
+
+static unsigned char *bb_append(bitbang_t *bb, int code, int sample_pin)
+{
+    unsigned char *r;
+
+    if (bb->nreports >= bb->size) {
+        bb->size = bb->size ? bb->size * 2 : 256;
+        bb->reqs = realloc(bb->reqs, bb->size * 64);
+        bb->replies = realloc(bb->replies, bb->size * 64);
+        bb->sample = realloc(bb->sample, bb->size);
+        if (!bb->reqs || !bb->replies || !bb->sample) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+    }
+    r = &bb->reqs[bb->nreports * 64];
+    memset(r, 0, 64);
+    r[0] = code;
+    bb->sample[bb->nreports++] = sample_pin;
+    return r;
+}
+
+//
+// Request new output value of the pin; takes effect at next step.
+//
+static void bb_set(bitbang_t *bb, int pin, int value)
+{
+    if (pin >= 0) {
+        bb->want_value[pin] = (value != 0);
+        bb->touched |= 1 << pin;
+    }
+}
+
+//
+// Request new direction of the pin: 0 = output, 1 = input.
+//
+static void bb_direction(bitbang_t *bb, int pin, int input)
+{
+    if (pin >= 0) {
+        bb->want_dir[pin] = (input != 0);
+        bb->touched |= 0x10 << pin;
+    }
+}
+
+//
+// Apply all requested changes in one SETGPIO report.
+// Pins which already have the requested state are not altered,
+// and when nothing changed, no report is generated.
+//
+static void bb_step(bitbang_t *bb)
+{
+    mcp_cmd_set_gpio_t *r = 0;
+    int pin;
+
+    for (pin=0; pin<NPINS; pin++) {
+        int new_value = bb->want_value[pin] != UNKNOWN && bb->want_value[pin] != bb->value[pin];
+        int new_dir = bb->want_dir[pin] != UNKNOWN && bb->want_dir[pin] != bb->dir[pin];
+
+        if ((bb->touched & (1 << pin)) && !new_value)
+            bb->nredundant++;
+        if ((bb->touched & (0x10 << pin)) && !new_dir)
+            bb->nredundant++;
+        if (!new_value && !new_dir)
+            continue;
+        if (!r)
+            r = (mcp_cmd_set_gpio_t*) bb_append(bb, MCP_CMD_SETGPIO, -1);
+        if (new_value) {
+            r->gp[pin].alter_value = 1;
+            r->gp[pin].value = bb->value[pin] = bb->want_value[pin];
+        }
+        if (new_dir) {
+            r->gp[pin].alter_direction = 1;
+            r->gp[pin].direction = bb->dir[pin] = bb->want_dir[pin];
+        }
+    }
+    bb->touched = 0;
+}
+
+//
+// Apply pending changes, then read the input pin.
+//
+static void bb_sample(bitbang_t *bb, int pin)
+{
+    bb_step(bb);
+    bb_append(bb, MCP_CMD_GETGPIO, pin);
+}
+
+//
+// Send the compiled reports to the chip.
+// Store sampled bits into bits[], one per byte.
+// Return the number of sampled bits.
+// Room for replies is allocated together with the reports,
+// so nothing is allocated while the transfer runs.
+//
+static unsigned bb_run(bitbang_t *bb, uint8_t *bits, mcp_bitbang_stats_t *stats)
+{
+    unsigned long long t0;
+    unsigned i, nbits = 0;
+
+    t0 = time_nsec();
+    mcp_execute_batch(bb->reqs, bb->nreports, bb->replies);
+    stats->nsec = time_nsec() - t0;
+
+    for (i=0; i<bb->nreports; i++) {
+        if (bb->sample[i] >= 0) {
+            const mcp_reply_gpio_t *r = (const mcp_reply_gpio_t*) &bb->replies[i * 64];
+
+            bits[nbits++] = (&r->gp0_pin)[2 * bb->sample[i]] & 1;
+        }
+    }
+    stats->nreports = bb->nreports;
+    stats->nredundant = bb->nredundant;
+    return nbits;
+}
+
+static void bb_free(bitbang_t *bb)
+{
+    free(bb->reqs);
+    free(bb->replies);
+    free(bb->sample);
+}
+
+//
+// SPI transfer: send nbytes from tx[] MSB first, and receive
+// the same number of bytes into rx[], when MISO pin is given.
+// Mode is 0-3: bit 1 = clock polarity, bit 0 = clock phase.
+// Chip select, when given, is active low for the whole transfer.
+//
+void mcp_spi_transfer(const mcp_spi_pins_t *pins, int mode,
+    const uint8_t *tx, uint8_t *rx, int nbytes, mcp_bitbang_stats_t *stats)
+{
+    int cpol = (mode >> 1) & 1, cpha = mode & 1;
+    uint8_t *bits = malloc(nbytes * 8 + 1);
+    bitbang_t bb;
+    int i, b, bit;
+
+    if (!bits) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    bb_init(&bb);
+
+    // Idle state: clock at its polarity, chip deselected.
+    bb_direction(&bb, pins->sck, 0);
+    bb_direction(&bb, pins->mosi, 0);
+    bb_direction(&bb, pins->miso, 1);
+    bb_direction(&bb, pins->cs, 0);
+    bb_set(&bb, pins->sck, cpol);
+    bb_set(&bb, pins->cs, 1);
+    bb_step(&bb);
+    bb_set(&bb, pins->cs, 0);
+
+    for (i=0; i<nbytes; i++) {
+        for (b=7; b>=0; b--) {
+            bit = (tx[i] >> b) & 1;
+            if (cpha == 0) {
+                // Data out before the leading edge, sample after it.
+                bb_set(&bb, pins->mosi, bit);
+                bb_step(&bb);
+                bb_set(&bb, pins->sck, !cpol);
+                if (pins->miso >= 0)
+                    bb_sample(&bb, pins->miso);
+                else
+                    bb_step(&bb);
+                bb_set(&bb, pins->sck, cpol);
+            } else {
+                // Data out on the leading edge, sample after the trailing edge.
+                bb_set(&bb, pins->sck, !cpol);
+                bb_set(&bb, pins->mosi, bit);
+                bb_step(&bb);
+                bb_set(&bb, pins->sck, cpol);
+                if (pins->miso >= 0)
+                    bb_sample(&bb, pins->miso);
+                else
+                    bb_step(&bb);
+            }
+        }
+    }
+
+    // Trailing clock edge and deselect go in the same report.
+    bb_set(&bb, pins->cs, 1);
+    bb_step(&bb);
+
+    if (bb_run(&bb, bits, stats) > 0 && rx) {
+        for (i=0; i<nbytes; i++) {
+            rx[i] = 0;
+            for (b=0; b<8; b++)
+                rx[i] = rx[i] << 1 | bits[i*8 + b];
+        }
+    }
+    stats->nbits = nbytes * 8;
+    bb_free(&bb);
+    free(bits);
+}
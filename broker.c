@@ -0,0 +1,474 @@
+/*
+ * I2C broker: share one MCP2221 chip between many local clients.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "mcp2221.h"
+#include "broker.h"
+#include "util.h"
+
+#define MAX_CLIENTS     64              // simultaneous connections
+#define QUEUE_DEPTH     16              // pending transactions per client
+#define AGING_NSEC      50000000ULL     // raise priority every 50 msec of waiting
+#define OUT_SIZE        (QUEUE_DEPTH * (sizeof(mcpbroker_reply_t) + MCPBROKER_MAXDATA))
+
+//
+// Pending I2C transaction.
+//
+typedef struct {
+    mcpbroker_request_t req;
+    mcpbroker_msg_t msg[MCPBROKER_MAXMSGS];
+    uint8_t wdata[MCPBROKER_MAXDATA];
+    int rlength;                        // total length of read data
+    unsigned long long arrived;         // time of arrival
+} txn_t;
+
+//
+// Connected client.
+//
+typedef struct {
+    int fd;
+    int rlen;                           // bytes in input buffer
+    uint8_t rbuf[sizeof(mcpbroker_request_t) +
+                 MCPBROKER_MAXMSGS * sizeof(mcpbroker_msg_t) +
+                 MCPBROKER_MAXDATA];
+    txn_t queue[QUEUE_DEPTH];           // circular queue of transactions
+    int qhead;                          // index of first transaction
+    int qcount;                         // number of pending transactions
+    int wlen;                           // bytes in output buffer
+    int failed;                         // connection lost: drop it
+    int overflow;                       // replies not read: drop it
+    uint8_t wbuf[OUT_SIZE];             // replies not yet sent
+} client_t;
+
+static client_t *clients[MAX_CLIENTS];
+static int next_client;                 // round-robin position
+
+//
+// Statistics per priority level.
+//
+static struct {
+    unsigned long count;                // completed transactions
+    unsigned long long total_nsec;      // sum of latencies
+    unsigned long long max_nsec;        // worst latency
+} prio_stats[MCPBROKER_MAXPRIO + 1];
+static unsigned long ncoalesced;
+
+//
+// Send as much of the output buffer as the socket accepts now.
+// The socket is non-blocking: a client which does not read
+// its replies must not stall the others.
+//
+static void flush_output(client_t *c)
+{
+    int n;
+
+    while (c->wlen > 0) {
+        n = send(c->fd, c->wbuf, c->wlen, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            c->failed = 1;
+            break;
+        }
+        c->wlen -= n;
+        memmove(c->wbuf, c->wbuf + n, c->wlen);
+    }
+}
+
+static void send_reply(client_t *c, uint32_t id, int status, int failed_msg,
+    const uint8_t *rdata, int rlength)
+{
+    mcpbroker_reply_t reply;
+
+    reply.id = id;
+    reply.status = status;
+    reply.failed_msg = failed_msg;
+    reply.rlength = (status == MCPBROKER_OK) ? rlength : 0;
+    if (c->failed || c->overflow)
+        return;
+    if (c->wlen + sizeof(reply) + reply.rlength > sizeof(c->wbuf)) {
+        c->overflow = 1;
+        return;
+    }
+    memcpy(c->wbuf + c->wlen, &reply, sizeof(reply));
+    memcpy(c->wbuf + c->wlen + sizeof(reply), rdata, reply.rlength);
+    c->wlen += sizeof(reply) + reply.rlength;
+    flush_output(c);
+}
+
+static void drop_client(int index)
+{
+    if (trace_flag)
+        fprintf(stderr, "Client %d disconnected.\n", index);
+    close(clients[index]->fd);
+    free(clients[index]);
+    clients[index] = 0;
+}
+
+//
+// Check that the transaction can be executed by MCP2221:
+// one message, or a write followed by write or read.
+// Compute length of read data.
+//
+static int validate(txn_t *t)
+{
+    int i, wlength = 0;
+
+    t->rlength = 0;
+    if (t->req.nmsgs == 0 || t->req.nmsgs > MCPBROKER_MAXMSGS ||
+        t->req.priority > MCPBROKER_MAXPRIO)
+        return -1;
+    for (i=0; i<t->req.nmsgs; i++) {
+        if (t->msg[i].length == 0 || t->msg[i].addr > 0x7f)
+            return -1;
+        if (t->msg[i].flags & MCPBROKER_READ) {
+            if (i != t->req.nmsgs - 1)
+                return -1;
+            t->rlength += t->msg[i].length;
+        } else {
+            wlength += t->msg[i].length;
+        }
+    }
+    if (wlength != t->req.wlength || t->rlength > MCPBROKER_MAXDATA)
+        return -1;
+    return 0;
+}
+
+//
+// Parse requests from input buffer of the client.
+// Return -1 when the stream is corrupted.
+//
+static int parse_requests(client_t *c)
+{
+    while (c->qcount < QUEUE_DEPTH && c->rlen >= sizeof(mcpbroker_request_t)) {
+        mcpbroker_request_t *req = (mcpbroker_request_t*) c->rbuf;
+        int mlen, need;
+
+        if (req->nmsgs > MCPBROKER_MAXMSGS || req->wlength > MCPBROKER_MAXDATA)
+            return -1;
+        mlen = req->nmsgs * sizeof(mcpbroker_msg_t);
+        need = sizeof(*req) + mlen + req->wlength;
+        if (c->rlen < need)
+            break;
+
+        txn_t *t = &c->queue[(c->qhead + c->qcount) % QUEUE_DEPTH];
+        t->req = *req;
+        memcpy(t->msg, c->rbuf + sizeof(*req), mlen);
+        memcpy(t->wdata, c->rbuf + sizeof(*req) + mlen, req->wlength);
+        t->arrived = time_nsec();
+
+        c->rlen -= need;
+        memmove(c->rbuf, c->rbuf + need, c->rlen);
+
+        if (validate(t) < 0) {
+            send_reply(c, t->req.id, MCPBROKER_INVALID, 0, 0, 0);
+            continue;
+        }
+        c->qcount++;
+    }
+    return 0;
+}
+
+//
+// Execute the transaction on the I2C bus.
+// Return status and index of failed message.
+//
+static int execute(txn_t *t, uint8_t *rdata, int *failed_msg)
+{
+    const uint8_t *wptr = t->wdata;
+    int i, cmd, n = t->req.nmsgs;
+
+    for (i=0; i<n; i++) {
+        mcpbroker_msg_t *m = &t->msg[i];
+        int last = (i == n-1);
+
+        if (m->flags & MCPBROKER_READ) {
+            // Read is always last; it terminates the transaction with stop.
+            cmd = (i == 0) ? MCP_CMD_I2CREAD : MCP_CMD_I2CREAD_REPEATSTART;
+            if (mcp_i2c_read(cmd, m->addr, rdata, m->length) < 0)
+                goto failed;
+        } else {
+            // Only the first message can leave the bus held.
+            cmd = !last ? MCP_CMD_I2CWRITE_NOSTOP :
+                  (i == 0) ? MCP_CMD_I2CWRITE : MCP_CMD_I2CWRITE_REPEATSTART;
+            if (mcp_i2c_write(cmd, m->addr, wptr, m->length) < 0)
+                goto failed;
+            wptr += m->length;
+        }
+    }
+    return MCPBROKER_OK;
+
+failed:
+    *failed_msg = i;
+    return MCPBROKER_NACK;
+}
+
+//
+// Are two transactions the same on the bus?
+//
+static int same_transaction(txn_t *a, txn_t *b)
+{
+    return a->req.nmsgs == b->req.nmsgs &&
+           a->req.wlength == b->req.wlength &&
+           memcmp(a->msg, b->msg, a->req.nmsgs * sizeof(mcpbroker_msg_t)) == 0 &&
+           memcmp(a->wdata, b->wdata, a->req.wlength) == 0;
+}
+
+static void account(txn_t *t, unsigned long long now)
+{
+    unsigned long long latency = now - t->arrived;
+    int prio = t->req.priority;
+
+    prio_stats[prio].count++;
+    prio_stats[prio].total_nsec += latency;
+    if (latency > prio_stats[prio].max_nsec)
+        prio_stats[prio].max_nsec = latency;
+}
+
+//
+// Select the next transaction and execute it.
+// The highest priority wins; waiting transactions get aged,
+// so low priorities cannot starve.  Clients of equal priority
+// are served in round-robin order.
+// Return 0 when nothing is pending.
+//
+static int schedule()
+{
+    unsigned long long now = time_nsec();
+    int i, k, best = -1, best_prio = -1;
+
+    for (k=0; k<MAX_CLIENTS; k++) {
+        i = (next_client + k) % MAX_CLIENTS;
+        client_t *c = clients[i];
+        if (!c || c->qcount == 0)
+            continue;
+
+        txn_t *t = &c->queue[c->qhead];
+        int prio = t->req.priority + (now - t->arrived) / AGING_NSEC;
+        if (prio > best_prio) {
+            best_prio = prio;
+            best = i;
+        }
+    }
+    if (best < 0)
+        return 0;
+    next_client = (best + 1) % MAX_CLIENTS;
+
+    client_t *c = clients[best];
+    txn_t *t = &c->queue[c->qhead];
+    uint8_t rdata[MCPBROKER_MAXDATA];
+    int failed_msg = 0;
+    int status = execute(t, rdata, &failed_msg);
+
+    now = time_nsec();
+    send_reply(c, t->req.id, status, failed_msg, rdata, t->rlength);
+    account(t, now);
+
+    // Identical side-effect free requests, waiting at the heads
+    // of other queues, get the same result without bus traffic.
+    if (t->req.flags & MCPBROKER_SHARED) {
+        for (i=0; i<MAX_CLIENTS; i++) {
+            client_t *other = clients[i];
+            if (!other || other == c || other->qcount == 0)
+                continue;
+
+            txn_t *o = &other->queue[other->qhead];
+            if (!(o->req.flags & MCPBROKER_SHARED) || !same_transaction(t, o))
+                continue;
+
+            send_reply(other, o->req.id, status, failed_msg, rdata, t->rlength);
+            account(o, now);
+            other->qhead = (other->qhead + 1) % QUEUE_DEPTH;
+            other->qcount--;
+            ncoalesced++;
+
+            // Input buffer could hold requests which did not fit the queue.
+            if (parse_requests(other) < 0)
+                drop_client(i);
+        }
+    }
+    c->qhead = (c->qhead + 1) % QUEUE_DEPTH;
+    c->qcount--;
+    if (parse_requests(c) < 0)
+        drop_client(best);
+    return 1;
+}
+
+static void print_stats()
+{
+    int prio;
+
+    for (prio=MCPBROKER_MAXPRIO; prio>=0; prio--) {
+        if (prio_stats[prio].count == 0)
+            continue;
+        fprintf(stderr, "Priority %d: %lu transactions, latency avg %.3f msec, max %.3f msec\n",
+            prio, prio_stats[prio].count,
+            prio_stats[prio].total_nsec / prio_stats[prio].count / 1e6,
+            prio_stats[prio].max_nsec / 1e6);
+    }
+    if (ncoalesced > 0)
+        fprintf(stderr, "Coalesced: %lu transactions\n", ncoalesced);
+}
+
+//
+// Serve I2C transactions from clients connected to Unix socket.
+//
+void mcp_broker(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    struct pollfd fds[MAX_CLIENTS + 1];
+    int index[MAX_CLIENTS + 1];
+    int sock, i, n, nfds, pending;
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(-1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // Remove stale socket of previous run, but nothing else.
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s: Exists and is not a socket.\n", path);
+            exit(-1);
+        }
+        unlink(path);
+    }
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(sock, 16) < 0)
+    {
+        fprintf(stderr, "%s: Cannot listen: %s\n", path, strerror(errno));
+        exit(-1);
+    }
+    catch_stop_signals();
+    fprintf(stderr, "Serving I2C transactions on %s\n", path);
+
+    pending = 0;
+    while (!stop_flag) {
+        // Listen to all clients which have room in their queues,
+        // and wait for room in sockets with unsent replies.
+        fds[0].fd = sock;
+        fds[0].events = POLLIN;
+        nfds = 1;
+        for (i=0; i<MAX_CLIENTS; i++) {
+            client_t *c = clients[i];
+            if (!c)
+                continue;
+            if (c->overflow)
+                fprintf(stderr, "Client %d: Does not read replies.\n", i);
+            if (c->failed || c->overflow) {
+                drop_client(i);
+                continue;
+            }
+            fds[nfds].events = 0;
+            if (c->qcount < QUEUE_DEPTH)
+                fds[nfds].events |= POLLIN;
+            if (c->wlen > 0)
+                fds[nfds].events |= POLLOUT;
+            if (!fds[nfds].events)
+                continue;
+            fds[nfds].fd = c->fd;
+            index[nfds] = i;
+            nfds++;
+        }
+
+        // Do not block while transactions are waiting.
+        n = poll(fds, nfds, pending ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(sock, 0, 0);
+            if (fd >= 0) {
+                for (i=0; i<MAX_CLIENTS && clients[i]; i++)
+                    continue;
+                if (i < MAX_CLIENTS) {
+                    clients[i] = calloc(1, sizeof(client_t));
+                    if (!clients[i]) {
+                        fprintf(stderr, "Out of memory!\n");
+                        exit(-1);
+                    }
+                    clients[i]->fd = fd;
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    if (trace_flag)
+                        fprintf(stderr, "Client %d connected.\n", i);
+                } else {
+                    close(fd);
+                }
+            }
+        }
+
+        for (n=1; n<nfds; n++) {
+            if (!fds[n].revents)
+                continue;
+
+            client_t *c = clients[index[n]];
+            if (c->wlen > 0 && (fds[n].revents & (POLLOUT | POLLERR | POLLHUP)))
+                flush_output(c);
+            if (c->failed) {
+                drop_client(index[n]);
+                continue;
+            }
+            if (!(fds[n].events & POLLIN) ||
+                !(fds[n].revents & (POLLIN | POLLERR | POLLHUP)))
+                continue;
+
+            int len = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (len <= 0) {
+                drop_client(index[n]);
+                continue;
+            }
+            c->rlen += len;
+            if (parse_requests(c) < 0) {
+                fprintf(stderr, "Client %d: Bad request.\n", index[n]);
+                drop_client(index[n]);
+            }
+        }
+
+        pending = schedule();
+    }
+    close(sock);
+    unlink(path);
+    print_stats();
+}
@@ -0,0 +1,158 @@
+/*
+ * Protocol of I2C broker for MCP2221 chip.
+ *
+ * The broker (mcptool -b path) owns the device and serves I2C
+ * transactions from many local clients via a Unix domain socket.
+ * A transaction is a sequence of messages executed atomically:
+ * the bus is not released between them (repeated start), and no
+ * other client can intervene.  Due to MCP2221 restrictions, a
+ * transaction has at most two messages, and the first of two
+ * must be a write: the chip has no command for a repeated start
+ * which does not end with stop.
+ *
+ * Request:  mcpbroker_request_t, then nmsgs of mcpbroker_msg_t,
+ *           then data of all write messages.
+ * Reply:    mcpbroker_reply_t, then data of all read messages.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MCPBROKER_MAXMSGS   2           // messages per request
+#define MCPBROKER_MAXDATA   1024        // data bytes per transaction
+#define MCPBROKER_MAXPRIO   7           // highest priority
+
+#define MCPBROKER_READ      0x01        // message flag: read data
+
+#define MCPBROKER_SHARED    0x01        // request flag: the transaction has
+                                        // no side effects, so its result can
+                                        // be shared with identical requests
+                                        // of other clients
+
+//
+// Status of transaction.
+//
+enum {
+    MCPBROKER_OK            = 0,        // completed successfully
+    MCPBROKER_NACK          = 1,        // I2C transfer failed
+    MCPBROKER_INVALID       = 2,        // malformed request
+};
+
+#pragma pack(1)
+typedef struct {
+    uint32_t id;                        // tag, returned in reply
+    uint8_t  priority;                  // 0 = lowest, 7 = highest
+    uint8_t  flags;                     // MCPBROKER_SHARED
+    uint8_t  nmsgs;                     // number of messages
+    uint8_t  unused;                    // must be zero
+    uint16_t wlength;                   // total length of write data
+} mcpbroker_request_t;
+
+typedef struct {
+    uint8_t  addr;                      // 7-bit slave address
+    uint8_t  flags;                     // MCPBROKER_READ
+    uint16_t length;                    // number of bytes
+} mcpbroker_msg_t;
+
+typedef struct {
+    uint32_t id;                        // tag from request
+    uint8_t  status;                    // MCPBROKER_OK or error code
+    uint8_t  failed_msg;                // index of failed message
+    uint16_t rlength;                   // total length of read data
+} mcpbroker_reply_t;
+#pragma pack()
+
+//
+// Connect to the broker.
+// Return socket, or -1 on failure.
+//
+static inline int mcpbroker_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sock < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static inline int mcpbroker_io(int sock, void *buf, int len, int writing)
+{
+    char *ptr = (char*) buf;
+
+    while (len > 0) {
+        int n = writing ? write(sock, ptr, len) : read(sock, ptr, len);
+        if (n <= 0)
+            return -1;
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//
+// Execute a transaction and wait for the result.
+// Write data of all messages are taken from wdata[],
+// read data are stored into rdata[].
+// Return MCPBROKER_OK on success, other status on failure,
+// or -1 when connection is lost.
+//
+static inline int mcpbroker_transfer(int sock, int priority, int flags,
+    const mcpbroker_msg_t *msgs, int nmsgs, const void *wdata, void *rdata)
+{
+    mcpbroker_request_t req;
+    mcpbroker_reply_t reply;
+    int i, wlength = 0;
+
+    for (i=0; i<nmsgs; i++)
+        if (!(msgs[i].flags & MCPBROKER_READ))
+            wlength += msgs[i].length;
+
+    req.id = 0;
+    req.priority = priority;
+    req.flags = flags;
+    req.nmsgs = nmsgs;
+    req.unused = 0;
+    req.wlength = wlength;
+    if (mcpbroker_io(sock, &req, sizeof(req), 1) < 0 ||
+        mcpbroker_io(sock, (void*) msgs, nmsgs * sizeof(*msgs), 1) < 0 ||
+        mcpbroker_io(sock, (void*) wdata, wlength, 1) < 0 ||
+        mcpbroker_io(sock, &reply, sizeof(reply), 0) < 0 ||
+        mcpbroker_io(sock, rdata, reply.rlength, 0) < 0)
+        return -1;
+    return reply.status;
+}
+
+#endif /* BROKER_H */
@@ -0,0 +1,189 @@
+/*
+ * Table of MCP2221 requests, and generic executor.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcp2221.h"
+#include "util.h"
+
+const mcp_command_t mcp_commands[MCP_NREQUESTS] = {
+    [MCP_REQ_STATUS] = {
+        "STATUSSET", MCP_CMD_STATUSSET, 0, 1,
+        MCP_CHECK_STATUS, sizeof(mcp_reply_status_t) },
+    [MCP_REQ_CHIPSETTINGS] = {
+        "READFLASH CHIPSETTINGS", MCP_CMD_READFLASH, MCP_FLASH_CHIPSETTINGS, 2,
+        MCP_CHECK_STATUS | MCP_CHECK_NBYTES, sizeof(mcp_reply_chip_settings_t) },
+    [MCP_REQ_GPIOSETTINGS] = {
+        "READFLASH GPIOSETTINGS", MCP_CMD_READFLASH, MCP_FLASH_GPIOSETTINGS, 2,
+        MCP_CHECK_STATUS | MCP_CHECK_NBYTES, sizeof(mcp_reply_gpio_settings_t) },
+    [MCP_REQ_USBMANUFACTURER] = {
+        "READFLASH USBMANUFACTURER", MCP_CMD_READFLASH, MCP_FLASH_USBMANUFACTURER, 2,
+        MCP_CHECK_STATUS | MCP_CHECK_STRING, 64 },
+    [MCP_REQ_USBPRODUCT] = {
+        "READFLASH USBPRODUCT", MCP_CMD_READFLASH, MCP_FLASH_USBPRODUCT, 2,
+        MCP_CHECK_STATUS | MCP_CHECK_STRING, 64 },
+    [MCP_REQ_USBSERIAL] = {
+        "READFLASH USBSERIAL", MCP_CMD_READFLASH, MCP_FLASH_USBSERIAL, 2,
+        MCP_CHECK_STATUS | MCP_CHECK_STRING, 64 },
+    [MCP_REQ_FACTORYSERIAL] = {
+        "READFLASH FACTORYSERIAL", MCP_CMD_READFLASH, MCP_FLASH_FACTORYSERIAL, 2,
+        MCP_CHECK_STATUS | MCP_CHECK_DATA, 64 },
+    [MCP_REQ_GETSRAM] = {
+        "GETSRAM", MCP_CMD_GETSRAM, 0, 1,
+        MCP_CHECK_STATUS | MCP_CHECK_SRAM, sizeof(mcp_reply_sram_data_t) },
+    [MCP_REQ_GETGPIO] = {
+        "GETGPIO", MCP_CMD_GETGPIO, 0, 1,
+        MCP_CHECK_STATUS, sizeof(mcp_reply_gpio_t) },
+    [MCP_REQ_SETSRAM] = {
+        "SETSRAM", MCP_CMD_SETSRAM, 0, sizeof(mcp_cmd_set_sram_t),
+        MCP_CHECK_STATUS, 2 },
+    [MCP_REQ_SETGPIO] = {
+        "SETGPIO", MCP_CMD_SETGPIO, 0, sizeof(mcp_cmd_set_gpio_t),
+        MCP_CHECK_STATUS | MCP_CHECK_GPIO, sizeof(mcp_reply_set_gpio_t) },
+};
+
+//
+// Reply buffer, reused by all requests.
+//
+static union {
+    unsigned char bytes[64];
+    mcp_reply_status_t status;      // for alignment only
+} reply;
+
+//
+// Check the reply against the rules.
+// Return 1 when valid.
+//
+static int reply_valid(const mcp_command_t *c, const unsigned char *r)
+{
+    if (r[0] != c->code)
+        return 0;
+    if ((c->check & MCP_CHECK_STATUS) && r[1] != 0)
+        return 0;
+    if ((c->check & MCP_CHECK_NBYTES) && r[2] + 4 != c->size)
+        return 0;
+    if ((c->check & MCP_CHECK_SRAM) && r[2] + r[3] + 4 != c->size)
+        return 0;
+    if ((c->check & MCP_CHECK_STRING) && (r[2] + 2 > c->size || r[3] != 3))
+        return 0;
+    if ((c->check & MCP_CHECK_DATA) && r[2] + 4 > c->size)
+        return 0;
+    return 1;
+}
+
+//
+// Find the pin altered by SETGPIO request, which is not GPIO.
+// Return -1 when all altered pins are GPIO.
+//
+static int bad_gpio(const unsigned char *req, const unsigned char *r)
+{
+    const mcp_cmd_set_gpio_t *set = (const mcp_cmd_set_gpio_t*) req;
+    const mcp_reply_set_gpio_t *reply = (const mcp_reply_set_gpio_t*) r;
+    int pin;
+
+    for (pin=0; pin<4; pin++) {
+        if ((set->gp[pin].alter_value && reply->gp[pin].value == MCP_GPIO_NOT_GPIO) ||
+            (set->gp[pin].alter_direction && reply->gp[pin].direction == MCP_GPIO_NOT_GPIO))
+            return pin;
+    }
+    return -1;
+}
+
+//
+// Find the table entry for the report: by command code,
+// and by subcode for requests which have it.
+//
+static const mcp_command_t *lookup(const unsigned char *req)
+{
+    int i;
+
+    for (i=0; i<MCP_NREQUESTS; i++) {
+        const mcp_command_t *c = &mcp_commands[i];
+
+        if (c->code == req[0] && (c->length != 2 || c->subcode == req[1]))
+            return c;
+    }
+    return 0;
+}
+
+const void *mcp_execute(int req)
+{
+    const mcp_command_t *c = &mcp_commands[req];
+    unsigned char cmd[2] = { c->code, c->subcode };
+
+    if (c->length > sizeof(cmd)) {
+        fprintf(stderr, "Request %s needs data, use a batch!\n", c->name);
+        exit(-1);
+    }
+    hid_send_recv(cmd, c->length, reply.bytes, sizeof(reply.bytes));
+    if (!reply_valid(c, reply.bytes)) {
+        fprintf(stderr, "Bad reply from %s request!\n", c->name);
+        exit(-1);
+    }
+    return reply.bytes;
+}
+
+void mcp_execute_batch(const unsigned char *reqs, unsigned count, unsigned char *replies)
+{
+    const mcp_command_t *c;
+    unsigned i;
+    int pin;
+
+    for (i=0; i<count; i++) {
+        if (!lookup(&reqs[i * 64])) {
+            fprintf(stderr, "Unknown request %#x in batch!\n", reqs[i * 64]);
+            exit(-1);
+        }
+    }
+    hid_send_batch(reqs, count, replies);
+
+    for (i=0; i<count; i++) {
+        c = lookup(&reqs[i * 64]);
+        if (!reply_valid(c, &replies[i * 64])) {
+            fprintf(stderr, "Bad reply from %s request!\n", c->name);
+            exit(-1);
+        }
+        if ((c->check & MCP_CHECK_GPIO) &&
+            (pin = bad_gpio(&reqs[i * 64], &replies[i * 64])) >= 0) {
+            fprintf(stderr, "Pin GP%d is not configured as GPIO.\n", pin);
+            exit(-1);
+        }
+    }
+}
+
+//
+// Get chip status.
+//
+void mcp_get_status(mcp_reply_status_t *status)
+{
+    memcpy(status, mcp_execute(MCP_REQ_STATUS), sizeof(*status));
+}
+
+//
+// Get GPIO values.
+//
+void mcp_get_gpio(mcp_reply_gpio_t *gpio)
+{
+    memcpy(gpio, mcp_execute(MCP_REQ_GETGPIO), sizeof(*gpio));
+}
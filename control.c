@@ -0,0 +1,341 @@
+/*
+ * Closed-loop control: ADC input, DAC or GPIO output.
+ *
+ * Every period, one batch of USB reports is sent to the chip:
+ * the output computed in the previous period (SETSRAM for DAC,
+ * SETGPIO for a pin), followed by STATUSSET to read the ADC.
+ * The chip answers one report at a time, so a period which changes
+ * the output costs two round trips, and a period without change
+ * costs one: the output report is omitted when the value stays.
+ * The batch only saves the wakeup of the caller between the two.
+ * The new output takes effect at the start of the next period.
+ *
+ * Controller is specified as the input channel with parameters:
+ *
+ *      adc0,set=512,out=gp1                bang-bang, hysteresis 4
+ *      adc0,set=512,out=gp1,hyst=10,reverse
+ *      adc1,set=300,out=dac,kp=0.1,ki=0.5  PID on DAC value 0-31
+ *
+ * Bang-bang switches the output on below set-hyst and off above
+ * set+hyst; "reverse" swaps the sense, for cooling.  PID is used
+ * when any of kp, ki, kd is given; integral and derivative gains
+ * are per second, and the integral stops growing while the output
+ * is saturated.  On exit, the output is switched off.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcp2221.h"
+#include "util.h"
+
+#define DEFAULT_HYST    4
+#define DAC_MAX         31          // DAC value is 5 bits
+#define OUT_DAC         -1          // output to DAC instead of GPx pin
+
+typedef struct {
+    int channel;                    // ADC channel 0-2
+    int out;                        // GPx pin 0-3, or OUT_DAC
+    int setpoint;                   // target ADC value
+    int hyst;                       // bang-bang margin around setpoint
+    int reverse;                    // output lowers the input
+    int pid;                        // PID instead of bang-bang
+    double kp, ki, kd;              // PID gains
+    double integral;                // PID integral term, in output units
+    int prev_value;                 // input at previous period
+} control_t;
+
+typedef struct {
+    unsigned long ncycles;          // periods completed
+    unsigned long nmissed;          // periods which overran the deadline
+    double sum;                     // of period lengths, usec
+    double sum_dev;                 // of period deviations from interval, usec
+    double min, max;                // shortest and longest period, usec
+    unsigned long long max_late;    // worst start after deadline, nsec
+    unsigned long nwrites;          // periods which changed the output
+    double exchange_read;           // of USB time in periods without write, usec
+    double exchange_write;          // of USB time in periods with write, usec
+} loop_stats_t;
+
+//
+// Parse controller specification.
+//
+static void parse_control(const char *spec, control_t *ctl)
+{
+    const char *p = spec;
+    char *end;
+    int have_set = 0, have_out = 0;
+
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->hyst = DEFAULT_HYST;
+
+    if (strncmp(p, "adc", 3) != 0 || p[3] < '0' || p[3] > '2')
+        goto bad;
+    ctl->channel = p[3] - '0';
+    p += 4;
+
+    while (*p == ',') {
+        double *gain;
+
+        p++;
+        if (strncmp(p, "set=", 4) == 0) {
+            ctl->setpoint = strtol(p + 4, &end, 0);
+            if (end == p + 4 || ctl->setpoint < 0 || ctl->setpoint > 1023)
+                goto bad;
+            have_set = 1;
+            p = end;
+            continue;
+        }
+        if (strncmp(p, "hyst=", 5) == 0) {
+            ctl->hyst = strtol(p + 5, &end, 0);
+            if (end == p + 5 || ctl->hyst < 0 || ctl->hyst > 1023)
+                goto bad;
+            p = end;
+            continue;
+        }
+        if (strncmp(p, "out=dac", 7) == 0) {
+            ctl->out = OUT_DAC;
+            have_out = 1;
+            p += 7;
+            continue;
+        }
+        if (strncmp(p, "out=gp", 6) == 0 && p[6] >= '0' && p[6] <= '3') {
+            ctl->out = p[6] - '0';
+            have_out = 1;
+            p += 7;
+            continue;
+        }
+        if (strncmp(p, "reverse", 7) == 0) {
+            ctl->reverse = 1;
+            p += 7;
+            continue;
+        }
+        if (strncmp(p, "kp=", 3) == 0)
+            gain = &ctl->kp;
+        else if (strncmp(p, "ki=", 3) == 0)
+            gain = &ctl->ki;
+        else if (strncmp(p, "kd=", 3) == 0)
+            gain = &ctl->kd;
+        else
+            goto bad;
+        p += 3;
+        *gain = strtod(p, &end);
+        if (end == p || *gain < 0)
+            goto bad;
+        ctl->pid = 1;
+        p = end;
+    }
+    if (*p != 0 || !have_set || !have_out)
+        goto bad;
+    if (ctl->pid && ctl->out != OUT_DAC) {
+        fprintf(stderr, "PID control needs DAC output: %s\n", spec);
+        exit(-1);
+    }
+    return;
+bad:
+    fprintf(stderr, "Bad controller: %s\n", spec);
+    exit(-1);
+}
+
+//
+// Compute new output from the input value.
+// Time step dt is in seconds.
+//
+static int control_step(control_t *ctl, int value, int output, double dt)
+{
+    int max = (ctl->out == OUT_DAC) ? DAC_MAX : 1;
+    double error = ctl->setpoint - value;
+    double u;
+
+    if (ctl->reverse)
+        error = -error;
+
+    if (!ctl->pid) {
+        // Bang-bang: keep the output until the input leaves the band.
+        if (error > ctl->hyst)
+            return max;
+        if (error < -ctl->hyst)
+            return 0;
+        return output;
+    }
+
+    // Derivative on the input, so that setpoint has no kick.
+    u = ctl->kp * error + ctl->integral;
+    if (dt > 0) {
+        double slope = (value - ctl->prev_value) / dt;
+
+        u -= ctl->kd * (ctl->reverse ? -slope : slope);
+
+        // Integrate only when it drives the output out of saturation.
+        if ((u < max || error < 0) && (u > 0 || error > 0))
+            ctl->integral += ctl->ki * error * dt;
+    }
+    ctl->prev_value = value;
+
+    if (u < 0)
+        return 0;
+    if (u > max)
+        return max;
+    return (int) (u + 0.5);
+}
+
+//
+// Fill the report which sets the output.
+//
+static void make_output(const control_t *ctl, int output, unsigned char *req)
+{
+    memset(req, 0, 64);
+    if (ctl->out == OUT_DAC) {
+        mcp_cmd_set_sram_t *cmd = (mcp_cmd_set_sram_t*) req;
+
+        cmd->command_code = MCP_CMD_SETSRAM;
+        cmd->dac_value = MCP_SRAM_ALTER | output;
+    } else {
+        mcp_cmd_set_gpio_t *cmd = (mcp_cmd_set_gpio_t*) req;
+
+        // Direction is set every time: it costs nothing in the same report.
+        cmd->command_code = MCP_CMD_SETGPIO;
+        cmd->gp[ctl->out].alter_value = 1;
+        cmd->gp[ctl->out].value = output;
+        cmd->gp[ctl->out].alter_direction = 1;
+        cmd->gp[ctl->out].direction = 0;
+    }
+}
+
+//
+// Run the control loop with given period, until interrupted.
+//
+void mcp_control(const char *spec, const char *output, int interval_msec)
+{
+    unsigned long long interval = interval_msec * 1000000ULL;
+    unsigned long long start_time, deadline, now, t_cycle, t_prev = 0, t_exchange;
+    unsigned char reqs[2 * 64], replies[2 * 64];
+    const mcp_reply_status_t *status;
+    int nreqs, value, out_value = 0, new_value;
+    loop_stats_t stats;
+    control_t ctl;
+    FILE *out = stdout;
+
+    parse_control(spec, &ctl);
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            perror(output);
+            exit(-1);
+        }
+    }
+    fprintf(out, "time,adc%d,%s\n", ctl.channel,
+        ctl.out == OUT_DAC ? "dac" : ctl.out == 0 ? "gp0" :
+        ctl.out == 1 ? "gp1" : ctl.out == 2 ? "gp2" : "gp3");
+    fprintf(stderr, "Control %s: %s, period %d msec.\n", spec,
+        ctl.pid ? "PID" : "bang-bang", interval_msec);
+
+    memset(&stats, 0, sizeof(stats));
+    catch_stop_signals();
+
+    // The first period switches the output off.
+    new_value = 0;
+    out_value = -1;
+    start_time = deadline = time_nsec();
+    while (!stop_flag) {
+        t_cycle = time_nsec();
+
+        nreqs = 0;
+        if (new_value != out_value) {
+            make_output(&ctl, new_value, &reqs[0]);
+            out_value = new_value;
+            nreqs++;
+        }
+        memset(&reqs[nreqs * 64], 0, 64);
+        reqs[nreqs * 64] = MCP_CMD_STATUSSET;
+        nreqs++;
+
+        mcp_execute_batch(reqs, nreqs, replies);
+        t_exchange = time_nsec() - t_cycle;
+        status = (const mcp_reply_status_t*) &replies[(nreqs - 1) * 64];
+        if (nreqs > 1) {
+            stats.nwrites++;
+            stats.exchange_write += t_exchange / 1e3;
+        } else {
+            stats.exchange_read += t_exchange / 1e3;
+        }
+        value = (ctl.channel == 0) ? status->adc_ch0 :
+                (ctl.channel == 1) ? status->adc_ch1 : status->adc_ch2;
+
+        new_value = control_step(&ctl, value, out_value,
+            t_prev ? (t_cycle - t_prev) / 1e9 : 0);
+        fprintf(out, "%.6f,%d,%d\n", (t_cycle - start_time) / 1e9, value, new_value);
+
+        // Statistics of the period and of the start time.
+        if (t_prev) {
+            double period = (t_cycle - t_prev) / 1e3;
+            double dev = period - interval / 1e3;
+
+            stats.sum += period;
+            stats.sum_dev += (dev < 0) ? -dev : dev;
+            if (stats.min == 0 || period < stats.min)
+                stats.min = period;
+            if (period > stats.max)
+                stats.max = period;
+        }
+        if (t_cycle > deadline && t_cycle - deadline > stats.max_late)
+            stats.max_late = t_cycle - deadline;
+        t_prev = t_cycle;
+        stats.ncycles++;
+
+        deadline += interval;
+        now = time_nsec();
+        if (deadline < now) {
+            // Overrun: skip the lost periods.
+            stats.nmissed++;
+            deadline = now;
+        }
+        sleep_until(deadline);
+    }
+
+    // Leave the output switched off.
+    if (out_value != 0) {
+        make_output(&ctl, 0, &reqs[0]);
+        mcp_execute_batch(reqs, 1, replies);
+    }
+    if (out != stdout)
+        fclose(out);
+
+    if (stats.ncycles > 1) {
+        double n = stats.ncycles - 1;
+
+        fprintf(stderr, "Control loop: %lu cycles, period %.0f usec (min %.0f, max %.0f), jitter %.0f usec\n",
+            stats.ncycles, stats.sum / n, stats.min, stats.max, stats.sum_dev / n);
+        fprintf(stderr, "Deadlines missed: %lu, max lateness %.0f usec.\n",
+            stats.nmissed, stats.max_late / 1e3);
+    }
+    if (stats.ncycles > stats.nwrites)
+        fprintf(stderr, "USB exchange: %.0f usec to read input (%lu periods)",
+            stats.exchange_read / (stats.ncycles - stats.nwrites),
+            stats.ncycles - stats.nwrites);
+    if (stats.nwrites > 0)
+        fprintf(stderr, "%s%.0f usec to write output and read input (%lu periods)",
+            stats.ncycles > stats.nwrites ? ", " : "USB exchange: ",
+            stats.exchange_write / stats.nwrites, stats.nwrites);
+    if (stats.ncycles > 0)
+        fprintf(stderr, ".\n");
+}
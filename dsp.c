@@ -0,0 +1,364 @@
+/*
+ * Decimation of ADC samples, with vectorized kernels.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dsp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <immintrin.h>
+#   define DSP_X86 1
+#endif
+
+//
+// History kept beyond the filter length, so that samples
+// are moved to the start of the buffer only once in a while.
+//
+#define SLACK   4096
+
+struct dsp {
+    int         ratio;              // decimation ratio
+    int         order;              // number of cascaded boxcars
+    int         ntaps;              // filter length
+    float       scale;              // ADC units to output units
+    float       *weight;            // filter coefficients, sum is 1
+    int         fill;               // samples in buffer
+    int         size;               // buffer capacity
+    int         phase;              // samples since last output
+    uint16_t    *x[3];              // history of every channel
+    uint64_t    *t;                 // history of timestamps
+    void        (*emit)(const dsp_output_t*, void*);
+    void        *arg;
+};
+
+//
+// Kernels: sum, min and max of a window; dot product with weights.
+//
+typedef void stats_func_t(const uint16_t *x, int n, uint32_t *sum, uint16_t *min, uint16_t *max);
+typedef float dot_func_t(const uint16_t *x, const float *w, int n);
+
+static void stats_scalar(const uint16_t *x, int n, uint32_t *sum, uint16_t *min, uint16_t *max)
+{
+    uint32_t s = 0;
+    uint16_t lo = 0xffff, hi = 0;
+    int i;
+
+    for (i=0; i<n; i++) {
+        s += x[i];
+        if (x[i] < lo)
+            lo = x[i];
+        if (x[i] > hi)
+            hi = x[i];
+    }
+    *sum = s;
+    *min = lo;
+    *max = hi;
+}
+
+static float dot_scalar(const uint16_t *x, const float *w, int n)
+{
+    float s = 0;
+    int i;
+
+    for (i=0; i<n; i++)
+        s += x[i] * w[i];
+    return s;
+}
+
+#ifdef DSP_X86
+//
+// SSE2 has only signed 16-bit min/max: flip the sign bit
+// to compare unsigned values.
+//
+__attribute__((target("sse2")))
+static void stats_sse2(const uint16_t *x, int n, uint32_t *sum, uint16_t *min, uint16_t *max)
+{
+    const __m128i bias = _mm_set1_epi16(-0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vmin = _mm_set1_epi16(0x7fff);
+    __m128i vmax = _mm_set1_epi16(-0x8000);
+    __m128i vsum = zero;
+    uint16_t lo[8], hi[8];
+    uint32_t s[4];
+    int i;
+
+    for (i=0; i+8<=n; i+=8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (x + i));
+        __m128i b = _mm_xor_si128(v, bias);
+
+        vmin = _mm_min_epi16(vmin, b);
+        vmax = _mm_max_epi16(vmax, b);
+        vsum = _mm_add_epi32(vsum, _mm_add_epi32(_mm_unpacklo_epi16(v, zero),
+                                                 _mm_unpackhi_epi16(v, zero)));
+    }
+    _mm_storeu_si128((__m128i*) lo, _mm_xor_si128(vmin, bias));
+    _mm_storeu_si128((__m128i*) hi, _mm_xor_si128(vmax, bias));
+    _mm_storeu_si128((__m128i*) s, vsum);
+
+    stats_scalar(x + i, n - i, sum, min, max);
+    *sum += s[0] + s[1] + s[2] + s[3];
+    for (i=0; i<8; i++) {
+        if (lo[i] < *min)
+            *min = lo[i];
+        if (hi[i] > *max)
+            *max = hi[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static float dot_sse2(const uint16_t *x, const float *w, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    float s[4];
+    int i;
+
+    for (i=0; i+8<=n; i+=8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (x + i));
+
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)),
+                                           _mm_loadu_ps(w + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)),
+                                           _mm_loadu_ps(w + i + 4)));
+    }
+    _mm_storeu_ps(s, _mm_add_ps(acc0, acc1));
+    return s[0] + s[1] + s[2] + s[3] + dot_scalar(x + i, w + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void stats_avx2(const uint16_t *x, int n, uint32_t *sum, uint16_t *min, uint16_t *max)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vmin = _mm256_set1_epi16(-1);
+    __m256i vmax = zero;
+    __m256i vsum = zero;
+    uint16_t lo[16], hi[16];
+    uint32_t s[8];
+    int i;
+
+    for (i=0; i+16<=n; i+=16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (x + i));
+
+        vmin = _mm256_min_epu16(vmin, v);
+        vmax = _mm256_max_epu16(vmax, v);
+        vsum = _mm256_add_epi32(vsum, _mm256_add_epi32(_mm256_unpacklo_epi16(v, zero),
+                                                       _mm256_unpackhi_epi16(v, zero)));
+    }
+    _mm256_storeu_si256((__m256i*) lo, vmin);
+    _mm256_storeu_si256((__m256i*) hi, vmax);
+    _mm256_storeu_si256((__m256i*) s, vsum);
+
+    stats_scalar(x + i, n - i, sum, min, max);
+    *sum += s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+    for (i=0; i<16; i++) {
+        if (lo[i] < *min)
+            *min = lo[i];
+        if (hi[i] > *max)
+            *max = hi[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static float dot_avx2(const uint16_t *x, const float *w, int n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    float s[8];
+    int i;
+
+    for (i=0; i+16<=n; i+=16) {
+        __m256i v0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (x + i)));
+        __m256i v1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (x + i + 8)));
+
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_cvtepi32_ps(v0), _mm256_loadu_ps(w + i)));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_cvtepi32_ps(v1), _mm256_loadu_ps(w + i + 8)));
+    }
+    _mm256_storeu_ps(s, _mm256_add_ps(acc0, acc1));
+    return s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7] +
+           dot_scalar(x + i, w + i, n - i);
+}
+#endif /* DSP_X86 */
+
+static stats_func_t *window_stats;
+static dot_func_t *dot;
+static const char *kernel_name;
+
+//
+// Choose the best kernels for this processor.
+//
+static void select_kernels()
+{
+    if (kernel_name)
+        return;
+
+    window_stats = stats_scalar;
+    dot = dot_scalar;
+    kernel_name = "scalar";
+#ifdef DSP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        window_stats = stats_avx2;
+        dot = dot_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        window_stats = stats_sse2;
+        dot = dot_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *dsp_kernel_name()
+{
+    select_kernels();
+    return kernel_name;
+}
+
+static void *alloc(size_t nbytes)
+{
+    void *p = calloc(1, nbytes);
+
+    if (!p) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    return p;
+}
+
+//
+// Impulse response of N cascaded boxcars of given length,
+// normalized to unity gain.
+//
+static void make_weights(float *w, int ratio, int order)
+{
+    double *h = alloc(order * ratio * sizeof(double));
+    double *tmp = alloc(order * ratio * sizeof(double));
+    double norm = 1;
+    int len = 1, k, i, j;
+
+    h[0] = 1;
+    for (k=0; k<order; k++) {
+        memset(tmp, 0, (len + ratio - 1) * sizeof(double));
+        for (i=0; i<len; i++)
+            for (j=0; j<ratio; j++)
+                tmp[i + j] += h[i];
+        len += ratio - 1;
+        memcpy(h, tmp, len * sizeof(double));
+        norm *= ratio;
+    }
+    for (i=0; i<len; i++)
+        w[i] = h[i] / norm;
+    free(h);
+    free(tmp);
+}
+
+dsp_t *dsp_create(int ratio, int order, double scale,
+    void (*emit)(const dsp_output_t *out, void *arg), void *arg)
+{
+    dsp_t *d;
+    int c;
+
+    if (ratio < 1 || ratio > DSP_MAX_RATIO || order < 1 || order > DSP_MAX_ORDER) {
+        fprintf(stderr, "Bad decimation parameters: ratio %d, order %d\n", ratio, order);
+        exit(-1);
+    }
+    select_kernels();
+
+    d = alloc(sizeof(*d));
+    d->ratio = ratio;
+    d->order = order;
+    d->ntaps = order * (ratio - 1) + 1;
+    d->scale = scale;
+    d->emit = emit;
+    d->arg = arg;
+    d->size = d->ntaps + SLACK;
+    d->weight = alloc(d->ntaps * sizeof(float));
+    make_weights(d->weight, ratio, order);
+    for (c=0; c<3; c++)
+        d->x[c] = alloc(d->size * sizeof(uint16_t));
+    d->t = alloc(d->size * sizeof(uint64_t));
+    return d;
+}
+
+void dsp_destroy(dsp_t *d)
+{
+    int c;
+
+    for (c=0; c<3; c++)
+        free(d->x[c]);
+    free(d->t);
+    free(d->weight);
+    free(d);
+}
+
+//
+// Compute one output from the last ntaps samples.
+//
+static void output(dsp_t *d)
+{
+    dsp_output_t out;
+    uint32_t sum;
+    uint16_t min, max;
+    int c;
+
+    out.t = d->t[d->fill - (d->ntaps + 1) / 2];
+    for (c=0; c<3; c++) {
+        const uint16_t *x = d->x[c] + d->fill - d->ntaps;
+
+        // Boxcar needs only the sum; min and max are over the last window.
+        window_stats(d->x[c] + d->fill - d->ratio, d->ratio, &sum, &min, &max);
+        if (d->order == 1)
+            out.mean[c] = (float) sum / d->ratio * d->scale;
+        else
+            out.mean[c] = dot(x, d->weight, d->ntaps) * d->scale;
+        out.min[c] = min * d->scale;
+        out.max[c] = max * d->scale;
+    }
+    d->emit(&out, d->arg);
+}
+
+void dsp_push(dsp_t *d, uint64_t t, const uint16_t adc[3])
+{
+    int c;
+
+    if (d->fill == d->size) {
+        // Keep the history needed for the next output.
+        int keep = d->ntaps - 1;
+
+        for (c=0; c<3; c++)
+            memmove(d->x[c], d->x[c] + d->fill - keep, keep * sizeof(uint16_t));
+        memmove(d->t, d->t + d->fill - keep, keep * sizeof(uint64_t));
+        d->fill = keep;
+    }
+    for (c=0; c<3; c++)
+        d->x[c][d->fill] = adc[c];
+    d->t[d->fill] = t;
+    d->fill++;
+
+    if (++d->phase >= d->ratio && d->fill >= d->ntaps) {
+        output(d);
+        d->phase = 0;
+    }
+}
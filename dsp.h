@@ -0,0 +1,80 @@
+/*
+ * Decimation of ADC samples: boxcar or CIC-style filter,
+ * with min/max/mean per output window.
+ *
+ * Samples are pushed one at a time, either live from the chip
+ * or from a log file.  Every `ratio` input samples, one output
+ * is produced: filtered value of every ADC channel, and min/max
+ * over the last window.  Order 1 is a plain boxcar average;
+ * order N is equivalent to N cascaded boxcars (CIC filter),
+ * with better rejection of aliases at the cost of N*ratio taps.
+ *
+ *      dsp_t *d = dsp_create(64, 2, 2.048 / 1024, print, 0);
+ *      while (read_sample(&t, adc))
+ *          dsp_push(d, t, adc);
+ *      dsp_destroy(d);
+ *
+ * The inner loops run on SSE2 or AVX2 when the processor has them,
+ * chosen at run time; other platforms use plain C.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef DSP_H
+#define DSP_H
+
+#include <stdint.h>
+
+#define DSP_MAX_RATIO   65536
+#define DSP_MAX_ORDER   4
+
+//
+// One output of the decimator.
+// Values are in volts, or in ADC units when scale is 1.
+//
+typedef struct {
+    uint64_t t;                     // time of window center, usec
+    float    mean[3];               // filtered value
+    float    min[3];                // min over the window
+    float    max[3];                // max over the window
+} dsp_output_t;
+
+typedef struct dsp dsp_t;
+
+//
+// Create decimator with given ratio and filter order.
+// Scale converts ADC units into output units.
+// Function emit() is called for every output.
+//
+dsp_t *dsp_create(int ratio, int order, double scale,
+    void (*emit)(const dsp_output_t *out, void *arg), void *arg);
+void dsp_destroy(dsp_t *d);
+
+//
+// Feed one sample: time in usec and three ADC channels.
+//
+void dsp_push(dsp_t *d, uint64_t t, const uint16_t adc[3]);
+
+//
+// Name of the kernels in use: "avx2", "sse2" or "scalar".
+//
+const char *dsp_kernel_name(void);
+
+#endif /* DSP_H */
@@ -0,0 +1,273 @@
+/*
+ * Export MCP2221 metrics in Prometheus text format.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "mcp2221.h"
+#include "util.h"
+
+//
+// Latest metrics, formatted and ready to be sent.
+// The device is polled by a separate thread, and scrapes
+// are answered from this cache without any USB traffic.
+//
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char cache_text[4096];
+static int cache_len;
+
+//
+// Format metrics into the buffer.
+// Return the length of text.
+//
+static int format_metrics(char *buf, int size, mcp_reply_status_t *status,
+    mcp_reply_gpio_t *gpio, hid_stats_t *stats, int nsamples)
+{
+    const uint8_t pin[4] = { gpio->gp0_pin, gpio->gp1_pin, gpio->gp2_pin, gpio->gp3_pin };
+    const uint8_t dir[4] = { gpio->gp0_direction, gpio->gp1_direction,
+                             gpio->gp2_direction, gpio->gp3_direction };
+    int len = 0, i;
+
+    len += snprintf(buf + len, size - len,
+        "# HELP mcp2221_adc ADC channel input value.\n"
+        "# TYPE mcp2221_adc gauge\n"
+        "mcp2221_adc{channel=\"0\"} %u\n"
+        "mcp2221_adc{channel=\"1\"} %u\n"
+        "mcp2221_adc{channel=\"2\"} %u\n",
+        status->adc_ch0, status->adc_ch1, status->adc_ch2);
+
+    len += snprintf(buf + len, size - len,
+        "# HELP mcp2221_gpio Value of GP pin in GPIO mode.\n"
+        "# TYPE mcp2221_gpio gauge\n");
+    for (i=0; i<4; i++) {
+        // Direction is 0 for output, 1 for input, other for non-GPIO function.
+        if (dir[i] > 1)
+            continue;
+        len += snprintf(buf + len, size - len,
+            "mcp2221_gpio{pin=\"%d\",direction=\"%s\"} %u\n",
+            i, dir[i] ? "input" : "output", pin[i]);
+    }
+
+    len += snprintf(buf + len, size - len,
+        "# HELP mcp2221_scl_input SCL line value, as read from the pin.\n"
+        "# TYPE mcp2221_scl_input gauge\n"
+        "mcp2221_scl_input %u\n"
+        "# HELP mcp2221_sda_input SDA line value, as read from the pin.\n"
+        "# TYPE mcp2221_sda_input gauge\n"
+        "mcp2221_sda_input %u\n",
+        status->scl_input, status->sda_input);
+
+    len += snprintf(buf + len, size - len,
+        "# HELP mcp2221_usb_requests_total Completed USB requests.\n"
+        "# TYPE mcp2221_usb_requests_total counter\n"
+        "mcp2221_usb_requests_total %lu\n"
+        "# HELP mcp2221_usb_retries_total Repeated USB transfers.\n"
+        "# TYPE mcp2221_usb_retries_total counter\n"
+        "mcp2221_usb_retries_total %lu\n"
+        "# HELP mcp2221_usb_errors_total Failed USB transfers.\n"
+        "# TYPE mcp2221_usb_errors_total counter\n"
+        "mcp2221_usb_errors_total %lu\n"
+        "# HELP mcp2221_usb_timeouts_total USB transfers not completed in time.\n"
+        "# TYPE mcp2221_usb_timeouts_total counter\n"
+        "mcp2221_usb_timeouts_total %lu\n"
+        "# HELP mcp2221_usb_stalls_total Cleared USB endpoint halts.\n"
+        "# TYPE mcp2221_usb_stalls_total counter\n"
+        "mcp2221_usb_stalls_total %lu\n"
+        "# HELP mcp2221_usb_reconnects_total Device lost and found again.\n"
+        "# TYPE mcp2221_usb_reconnects_total counter\n"
+        "mcp2221_usb_reconnects_total %lu\n",
+        stats->requests, stats->retries, stats->errors,
+        stats->timeouts, stats->stalls, stats->reconnects);
+
+    len += snprintf(buf + len, size - len,
+        "# HELP mcp2221_polls_total Number of device polls.\n"
+        "# TYPE mcp2221_polls_total counter\n"
+        "mcp2221_polls_total %d\n"
+        "# HELP mcp2221_last_poll_seconds Time of last device poll.\n"
+        "# TYPE mcp2221_last_poll_seconds gauge\n"
+        "mcp2221_last_poll_seconds %lu\n",
+        nsamples, (unsigned long) time(0));
+    return len;
+}
+
+//
+// Poll the device with given interval, and update the cache.
+//
+static void *poll_thread(void *arg)
+{
+    unsigned long long interval = *(int*)arg * 1000000ULL;
+    unsigned long long deadline = time_nsec();
+    mcp_reply_status_t status;
+    mcp_reply_gpio_t gpio;
+    hid_stats_t stats;
+    char text[sizeof(cache_text)];
+    int len, nsamples = 0;
+
+    while (!stop_flag) {
+        mcp_get_status(&status);
+        mcp_get_gpio(&gpio);
+        hid_get_stats(&stats);
+        nsamples++;
+        len = format_metrics(text, sizeof(text), &status, &gpio, &stats, nsamples);
+
+        pthread_mutex_lock(&cache_lock);
+        memcpy(cache_text, text, len);
+        cache_len = len;
+        pthread_mutex_unlock(&cache_lock);
+
+        // Keep a fixed rate, independent of the request latency.
+        deadline += interval;
+        if (deadline < time_nsec())
+            deadline = time_nsec();
+        sleep_until(deadline);
+    }
+    return 0;
+}
+
+//
+// Write all data to the socket.
+//
+static void send_all(int sock, const char *data, int len)
+{
+    while (len > 0) {
+        int n = send(sock, data, len, 0);
+        if (n <= 0)
+            return;
+        data += n;
+        len -= n;
+    }
+}
+
+//
+// Serve one HTTP connection.
+//
+static void serve_client(int sock)
+{
+    char request[1024], text[sizeof(cache_text)], header[256];
+    int len, hlen;
+
+    // We only need the request line.
+    len = recv(sock, request, sizeof(request) - 1, 0);
+    if (len <= 0)
+        return;
+    request[len] = 0;
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 &&
+        strncmp(request, "GET / ", 6) != 0)
+    {
+        static const char not_found[] =
+            "HTTP/1.0 404 Not Found\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: 10\r\n"
+            "\r\n"
+            "Not found\n";
+        send_all(sock, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    len = cache_len;
+    memcpy(text, cache_text, len);
+    pthread_mutex_unlock(&cache_lock);
+
+    hlen = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\n"
+        "\r\n", len);
+    send_all(sock, header, hlen);
+    send_all(sock, text, len);
+}
+
+//
+// Poll the device in background, and serve /metrics
+// on the given port of the loopback interface.
+//
+void mcp_export(int port, int interval_msec)
+{
+    struct sockaddr_in addr;
+    sigset_t mask, saved_mask;
+    pthread_t thread;
+    int sock, one = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(-1);
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(sock, 16) < 0)
+    {
+        fprintf(stderr, "Cannot listen on port %d: %s\n", port, strerror(errno));
+        exit(-1);
+    }
+
+    // Stop gracefully on Ctrl-C.
+    catch_stop_signals();
+
+    // Start polling the device.
+    // Signals must interrupt accept() in the main thread.
+    cache_len = 0;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &saved_mask);
+    pthread_create(&thread, 0, poll_thread, &interval_msec);
+    pthread_sigmask(SIG_SETMASK, &saved_mask, 0);
+    fprintf(stderr, "Serving metrics on http://127.0.0.1:%d/metrics\n", port);
+
+    while (!stop_flag) {
+        int client = accept(sock, 0, 0);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            break;
+        }
+
+        // Do not let a stalled client block other scrapes.
+        struct timeval timeout = { 1, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_client(client);
+        close(client);
+    }
+    stop_flag = 1;
+    pthread_join(thread, 0);
+    close(sock);
+}
@@ -26,35 +26,146 @@
 #include <string.h>
 #include <unistd.h>
 #include <libusb.h>
+#include "mcp2221.h"
+#include "usbdev.h"
 #include "util.h"
 
 static libusb_context *ctx = NULL;          // libusb context
 static libusb_device_handle *dev;           // libusb device
+static hid_stats_t stats;                   // transfer statistics
+static unsigned long long last_send;        // time of the last request
+static unsigned long long last_written;     // when the request was delivered
+static unsigned long long last_recv;        // time of its reply
+static int dev_vid, dev_pid;                // USB vendor and product IDs
+static char dev_serial[64];                 // serial number of the device
+static uint8_t dev_bus;                     // where the device is attached:
+static uint8_t dev_ports[8];                // bus and port path,
+static int dev_nports;
+static uint8_t dev_address;                 // and address on the bus
+static int reconnect_flag;                  // reconnect when device is lost
+static volatile int device_arrived;         // set by hotplug callback
+static volatile int device_left;            // set by hotplug callback
+static int last_error;                      // libusb error of the last failed transfer
+static struct libusb_transfer *batch_out;   // transfers of hid_send_batch(),
+static struct libusb_transfer *batch_in;    // allocated once at init
 
 #define HID_INTERFACE       2               // HID interface index
-#define TIMEOUT_MSEC        500             // receive timeout
 #define BULK_WRITE_ENDPOINT 0x03            // output to HID device
 #define BULK_READ_ENDPOINT  0x83            // input from HID device
 
 //
-// Perform USB bulk transfer.
+// Retry policy.
+// Every request has a deadline; transient errors are retried
+// with exponential backoff until the deadline expires.
+//
+#define DEADLINE_MSEC       500             // default time limit for a request
+#define BACKOFF_USEC        100             // first delay before retry
+#define BACKOFF_MAX_USEC    10000           // max delay between retries
+#define CANCEL_MSEC         100             // time limit for I2C cancel request
+
+static unsigned default_deadline = DEADLINE_MSEC;
+static unsigned backoff_first = BACKOFF_USEC;
+static unsigned backoff_max = BACKOFF_MAX_USEC;
+static unsigned cmd_deadline[256];          // per-command deadlines, 0 = default
+
+//
+// Set retry policy: default deadline of a request in milliseconds,
+// first and maximal delay between retries in microseconds.
+// Zero value leaves the parameter unchanged.
+//
+void hid_set_retry_policy(unsigned deadline_msec, unsigned backoff_usec, unsigned backoff_max_usec)
+{
+    if (deadline_msec)
+        default_deadline = deadline_msec;
+    if (backoff_usec)
+        backoff_first = backoff_usec;
+    if (backoff_max_usec)
+        backoff_max = backoff_max_usec;
+}
+
+//
+// Set deadline for a given command code.
+// Zero value restores the default.
+//
+void hid_set_deadline(int cmd, unsigned msec)
+{
+    cmd_deadline[cmd & 0xff] = msec;
+}
+
+//
+// Get time limit for a given command code.
+//
+unsigned hid_get_deadline(int cmd)
+{
+    return cmd_deadline[cmd & 0xff] ? cmd_deadline[cmd & 0xff] : default_deadline;
+}
+
+//
+// Is the error worth a retry?
+// A write is repeated only when the report surely did not reach
+// the device: otherwise the command could be executed twice.
+//
+static int transient_error(uint8_t type, int result)
+{
+    switch (result) {
+    case LIBUSB_ERROR_PIPE:
+    case LIBUSB_ERROR_BUSY:
+        return 1;
+    case LIBUSB_ERROR_IO:
+    case LIBUSB_ERROR_OVERFLOW:
+    case LIBUSB_ERROR_INTERRUPTED:
+    case LIBUSB_ERROR_OTHER:
+        return type == BULK_READ_ENDPOINT;
+    }
+    return 0;
+}
+
+//
+// Perform USB bulk transfer, until the given deadline.
 // Return a number of transferred bytes, or -1 in case of error.
 //
-static int bulk_transfer(uint8_t type, uint8_t *data, int length)
+static int bulk_transfer(uint8_t type, uint8_t *data, int length, unsigned long long deadline)
 {
-    int result, transfered, retry;
+    unsigned long long now;
+    unsigned delay = backoff_first;
+    int result, transfered;
+
+    for (;;) {
+        // Wait no longer than the deadline allows.
+        now = time_nsec();
+        unsigned timeout = (now < deadline) ? (deadline - now + 999999) / 1000000 : 1;
 
-    for (retry = 0; retry < 10; retry++) {
-        result = libusb_bulk_transfer(dev, type, data, length, &transfered, TIMEOUT_MSEC);
+        result = libusb_bulk_transfer(dev, type, data, length, &transfered, timeout);
         if (result >= 0)
             return transfered;
 
-        if (result != LIBUSB_ERROR_PIPE)
+        stats.errors++;
+        last_error = result;
+        if (result == LIBUSB_ERROR_TIMEOUT)
+            stats.timeouts++;
+        if (!transient_error(type, result))
             break;
 
-        // Sometimes the chip does not recognize the command, for unknown reason.
-        // Need to repeat.
-        usleep(10000);
+        if (result == LIBUSB_ERROR_PIPE) {
+            // Sometimes the chip does not recognize the command, for unknown reason.
+            // Clear the stall condition and repeat.
+            libusb_clear_halt(dev, type);
+            stats.stalls++;
+        }
+
+        now = time_nsec();
+        if (now + delay * 1000ULL >= deadline)
+            break;
+
+        stats.retries++;
+        if (trace_flag > 0)
+            fprintf(stderr, "Retry %s after '%s', delay %u usec\n",
+                (type == BULK_WRITE_ENDPOINT) ? "write" : "read",
+                libusb_error_name(result), delay);
+        usleep(delay);
+        delay *= 2;
+        if (delay > backoff_max)
+            delay = backoff_max;
     }
     fprintf(stderr, "%s: Failed to %s %d bytes '%s'\n", __func__,
             (type == BULK_WRITE_ENDPOINT) ? "write" : "read", length,
@@ -62,17 +173,314 @@ static int bulk_transfer(uint8_t type, uint8_t *data, int length)
     return -1;
 }
 
+//
+// Is it I2C command, which could leave the I2C engine busy?
+//
+static int is_i2c_command(int cmd)
+{
+    switch (cmd) {
+    case MCP_CMD_I2CWRITE:
+    case MCP_CMD_I2CWRITE_REPEATSTART:
+    case MCP_CMD_I2CWRITE_NOSTOP:
+    case MCP_CMD_I2CREAD:
+    case MCP_CMD_I2CREAD_REPEATSTART:
+    case MCP_CMD_I2CREAD_GET:
+        return 1;
+    }
+    return 0;
+}
+
+//
+// I2C operation was not answered: cancel it via STATUSSET,
+// to leave the chip in a usable state.
+//
+static void cancel_i2c()
+{
+    unsigned char buf[64];
+    unsigned long long deadline = time_nsec() + CANCEL_MSEC * 1000000ULL;
+
+    memset(buf, 0, sizeof(buf));
+    buf[0] = MCP_CMD_STATUSSET;
+    buf[2] = MCP_I2C_CANCEL;
+    if (bulk_transfer(BULK_WRITE_ENDPOINT, buf, sizeof(buf), deadline) < 0 ||
+        bulk_transfer(BULK_READ_ENDPOINT, buf, sizeof(buf), deadline) < 0)
+        return;
+    stats.cancels++;
+    fprintf(stderr, "I2C transfer cancelled.\n");
+}
+
+//
+// Take HID interface from the kernel driver.
+//
+static int claim_interface()
+{
+    if (libusb_kernel_driver_active(dev, HID_INTERFACE)) {
+        libusb_detach_kernel_driver(dev, HID_INTERFACE);
+    }
+    return libusb_claim_interface(dev, HID_INTERFACE);
+}
+
+//
+// Remember where the opened device is attached.
+// After reset, the chip comes back to the same port, with new address.
+//
+static void save_location()
+{
+    libusb_device *device = libusb_get_device(dev);
+
+    dev_bus = libusb_get_bus_number(device);
+    dev_address = libusb_get_device_address(device);
+    dev_nports = libusb_get_port_numbers(device, dev_ports, sizeof(dev_ports));
+}
+
+//
+// Is the device attached to the same port as ours?
+//
+static int same_port(libusb_device *device)
+{
+    uint8_t ports[sizeof(dev_ports)];
+    int n = libusb_get_port_numbers(device, ports, sizeof(ports));
+
+    return libusb_get_bus_number(device) == dev_bus &&
+        n == dev_nports && n > 0 && memcmp(ports, dev_ports, n) == 0;
+}
+
+//
+// Is our device still present at its old address?
+//
+static int old_device_present()
+{
+    libusb_device **list;
+    ssize_t count, i;
+    int found = 0;
+
+    count = libusb_get_device_list(ctx, &list);
+    if (count < 0)
+        return 0;
+    for (i=0; i<count && !found; i++)
+        found = (libusb_get_bus_number(list[i]) == dev_bus &&
+                 libusb_get_device_address(list[i]) == dev_address);
+    libusb_free_device_list(list, 1);
+    return found;
+}
+
+//
+// Hotplug callback: a device with our VID/PID has appeared or gone.
+// With non-zero arg, only events on the port of our device count:
+// other chips of the same type can come and go meanwhile.
+// No I/O is allowed here, so just notify the waiting loop.
+//
+static int hotplug_callback(libusb_context *context, libusb_device *device,
+    libusb_hotplug_event event, void *arg)
+{
+    if (arg && !same_port(device))
+        return 0;
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+        device_left = 1;
+    else
+        device_arrived = 1;
+    return 0;
+}
+
+//
+// Register hotplug callback for given events, on any port
+// or only on the port of our device.
+// Return 1 on success, or 0 when hotplug is not supported.
+//
+static int watch_hotplug(int events, int our_port, libusb_hotplug_callback_handle *callback)
+{
+    device_arrived = 0;
+    device_left = 0;
+    return libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+        libusb_hotplug_register_callback(ctx, events, LIBUSB_HOTPLUG_NO_FLAGS,
+            dev_vid, dev_pid, LIBUSB_HOTPLUG_MATCH_ANY,
+            hotplug_callback, our_port ? &dev_bus : 0, callback) == 0;
+}
+
+//
+// Wait until the flag is set by hotplug callback, or a given time passes.
+//
+static void wait_event(int have_hotplug, volatile int *flag, unsigned msec)
+{
+    if (have_hotplug) {
+        struct timeval tv = { msec / 1000, msec % 1000 * 1000 };
+
+        libusb_handle_events_timeout_completed(ctx, &tv, (int*) flag);
+    } else {
+        // No hotplug support on this platform: rescan periodically.
+        usleep((msec < 100 ? msec : 100) * 1000);
+    }
+}
+
+//
+// Open the device with the same serial number and claim the interface.
+// Wait for arrival, until the deadline (0 means forever).
+// Return 0 on success, or -1 when interrupted or timed out.
+//
+static int reopen(int have_hotplug, unsigned long long deadline)
+{
+    unsigned long long now;
+    int attempt;
+
+    while (!stop_flag) {
+        // Device node may need a moment to get permissions after arrival.
+        for (attempt = 0; attempt < 8 && !stop_flag; attempt++) {
+            dev = usb_open_device(ctx, dev_vid, dev_pid, dev_serial, 0, 0, 0);
+            if (dev) {
+                if (claim_interface() == 0) {
+                    save_location();
+                    return 0;
+                }
+                libusb_close(dev);
+                dev = 0;
+            }
+            if (!device_arrived)
+                break;
+            usleep(5000 << attempt);
+        }
+
+        now = time_nsec();
+        if (deadline && now >= deadline)
+            break;
+        device_arrived = 0;
+        wait_event(have_hotplug, &device_arrived,
+            (deadline && deadline - now < 1000000000ULL) ?
+                (deadline - now + 999999) / 1000000 : 1000);
+    }
+    return -1;
+}
+
+//
+// Device is lost: wait for the device with the same serial number
+// to appear again, then reopen it.
+// Return 0 on success, or -1 when interrupted.
+//
+static int reconnect()
+{
+    libusb_hotplug_callback_handle callback;
+    unsigned long long t0 = time_nsec();
+    int have_hotplug, result;
+
+    fprintf(stderr, "Device lost, waiting for %04x:%04x serial '%s'...\n",
+        dev_vid, dev_pid, dev_serial);
+    libusb_release_interface(dev, HID_INTERFACE);
+    libusb_close(dev);
+    dev = 0;
+
+    // Register the callback before scanning, so no arrival can be missed.
+    // The device could be plugged back into any port.
+    have_hotplug = watch_hotplug(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0, &callback);
+    result = reopen(have_hotplug, 0);
+    if (have_hotplug)
+        libusb_hotplug_deregister_callback(ctx, callback);
+    if (result < 0)
+        return -1;
+
+    stats.reconnects++;
+    fprintf(stderr, "Device reconnected after %.3f seconds.\n",
+        (time_nsec() - t0) / 1e9);
+    return 0;
+}
+
+//
+// Send reset command, which has no reply.
+// Wait until the chip leaves the bus and comes back,
+// then reopen the device with the same serial number.
+// Return 0 on success, or -1 when the device did not return in time.
+//
+int hid_reset(const unsigned char *data, unsigned nbytes, unsigned timeout_msec)
+{
+    libusb_hotplug_callback_handle callback;
+    unsigned long long deadline = time_nsec() + timeout_msec * 1000000ULL;
+    unsigned char buf[64];
+    int have_hotplug, result;
+
+    if (hid_replaying())
+        return 0;
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, data, nbytes);
+
+    // Register the callback before reset, so no event can be missed.
+    have_hotplug = watch_hotplug(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+        LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 1, &callback);
+
+    if (bulk_transfer(BULK_WRITE_ENDPOINT, buf, sizeof(buf), deadline) < 0) {
+        if (have_hotplug)
+            libusb_hotplug_deregister_callback(ctx, callback);
+        return -1;
+    }
+
+    // Old device must disappear, otherwise we could reopen it.
+    if (have_hotplug) {
+        while (!device_left && !stop_flag && time_nsec() < deadline)
+            wait_event(have_hotplug, &device_left, 10);
+        if (!device_left) {
+            // Reset was ignored: keep the old device.
+            libusb_hotplug_deregister_callback(ctx, callback);
+            return -1;
+        }
+    } else {
+        // Without hotplug, rescan until the old device is gone.
+        while (old_device_present() && !stop_flag && time_nsec() < deadline)
+            usleep(1000);
+        if (old_device_present()) {
+            // Reset was ignored: keep the old device.
+            return -1;
+        }
+    }
+    libusb_release_interface(dev, HID_INTERFACE);
+    libusb_close(dev);
+    dev = 0;
+
+    result = reopen(have_hotplug, deadline);
+    if (have_hotplug)
+        libusb_hotplug_deregister_callback(ctx, callback);
+    return result;
+}
+
+//
+// Enable or disable automatic reconnect, when the device is lost.
+//
+void hid_set_reconnect(int enable)
+{
+    reconnect_flag = enable;
+}
+
+//
+// Can the command be sent again, when it is not known
+// whether the device has executed it?
+//
+static int is_idempotent(const unsigned char *buf)
+{
+    switch (buf[0]) {
+    case MCP_CMD_GETGPIO:
+    case MCP_CMD_GETSRAM:
+    case MCP_CMD_READFLASH:
+        return 1;
+    case MCP_CMD_STATUSSET:
+        return buf[2] != MCP_I2C_CANCEL;
+    }
+    return 0;
+}
+
 //
 // Send a request to the device.
 // Store the reply into the rdata[] array.
 // Terminate in case of errors.
+// Return -1 when the device was lost after the request went out,
+// and the request was not repeated on the new connection,
+// because the command has side effects.  Otherwise return 0.
 //
-void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsigned rlength)
+int hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsigned rlength)
 {
     unsigned char buf[64];
-    unsigned char reply[64];
+    unsigned char local_reply[64];
     unsigned k;
 
+    // Receive directly into the caller's buffer, when it fits a whole report.
+    unsigned char *reply = (rlength == sizeof(local_reply)) ? rdata : local_reply;
+
     memset(buf, 0, sizeof(buf));
     if (nbytes > 0)
         memcpy(buf, data, nbytes);
@@ -87,33 +495,202 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsi
         fprintf(stderr, "\n");
     }
 
+    unsigned long long t_send = time_nsec();
+    if (hid_replaying()) {
+        hid_replay(buf, reply);
+        last_send = t_send;
+        last_written = 0;
+        last_recv = time_nsec();
+        goto done;
+    }
+
+again:;
+    unsigned long long deadline = time_nsec() + hid_get_deadline(buf[0]) * 1000000ULL;
+
     // Send request to the device.
-    if (bulk_transfer(BULK_WRITE_ENDPOINT, buf, sizeof(buf)) < 0) {
+    if (bulk_transfer(BULK_WRITE_ENDPOINT, buf, sizeof(buf), deadline) < 0) {
+        // Stall or busy means the report was not accepted.
+        int rejected = (last_error == LIBUSB_ERROR_PIPE || last_error == LIBUSB_ERROR_BUSY);
+
+        if (reconnect_flag && reconnect() == 0) {
+            if (rejected || is_idempotent(buf))
+                goto again;
+            fprintf(stderr, "Request %02x may have been executed, not repeated.\n", buf[0]);
+            memset(rdata, 0, rlength);
+            return -1;
+        }
         fprintf(stderr, "Fatal write error!\n");
         exit(-1);
     }
+    unsigned long long t_written = time_nsec();
 
     // Get reply.
-    memset(reply, 0, sizeof(reply));
-    int reply_len = bulk_transfer(BULK_READ_ENDPOINT, reply, sizeof(reply));
+    memset(reply, 0, sizeof(local_reply));
+    int reply_len = bulk_transfer(BULK_READ_ENDPOINT, reply, sizeof(local_reply), deadline);
     if (reply_len < 0) {
+        if (is_i2c_command(buf[0]))
+            cancel_i2c();
+        if (reconnect_flag && reconnect() == 0) {
+            if (is_idempotent(buf))
+                goto again;
+            fprintf(stderr, "Request %02x may have been executed, not repeated.\n", buf[0]);
+            memset(rdata, 0, rlength);
+            return -1;
+        }
         exit(-1);
     }
-    if (reply_len != sizeof(reply)) {
+    if (reply_len != sizeof(local_reply)) {
         fprintf(stderr, "Short read: %d bytes instead of %d!\n",
-            reply_len, (int)sizeof(reply));
+            reply_len, (int)sizeof(local_reply));
         exit(-1);
     }
+    unsigned long long t_recv = time_nsec();
+    last_send = t_send;
+    last_written = t_written;
+    last_recv = t_recv;
+    rt_latency(t_recv - t_send);
+    if (hid_recording())
+        hid_record(buf, reply, t_send, t_recv);
+done:
     if (trace_flag > 0) {
         fprintf(stderr, "---Recv");
-        for (k=0; k<reply_len; ++k) {
+        for (k=0; k<sizeof(local_reply); ++k) {
             if (k != 0 && (k & 15) == 0)
                 fprintf(stderr, "\n       ");
             fprintf(stderr, " %02x", reply[k]);
         }
         fprintf(stderr, "\n");
     }
-    memcpy(rdata, reply, rlength);
+    if (reply != rdata)
+        memcpy(rdata, reply, rlength);
+    stats.requests++;
+    return 0;
+}
+
+//
+// State of a batch of requests.
+//
+typedef struct {
+    const unsigned char *reqs;      // requests, 64 bytes each
+    unsigned char *replies;         // replies, 64 bytes each
+    unsigned count;                 // number of requests
+    unsigned done;                  // completed requests
+    int pending;                    // transfers in flight
+    int failed;                     // transfer error
+    unsigned long long t_start;     // time when current request was sent
+    struct libusb_transfer *out, *in;
+} batch_t;
+
+static void batch_start(batch_t *b);
+
+//
+// Both transfers of the current request are finished:
+// the next request goes out right from the callback,
+// without waiting for the caller.
+//
+static void batch_done(struct libusb_transfer *transfer)
+{
+    batch_t *b = transfer->user_data;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+        (transfer == b->in && transfer->actual_length != 64))
+        b->failed = 1;
+    if (--b->pending > 0 || b->failed)
+        return;
+
+    if (trace_flag > 0)
+        fprintf(stderr, "---Batch %u: %02x -> %02x %02x\n", b->done,
+            b->reqs[b->done * 64], b->replies[b->done * 64], b->replies[b->done * 64 + 1]);
+    rt_latency(time_nsec() - b->t_start);
+    b->done++;
+    stats.requests++;
+    if (b->done < b->count)
+        batch_start(b);
+}
+
+//
+// Submit the request together with the read of its reply,
+// so the reply is picked up in the first frame it is ready.
+//
+static void batch_start(batch_t *b)
+{
+    unsigned i = b->done;
+
+    b->t_start = time_nsec();
+    libusb_fill_bulk_transfer(b->out, dev, BULK_WRITE_ENDPOINT,
+        (unsigned char*) &b->reqs[i * 64], 64, batch_done, b, hid_get_deadline(b->reqs[i * 64]));
+    libusb_fill_bulk_transfer(b->in, dev, BULK_READ_ENDPOINT,
+        &b->replies[i * 64], 64, batch_done, b, hid_get_deadline(b->reqs[i * 64]));
+    if (libusb_submit_transfer(b->out) < 0) {
+        b->failed = 1;
+        return;
+    }
+    b->pending = 1;
+    if (libusb_submit_transfer(b->in) < 0) {
+        b->failed = 1;
+        return;
+    }
+    b->pending = 2;
+}
+
+//
+// Send a sequence of requests back to back, 64 bytes each,
+// and store the replies.  Requests must be safe to repeat:
+// after a transfer error, the rest of the batch goes
+// through hid_send_recv(), with its retry policy.
+//
+void hid_send_batch(const unsigned char *reqs, unsigned count, unsigned char *replies)
+{
+    batch_t b = { reqs, replies, count };
+
+    if (count == 0)
+        return;
+
+    // Recording and replay see every request separately.
+    if (hid_recording() || hid_replaying()) {
+        for (; b.done < count; b.done++)
+            hid_send_recv(&reqs[b.done * 64], 64, &replies[b.done * 64], 64);
+        return;
+    }
+
+    b.out = batch_out;
+    b.in = batch_in;
+    batch_start(&b);
+    while (b.pending > 0)
+        libusb_handle_events(ctx);
+
+    if (b.failed) {
+        stats.errors++;
+        for (; b.done < count; b.done++)
+            hid_send_recv(&reqs[b.done * 64], 64, &replies[b.done * 64], 64);
+    }
+}
+
+//
+// Get serial number of the connected device.
+//
+const char *hid_get_serial()
+{
+    return dev_serial;
+}
+
+//
+// Get statistics of USB transfers.
+//
+void hid_get_stats(hid_stats_t *result)
+{
+    *result = stats;
+}
+
+//
+// Get times of the last request: sent, delivered to the device
+// (completion of the write transfer), and reply received.
+//
+void hid_get_times(unsigned long long *t_send, unsigned long long *t_written, unsigned long long *t_recv)
+{
+    *t_send = last_send;
+    *t_written = last_written;
+    *t_recv = last_recv;
 }
 
 //
@@ -122,6 +699,12 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsi
 //
 int hid_init(int vid, int pid)
 {
+    if (hid_replaying()) {
+        // No device: replies come from the recording.
+        strcpy(dev_serial, "replay");
+        return 0;
+    }
+
     int error = libusb_init(&ctx);
     if (error < 0) {
         fprintf(stderr, "libusb init failed: %d: %s\n",
@@ -129,7 +712,9 @@ int hid_init(int vid, int pid)
         exit(-1);
     }
 
-    dev = libusb_open_device_with_vid_pid(ctx, vid, pid);
+    dev_vid = vid;
+    dev_pid = pid;
+    dev = usb_open_device(ctx, vid, pid, "", 0, dev_serial, sizeof(dev_serial));
     if (!dev) {
         if (trace_flag) {
             fprintf(stderr, "Cannot find USB device %04x:%04x\n",
@@ -139,11 +724,7 @@ int hid_init(int vid, int pid)
         ctx = 0;
         return -1;
     }
-    if (libusb_kernel_driver_active(dev, HID_INTERFACE)) {
-        libusb_detach_kernel_driver(dev, HID_INTERFACE);
-    }
-
-    error = libusb_claim_interface(dev, HID_INTERFACE);
+    error = claim_interface();
     if (error < 0) {
         fprintf(stderr, "Failed to claim USB interface: %d: %s\n",
             error, libusb_strerror(error));
@@ -152,16 +733,38 @@ int hid_init(int vid, int pid)
         ctx = 0;
         exit(-1);
     }
+    save_location();
+
+    // No allocation on the path of every batch.
+    batch_out = libusb_alloc_transfer(0);
+    batch_in = libusb_alloc_transfer(0);
+    if (!batch_out || !batch_in) {
+        fprintf(stderr, "Cannot allocate USB transfers!\n");
+        exit(-1);
+    }
     return 0;
 }
 
 void hid_close()
 {
+    hid_record_close();
     if (!ctx)
         return;
 
-    libusb_release_interface(dev, HID_INTERFACE);
-    libusb_close(dev);
+    if (stats.retries > 0 || stats.reconnects > 0 || trace_flag)
+        fprintf(stderr, "USB: %lu requests, %lu retries, %lu errors, %lu timeouts, %lu stalls, %lu I2C cancels, %lu reconnects\n",
+            stats.requests, stats.retries, stats.errors, stats.timeouts,
+            stats.stalls, stats.cancels, stats.reconnects);
+
+    if (dev) {
+        libusb_release_interface(dev, HID_INTERFACE);
+        libusb_close(dev);
+        dev = 0;
+    }
+    libusb_free_transfer(batch_out);
+    libusb_free_transfer(batch_in);
+    batch_out = 0;
+    batch_in = 0;
     libusb_exit(ctx);
     ctx = 0;
 }
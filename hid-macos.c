@@ -31,16 +31,22 @@
 static volatile IOHIDDeviceRef dev;         // device handle
 static unsigned char transfer_buf[64];      // device buffer
 static unsigned char receive_buf[64];       // receive buffer
+static hid_stats_t stats;                   // transfer statistics
+static unsigned long long last_send;        // time of the last request
+static unsigned long long last_recv;        // time of its reply
+static unsigned resend_msec = 100;          // resend request when no reply
 static volatile int nbytes_received = 0;    // receive result
 
 //
 // Send a request to the device.
 // Store the reply into the rdata[] array.
 // Terminate in case of errors.
+// Return 0.
 //
-void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsigned rlength)
+int hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsigned rlength)
 {
     unsigned char buf[64];
+    unsigned long long t_send;
     unsigned k;
     IOReturn result;
 
@@ -57,6 +63,12 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsi
         }
         fprintf(stderr, "\n");
     }
+    t_send = time_nsec();
+    if (hid_replaying()) {
+        hid_replay(buf, receive_buf);
+        nbytes_received = sizeof(receive_buf);
+        goto done;
+    }
     nbytes_received = 0;
     memset(receive_buf, 0, sizeof(receive_buf));
 again:
@@ -72,10 +84,12 @@ again:
     for (k = 0; nbytes_received <= 0; k++) {
         usleep(100);
         CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, 0);
-        if (k >= 1000) {
+        if (k >= resend_msec * 10) {
             if (trace_flag > 0) {
                 fprintf(stderr, "No response from HID device!\n");
             }
+            stats.errors++;
+            stats.retries++;
             goto again;
         }
     }
@@ -85,6 +99,11 @@ again:
             nbytes_received, (int)sizeof(receive_buf));
         exit(-1);
     }
+    if (hid_recording())
+        hid_record(buf, receive_buf, t_send, time_nsec());
+done:
+    last_send = t_send;
+    last_recv = time_nsec();
     if (trace_flag > 0) {
         fprintf(stderr, "---Recv");
         for (k=0; k<nbytes_received; ++k) {
@@ -95,6 +114,85 @@ again:
         fprintf(stderr, "\n");
     }
     memcpy(rdata, receive_buf, rlength);
+    stats.requests++;
+    return 0;
+}
+
+//
+// Set retry policy.
+// Only the deadline is used: the request is resent when
+// no reply is received in this time.
+//
+void hid_set_retry_policy(unsigned deadline_msec, unsigned backoff_usec, unsigned backoff_max_usec)
+{
+    if (deadline_msec)
+        resend_msec = deadline_msec;
+}
+
+void hid_set_deadline(int cmd, unsigned msec)
+{
+    // Not supported.
+}
+
+unsigned hid_get_deadline(int cmd)
+{
+    return resend_msec;
+}
+
+//
+// Automatic reconnect is not supported.
+//
+void hid_set_reconnect(int enable)
+{
+    if (enable)
+        fprintf(stderr, "Warning: Reconnect is not supported on this platform.\n");
+}
+
+//
+// Reset with waiting for re-enumeration is not supported.
+//
+int hid_reset(const unsigned char *data, unsigned nbytes, unsigned timeout_msec)
+{
+    fprintf(stderr, "Reset is not supported on this platform.\n");
+    return -1;
+}
+
+//
+// Send a sequence of requests, one by one.
+//
+void hid_send_batch(const unsigned char *reqs, unsigned count, unsigned char *replies)
+{
+    unsigned i;
+
+    for (i=0; i<count; i++)
+        hid_send_recv(&reqs[i * 64], 64, &replies[i * 64], 64);
+}
+
+//
+// Serial number is not known: match any device.
+//
+const char *hid_get_serial()
+{
+    return "";
+}
+
+//
+// Get statistics of USB transfers.
+//
+void hid_get_stats(hid_stats_t *result)
+{
+    *result = stats;
+}
+
+//
+// Get times of the last request: sent, delivered to the device
+// (not known here, so zero), and reply received.
+//
+void hid_get_times(unsigned long long *t_send, unsigned long long *t_written, unsigned long long *t_recv)
+{
+    *t_send = last_send;
+    *t_written = 0;
+    *t_recv = last_recv;
 }
 
 //
@@ -153,6 +251,9 @@ static void callback_close(void *ontext,
 //
 int hid_init(int vid, int pid)
 {
+    if (hid_replaying())
+        return 0;
+
     // Create the USB HID Manager.
     IOHIDManagerRef HIDManager = IOHIDManagerCreate(kCFAllocatorDefault,
                                                     kIOHIDOptionsTypeNone);
@@ -207,6 +308,7 @@ int hid_init(int vid, int pid)
 //
 void hid_close()
 {
+    hid_record_close();
     if (!dev)
         return;
 
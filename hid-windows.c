@@ -33,15 +33,22 @@
 
 HANDLE dev = INVALID_HANDLE_VALUE;          // HID device
 static unsigned char receive_buf[64];       // receive buffer
+static hid_stats_t stats;                   // transfer statistics
+static unsigned long long last_send;        // time of the last request
+static unsigned long long last_recv;        // time of its reply
+
+#define DEADLINE_MSEC   500                 // time limit for asynchronous requests
 
 //
 // Send a request to the device.
 // Store the reply into the rdata[] array.
 // Terminate in case of errors.
+// Return 0.
 //
-void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsigned rlength)
+int hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsigned rlength)
 {
     unsigned char buf[64];
+    unsigned long long t_send;
     unsigned k;
     DWORD nbytes_received;
 
@@ -58,6 +65,12 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsi
         }
         fprintf(stderr, "\n");
     }
+    t_send = time_nsec();
+    if (hid_replaying()) {
+        hid_replay(buf, receive_buf);
+        nbytes_received = sizeof(receive_buf);
+        goto done;
+    }
     nbytes_received = 0;
     memset(receive_buf, 0, sizeof(receive_buf));
 
@@ -78,6 +91,11 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsi
             (unsigned)nbytes_received, (unsigned)sizeof(receive_buf));
         exit(-1);
     }
+    if (hid_recording())
+        hid_record(buf, receive_buf, t_send, time_nsec());
+done:
+    last_send = t_send;
+    last_recv = time_nsec();
     if (trace_flag > 0) {
         fprintf(stderr, "---Recv");
         for (k=0; k<nbytes_received; ++k) {
@@ -88,6 +106,81 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsi
         fprintf(stderr, "\n");
     }
     memcpy(rdata, receive_buf, rlength);
+    stats.requests++;
+    return 0;
+}
+
+//
+// Set retry policy.
+// Not supported: ReadFile() waits for the reply without a timeout.
+//
+void hid_set_retry_policy(unsigned deadline_msec, unsigned backoff_usec, unsigned backoff_max_usec)
+{
+}
+
+void hid_set_deadline(int cmd, unsigned msec)
+{
+}
+
+unsigned hid_get_deadline(int cmd)
+{
+    return DEADLINE_MSEC;
+}
+
+//
+// Automatic reconnect is not supported.
+//
+void hid_set_reconnect(int enable)
+{
+    if (enable)
+        fprintf(stderr, "Warning: Reconnect is not supported on this platform.\n");
+}
+
+//
+// Reset with waiting for re-enumeration is not supported.
+//
+int hid_reset(const unsigned char *data, unsigned nbytes, unsigned timeout_msec)
+{
+    fprintf(stderr, "Reset is not supported on this platform.\n");
+    return -1;
+}
+
+//
+// Send a sequence of requests, one by one.
+//
+void hid_send_batch(const unsigned char *reqs, unsigned count, unsigned char *replies)
+{
+    unsigned i;
+
+    for (i=0; i<count; i++)
+        hid_send_recv(&reqs[i * 64], 64, &replies[i * 64], 64);
+}
+
+//
+// Serial number is not known: match any device.
+//
+const char *hid_get_serial()
+{
+    return "";
+}
+
+//
+// Get statistics of USB transfers.
+//
+void hid_get_stats(hid_stats_t *result)
+{
+    *result = stats;
+}
+
+//
+// Get times of the last request: sent, delivered to the device
+// (not known here, so zero), and reply received.
+//
+void hid_get_times(unsigned long long *t_send, unsigned long long *t_written, unsigned long long *t_recv)
+{
+    *t_send = last_send;
+    *t_written = 0;
+    *t_recv = last_recv;
 }
 
 //
@@ -97,6 +190,9 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsi
 //
 int hid_init(int vid, int pid)
 {
+    if (hid_replaying())
+        return 0;
+
     static GUID guid = { 0x4d1e55b2, 0xf16f, 0x11cf, { 0x88, 0xcb, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } };
 
     HDEVINFO devinfo = SetupDiGetClassDevs(&guid, NULL, NULL, DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
@@ -166,6 +262,7 @@ int hid_init(int vid, int pid)
 //
 void hid_close()
 {
+    hid_record_close();
     if (dev != INVALID_HANDLE_VALUE) {
         CloseHandle(dev);
         dev = INVALID_HANDLE_VALUE;
@@ -0,0 +1,281 @@
+/*
+ * I2C transfers via MCP2221 chip.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcp2221.h"
+#include "util.h"
+
+//
+// How many times to poll the chip before giving up.
+// Every poll is a USB round trip, so no extra delays are needed.
+//
+#define I2C_RETRY_MAX   50
+
+//
+// The engine could be left busy by a previous session.
+// Check it once; after that every failure is followed by cancel.
+//
+static int engine_checked;
+
+//
+// Get state of I2C engine.
+//
+static int i2c_state(mcp_reply_status_t *status)
+{
+    mcp_get_status(status);
+    return status->i2c_machine_state;
+}
+
+//
+// Cancel current I2C transfer and bring the engine to idle state.
+//
+void mcp_i2c_cancel()
+{
+    unsigned char cancel[3] = { MCP_CMD_STATUSSET, 0, MCP_I2C_CANCEL };
+    mcp_reply_status_t status;
+
+    hid_send_recv(cancel, sizeof(cancel), &status, sizeof(status));
+    if (status.command_code != cancel[0] ||
+        status.status != 0)
+    {
+        fprintf(stderr, "Bad reply from STATUSSET request!\n");
+        exit(-1);
+    }
+    if (trace_flag)
+        fprintf(stderr, "I2C transfer cancelled.\n");
+    engine_checked = 1;
+}
+
+//
+// Is the state a fatal error of I2C engine?
+//
+static int i2c_failed(int state)
+{
+    switch (state) {
+    case MCP_I2C_STATE_START_TIMEOUT:
+    case MCP_I2C_STATE_RSTART_TIMEOUT:
+    case MCP_I2C_STATE_WRADDR_TIMEOUT:
+    case MCP_I2C_STATE_ADDR_NACK:
+    case MCP_I2C_STATE_WRDATA_TIMEOUT:
+    case MCP_I2C_STATE_RDDATA_TIMEOUT:
+    case MCP_I2C_STATE_STOP_TIMEOUT:
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Write data to I2C slave.
+// Command is one of MCP_CMD_I2CWRITE, MCP_CMD_I2CWRITE_NOSTOP
+// or MCP_CMD_I2CWRITE_REPEATSTART.
+// Data longer than 60 bytes are sent in several reports.
+//
+int mcp_i2c_write(int cmd, int addr, const uint8_t *data, int nbytes)
+{
+    mcp_cmd_i2c_t req;
+    mcp_reply_i2c_t reply;
+    mcp_reply_status_t status;
+    int done, chunk, retry, state;
+
+    if (!engine_checked) {
+        if (i2c_state(&status) != MCP_I2C_STATE_IDLE)
+            mcp_i2c_cancel();
+        engine_checked = 1;
+    }
+
+    req.command_code = cmd;
+    req.length = nbytes;
+    req.address = addr << 1;
+    done = 0;
+    do {
+        chunk = nbytes - done;
+        if (chunk > MCP_I2C_MAXDATA)
+            chunk = MCP_I2C_MAXDATA;
+        memcpy(req.data, data + done, chunk);
+
+        for (retry = 0; ; retry++) {
+            if (hid_send_recv((unsigned char*) &req, 4 + chunk, &reply, sizeof(reply)) < 0)
+                return -1;
+            if (reply.command_code != cmd) {
+                fprintf(stderr, "Bad reply from I2CWRITE request!\n");
+                exit(-1);
+            }
+            if (reply.status == 0)
+                break;
+            if (i2c_failed(reply.i2c_state) || retry >= I2C_RETRY_MAX) {
+                if (trace_flag)
+                    fprintf(stderr, "I2C write to %#x failed, state %#x\n", addr, reply.i2c_state);
+                mcp_i2c_cancel();
+                return -1;
+            }
+        }
+
+        // Wait until the chip sends out the chunk.
+        for (retry = 0; i2c_state(&status) == MCP_I2C_STATE_PARTIAL_DATA; retry++) {
+            if (retry >= I2C_RETRY_MAX) {
+                mcp_i2c_cancel();
+                return -1;
+            }
+        }
+        done += chunk;
+    } while (done < nbytes);
+
+    // Check completion.
+    for (retry = 0; ; retry++) {
+        if (status.i2c_ack_status & MCP_I2C_ADDR_NACK) {
+            if (trace_flag)
+                fprintf(stderr, "I2C address %#x not acknowledged\n", addr);
+            mcp_i2c_cancel();
+            return -1;
+        }
+        state = status.i2c_machine_state;
+        if (state == MCP_I2C_STATE_IDLE)
+            return 0;
+        if (state == MCP_I2C_STATE_WRITING_NOSTOP && cmd == MCP_CMD_I2CWRITE_NOSTOP)
+            return 0;
+        if (i2c_failed(state) || retry >= I2C_RETRY_MAX) {
+            if (trace_flag)
+                fprintf(stderr, "I2C write to %#x failed, state %#x\n", addr, state);
+            mcp_i2c_cancel();
+            return -1;
+        }
+        i2c_state(&status);
+    }
+}
+
+//
+// Read data from I2C slave.
+// Command is MCP_CMD_I2CREAD or MCP_CMD_I2CREAD_REPEATSTART.
+//
+int mcp_i2c_read(int cmd, int addr, uint8_t *data, int nbytes)
+{
+    mcp_cmd_i2c_t req;
+    mcp_reply_i2c_t reply;
+    mcp_reply_i2c_data_t rdata;
+    mcp_reply_status_t status;
+    int done, chunk, retry;
+
+    if (!engine_checked) {
+        if (i2c_state(&status) != MCP_I2C_STATE_IDLE)
+            mcp_i2c_cancel();
+        engine_checked = 1;
+    }
+
+    // Start the read transfer.
+    req.command_code = cmd;
+    req.length = nbytes;
+    req.address = addr << 1 | 1;
+    for (retry = 0; ; retry++) {
+        if (hid_send_recv((unsigned char*) &req, 4, &reply, sizeof(reply)) < 0)
+            return -1;
+        if (reply.command_code != cmd) {
+            fprintf(stderr, "Bad reply from I2CREAD request!\n");
+            exit(-1);
+        }
+        if (reply.status == 0)
+            break;
+        if (retry >= I2C_RETRY_MAX) {
+            mcp_i2c_cancel();
+            return -1;
+        }
+    }
+
+    // Fetch the data.
+    for (done = 0; done < nbytes; done += chunk) {
+        unsigned char get_data[1] = { MCP_CMD_I2CREAD_GET };
+
+        for (retry = 0; ; retry++) {
+            if (hid_send_recv(get_data, sizeof(get_data), &rdata, sizeof(rdata)) < 0)
+                return -1;
+            if (rdata.command_code != get_data[0]) {
+                fprintf(stderr, "Bad reply from I2CREAD_GET request!\n");
+                exit(-1);
+            }
+            if (rdata.status == 0 && rdata.nbytes != 0 &&
+                rdata.nbytes != MCP_I2C_READ_ERROR)
+                break;
+            if (i2c_failed(rdata.i2c_state) || retry >= I2C_RETRY_MAX) {
+                if (trace_flag)
+                    fprintf(stderr, "I2C read from %#x failed, state %#x\n", addr, rdata.i2c_state);
+                mcp_i2c_cancel();
+                return -1;
+            }
+        }
+        chunk = rdata.nbytes;
+        if (chunk > MCP_I2C_MAXDATA || chunk > nbytes - done) {
+            fprintf(stderr, "Bad data length %d from I2CREAD_GET request, expected %d bytes!\n",
+                chunk, nbytes - done);
+            mcp_i2c_cancel();
+            return -1;
+        }
+        memcpy(data + done, rdata.data, chunk);
+    }
+    return 0;
+}
+
+//
+// Put register address into the buffer, most significant byte first.
+// Register width is 8 or 16 bits.
+// Return number of bytes.
+//
+static int put_regaddr(uint8_t *buf, int reg, int reg_width)
+{
+    if (reg_width == 16) {
+        buf[0] = reg >> 8;
+        buf[1] = reg;
+        return 2;
+    }
+    buf[0] = reg;
+    return 1;
+}
+
+//
+// Read a block of registers in one transaction:
+// write register address without stop, then read with repeated start.
+//
+int mcp_i2c_read_regs(int addr, int reg, int reg_width, uint8_t *data, int nbytes)
+{
+    uint8_t regaddr[2];
+    int n = put_regaddr(regaddr, reg, reg_width);
+
+    if (mcp_i2c_write(MCP_CMD_I2CWRITE_NOSTOP, addr, regaddr, n) < 0)
+        return -1;
+    return mcp_i2c_read(MCP_CMD_I2CREAD_REPEATSTART, addr, data, nbytes);
+}
+
+//
+// Write a block of registers in one transaction:
+// register address followed by data.
+//
+int mcp_i2c_write_regs(int addr, int reg, int reg_width, const uint8_t *data, int nbytes)
+{
+    uint8_t buf[2 + MCP_I2C_MAXREGS];
+    int n = put_regaddr(buf, reg, reg_width);
+
+    if (nbytes > MCP_I2C_MAXREGS)
+        return -1;
+    memcpy(buf + n, data, nbytes);
+    return mcp_i2c_write(MCP_CMD_I2CWRITE, addr, buf, n + nbytes);
+}
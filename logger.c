@@ -0,0 +1,500 @@
+/*
+ * Log ADC and GPIO samples of MCP2221 chip into compact file,
+ * and query the log by time range.
+ * File format is described in mcplog.h.
+ *
+ * ADC samples can be decimated (see dsp.h), both live
+ * from the chip and when reading the log.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dsp.h"
+#include "mcp2221.h"
+#include "mcplog.h"
+#include "timestamp.h"
+#include "util.h"
+
+//
+// Partial block is rewritten in place this often, so that
+// a killed logger loses at most this much of data.
+//
+#define SYNC_NSEC   1000000000ULL
+
+//
+// State of the writer.
+//
+typedef struct {
+    int             fd;
+    uint32_t        interval_usec;
+    mcplog_block_t  *index;         // headers of all blocks
+    uint32_t        nblocks;        // number of blocks, including current
+    uint32_t        index_size;     // allocated entries
+    uint64_t        nsamples;       // total number of samples
+    mcplog_sample_t prev;           // previous sample in current block
+    union {
+        mcplog_block_t hdr;
+        uint8_t bytes[MCPLOG_BLOCK_SIZE];
+    } block;                        // current block
+} logger_t;
+
+static void write_at(logger_t *log, const void *data, size_t nbytes, off_t offset)
+{
+    if (pwrite(log->fd, data, nbytes, offset) != (ssize_t) nbytes) {
+        perror("Log write");
+        exit(-1);
+    }
+}
+
+static off_t block_offset(uint32_t n)
+{
+    return sizeof(mcplog_header_t) + (off_t) n * MCPLOG_BLOCK_SIZE;
+}
+
+//
+// Write current block to the file.
+// Unused tail of the block is zeroed.
+//
+static void sync_block(logger_t *log)
+{
+    if (log->nblocks == 0)
+        return;
+
+    log->index[log->nblocks - 1] = log->block.hdr;
+    write_at(log, log->block.bytes, MCPLOG_BLOCK_SIZE, block_offset(log->nblocks - 1));
+}
+
+//
+// Start new empty block.
+//
+static void new_block(logger_t *log)
+{
+    if (log->nblocks >= log->index_size) {
+        log->index_size = log->index_size ? log->index_size * 2 : 256;
+        log->index = realloc(log->index, log->index_size * sizeof(mcplog_block_t));
+        if (!log->index) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+    }
+    memset(&log->block, 0, sizeof(log->block));
+    log->nblocks++;
+}
+
+//
+// Append one sample to the log.
+//
+static void append(logger_t *log, const mcplog_sample_t *s)
+{
+    mcplog_block_t *hdr = &log->block.hdr;
+    uint8_t buf[MCPLOG_MAX_SAMPLE];
+    unsigned n, i;
+
+    if (log->nblocks > 0 && hdr->nsamples > 0) {
+        n = mcplog_encode(buf, s, &log->prev, log->interval_usec);
+        if (hdr->nbytes + n <= MCPLOG_PAYLOAD)
+            goto store;
+
+        // Block is full.
+        sync_block(log);
+    }
+
+    // First sample of a block is encoded against zero state.
+    new_block(log);
+    memset(&log->prev, 0, sizeof(log->prev));
+    log->prev.t = s->t - log->interval_usec;
+    n = mcplog_encode(buf, s, &log->prev, log->interval_usec);
+    hdr->t_first = s->t;
+    for (i=0; i<3; i++)
+        hdr->adc_min[i] = hdr->adc_max[i] = s->adc[i];
+store:
+    memcpy(log->block.bytes + sizeof(mcplog_block_t) + hdr->nbytes, buf, n);
+    hdr->nbytes += n;
+    hdr->nsamples++;
+    hdr->t_last = s->t;
+    for (i=0; i<3; i++) {
+        if (s->adc[i] < hdr->adc_min[i])
+            hdr->adc_min[i] = s->adc[i];
+        if (s->adc[i] > hdr->adc_max[i])
+            hdr->adc_max[i] = s->adc[i];
+    }
+    log->prev = *s;
+    log->nsamples++;
+}
+
+//
+// Pack GPIO pins and directions into one byte.
+//
+static uint8_t pack_gpio(const mcp_reply_gpio_t *gpio)
+{
+    return (gpio->gp0_pin == 1) |
+           (gpio->gp1_pin == 1) << 1 |
+           (gpio->gp2_pin == 1) << 2 |
+           (gpio->gp3_pin == 1) << 3 |
+           (gpio->gp0_direction == 1) << 4 |
+           (gpio->gp1_direction == 1) << 5 |
+           (gpio->gp2_direction == 1) << 6 |
+           (gpio->gp3_direction == 1) << 7;
+}
+
+//
+// Get ADC reference voltage from SRAM settings, in millivolts.
+// Return 0 when the reference is off.
+//
+static int adc_vref_mvolt(int vdd_mvolt)
+{
+    const mcp_reply_sram_data_t *sram = mcp_execute(MCP_REQ_GETSRAM);
+
+    if (!sram->config3.adc_ref_en)
+        return vdd_mvolt;
+
+    switch (sram->config3.adc_ref_sel) {
+    case MCP_REF_4096: return 4096;
+    case MCP_REF_2048: return 2048;
+    case MCP_REF_1024: return 1024;
+    default:           return 0;
+    }
+}
+
+//
+// Volts per unit of 10-bit ADC, or 1 to keep ADC units.
+//
+static double adc_scale(int vref_mvolt)
+{
+    return vref_mvolt ? vref_mvolt / 1000.0 / 1024 : 1.0;
+}
+
+//
+// Destination of decimated output.
+//
+typedef struct {
+    FILE     *f;
+    uint32_t err;                   // max uncertainty since last output, usec
+} output_t;
+
+//
+// Account uncertainty of a sample, which goes to the decimator.
+//
+static void output_err(output_t *o, uint32_t err)
+{
+    if (err > o->err)
+        o->err = err;
+}
+
+//
+// Print one output of the decimator as CSV line.
+// Time uncertainty is the worst of the samples since the previous output.
+//
+static void print_output(const dsp_output_t *out, void *arg)
+{
+    output_t *o = arg;
+    int c;
+
+    fprintf(o->f, "%.6f,%.6f", out->t / 1e6, o->err / 1e6);
+    for (c=0; c<3; c++)
+        fprintf(o->f, ",%.5f,%.5f,%.5f", out->mean[c], out->min[c], out->max[c]);
+    fprintf(o->f, "\n");
+    o->err = 0;
+}
+
+static void print_output_header(FILE *f, int vref_mvolt)
+{
+    if (vref_mvolt)
+        fprintf(stderr, "ADC reference %.3f V.\n", vref_mvolt / 1000.0);
+    else
+        fprintf(stderr, "ADC reference unknown, output in ADC units.\n");
+    fprintf(f, "time,err,adc0,adc0.min,adc0.max,adc1,adc1.min,adc1.max,adc2,adc2.min,adc2.max\n");
+}
+
+//
+// Poll the chip with given interval, decimate ADC samples
+// and print the result.
+//
+void mcp_capture(const char *output, int interval_msec, int ratio, int order, int vdd_mvolt)
+{
+    unsigned long long interval = interval_msec * 1000000ULL;
+    unsigned long long start_time, deadline, t, err;
+    unsigned long nsamples = 0;
+    mcp_reply_status_t status;
+    uint16_t adc[3];
+    output_t out = { stdout };
+    int vref_mvolt;
+    dsp_t *dsp;
+    tstamp_t *ts = ts_create("chip");
+
+    if (output) {
+        out.f = fopen(output, "w");
+        if (!out.f) {
+            perror(output);
+            exit(-1);
+        }
+    }
+    vref_mvolt = adc_vref_mvolt(vdd_mvolt);
+    dsp = dsp_create(ratio, order, adc_scale(vref_mvolt), print_output, &out);
+    print_output_header(out.f, vref_mvolt);
+    fprintf(stderr, "Decimate by %d, order %d, %s kernels.\n", ratio, order, dsp_kernel_name());
+
+    catch_stop_signals();
+    start_time = deadline = time_nsec();
+    while (!stop_flag) {
+        mcp_get_status(&status);
+        ts_last(ts, &t, &err);
+
+        adc[0] = status.adc_ch0;
+        adc[1] = status.adc_ch1;
+        adc[2] = status.adc_ch2;
+        output_err(&out, err / 1000);
+        dsp_push(dsp, (t - start_time) / 1000, adc);
+        nsamples++;
+
+        deadline += interval;
+        if (deadline < time_nsec())
+            deadline = time_nsec();
+        sleep_until(deadline);
+    }
+
+    dsp_destroy(dsp);
+    if (out.f != stdout)
+        fclose(out.f);
+    fprintf(stderr, "Captured %lu samples.\n", nsamples);
+    ts_report(ts);
+    ts_destroy(ts);
+}
+
+//
+// Poll the chip with given interval, and append samples to the log file.
+// On exit, write the index and the footer.
+//
+void mcp_log(const char *filename, int interval_msec, int vdd_mvolt)
+{
+    unsigned long long interval = interval_msec * 1000000ULL;
+    unsigned long long start_time, deadline, last_sync, t, err;
+    mcp_reply_status_t status;
+    mcp_reply_gpio_t gpio;
+    mcplog_header_t header;
+    mcplog_footer_t footer;
+    mcplog_sample_t s;
+    struct timespec now;
+    static logger_t log;
+    off_t size;
+    tstamp_t *ts = ts_create("chip");
+
+    log.fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (log.fd < 0) {
+        perror(filename);
+        exit(-1);
+    }
+    log.interval_usec = interval_msec * 1000;
+
+    catch_stop_signals();
+    fprintf(stderr, "Logging to %s\n", filename);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    start_time = deadline = last_sync = time_nsec();
+    memset(&header, 0, sizeof(header));
+    header.magic = MCPLOG_MAGIC;
+    header.version = MCPLOG_VERSION;
+    header.interval_usec = log.interval_usec;
+    header.vref_mvolt = adc_vref_mvolt(vdd_mvolt);
+    header.start_realtime_nsec = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    write_at(&log, &header, sizeof(header), 0);
+
+    while (!stop_flag) {
+        // Timestamp is the moment of ADC sample.
+        mcp_get_status(&status);
+        ts_last(ts, &t, &err);
+        mcp_get_gpio(&gpio);
+        s.t = (t - start_time) / 1000;
+        s.adc[0] = status.adc_ch0;
+        s.adc[1] = status.adc_ch1;
+        s.adc[2] = status.adc_ch2;
+        s.gpio = pack_gpio(&gpio);
+        s.err = err / 1000;
+        append(&log, &s);
+
+        if (t - last_sync >= SYNC_NSEC) {
+            sync_block(&log);
+            last_sync = t;
+        }
+
+        deadline += interval;
+        if (deadline < time_nsec())
+            deadline = time_nsec();
+        sleep_until(deadline);
+    }
+
+    // Index goes right after the last block.
+    sync_block(&log);
+    memset(&footer, 0, sizeof(footer));
+    footer.index_offset = block_offset(log.nblocks);
+    footer.nsamples = log.nsamples;
+    footer.nblocks = log.nblocks;
+    footer.magic = MCPLOG_MAGIC;
+    write_at(&log, log.index, log.nblocks * sizeof(mcplog_block_t), footer.index_offset);
+    write_at(&log, &footer, sizeof(footer),
+        footer.index_offset + log.nblocks * sizeof(mcplog_block_t));
+    size = lseek(log.fd, 0, SEEK_END);
+    close(log.fd);
+    free(log.index);
+
+    fprintf(stderr, "Logged %llu samples in %u blocks, %.1f bytes per sample.\n",
+        (unsigned long long) log.nsamples, log.nblocks,
+        log.nsamples ? (double) size / log.nsamples : 0.0);
+    ts_report(ts);
+    ts_destroy(ts);
+}
+
+//
+// Range of interest for the query.
+//
+typedef struct {
+    uint64_t from, to;              // usec
+    uint64_t nprinted;
+    dsp_t    *dsp;                  // decimator, or 0
+    output_t out;                   // its output
+} query_t;
+
+static int print_sample(const mcplog_sample_t *s, void *arg)
+{
+    query_t *q = arg;
+
+    if (s->t > q->to)
+        return 1;
+    if (s->t < q->from)
+        return 0;
+
+    q->nprinted++;
+    if (q->dsp) {
+        output_err(&q->out, s->err);
+        dsp_push(q->dsp, s->t, s->adc);
+        return 0;
+    }
+    printf("%.6f,%.6f,%u,%u,%u,%u,%u,%u,%u\n", s->t / 1e6, s->err / 1e6,
+        s->adc[0], s->adc[1], s->adc[2],
+        s->gpio & 1, s->gpio >> 1 & 1, s->gpio >> 2 & 1, s->gpio >> 3 & 1);
+    return 0;
+}
+
+//
+// Print samples from the log file within given time range, in seconds.
+// The file is mapped into memory, and only the blocks which overlap
+// the range are decoded.  With non-zero ratio, ADC samples
+// are decimated and printed in volts.
+//
+void mcp_query(const char *filename, double from_sec, double to_sec, int ratio, int order)
+{
+    const mcplog_header_t *header;
+    const mcplog_footer_t *footer;
+    const mcplog_block_t *index;
+    const uint8_t *base;
+    query_t q = { from_sec * 1e6, to_sec * 1e6 };
+    uint32_t nblocks, lo, hi, i, nread = 0;
+    int use_index = 0, result;
+    struct stat st;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        exit(-1);
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*header)) {
+        fprintf(stderr, "%s: Not a log file.\n", filename);
+        exit(-1);
+    }
+    base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "%s: Cannot map file: %s\n", filename, strerror(errno));
+        exit(-1);
+    }
+    header = (const mcplog_header_t*) base;
+    if (header->magic != MCPLOG_MAGIC || header->version != MCPLOG_VERSION) {
+        fprintf(stderr, "%s: Not a log file.\n", filename);
+        exit(-1);
+    }
+
+    // Use the index when present; otherwise walk the block headers.
+    nblocks = (st.st_size - sizeof(*header)) / MCPLOG_BLOCK_SIZE;
+    index = 0;
+    if (st.st_size >= (off_t) (sizeof(*header) + sizeof(*footer))) {
+        footer = (const mcplog_footer_t*) (base + st.st_size - sizeof(*footer));
+        if (footer->magic == MCPLOG_MAGIC &&
+            footer->index_offset == block_offset(footer->nblocks) &&
+            footer->index_offset + footer->nblocks * sizeof(mcplog_block_t) +
+                sizeof(*footer) == (uint64_t) st.st_size) {
+            nblocks = footer->nblocks;
+            index = (const mcplog_block_t*) (base + footer->index_offset);
+            use_index = 1;
+        }
+    }
+    if (!use_index)
+        fprintf(stderr, "%s: No index, log was not closed properly.\n", filename);
+
+#define BLOCK(n) ((const mcplog_block_t*) (base + block_offset(n)))
+#define ENTRY(n) (use_index ? &index[n] : BLOCK(n))
+
+    // Binary search for the first block which ends at or after the start.
+    lo = 0;
+    hi = nblocks;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (ENTRY(mid)->t_last < q.from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (ratio) {
+        q.out.f = stdout;
+        q.dsp = dsp_create(ratio, order, adc_scale(header->vref_mvolt), print_output, &q.out);
+        print_output_header(stdout, header->vref_mvolt);
+    } else {
+        printf("time,err,adc0,adc1,adc2,gp0,gp1,gp2,gp3\n");
+    }
+    for (i=lo; i<nblocks; i++) {
+        const mcplog_block_t *entry = ENTRY(i);
+
+        if (entry->nsamples == 0 || entry->t_first > q.to)
+            break;
+        nread++;
+        result = mcplog_scan_block(BLOCK(i), header->interval_usec, print_sample, &q);
+        if (result < 0)
+            fprintf(stderr, "%s: Block %u is damaged.\n", filename, i);
+        if (result)
+            break;
+    }
+    munmap((void*) base, st.st_size);
+    if (q.dsp)
+        dsp_destroy(q.dsp);
+
+    fprintf(stderr, "Processed %llu samples, decoded %u of %u blocks.\n",
+        (unsigned long long) q.nprinted, nread, nblocks);
+}
@@ -23,7 +23,9 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include "dsp.h"
 #include "mcp2221.h"
 #include "util.h"
 
@@ -33,8 +35,19 @@
 #define MCP2221_VID 0x04d8
 #define MCP2221_PID 0x00dd
 
+//
+// How long to wait for the chip to come back after reset.
+//
+#define RESET_MSEC  5000
+
 const char version[] = VERSION;
 const char *copyright;
+int trace_flag;
+
+static int uart_baud;                   // relay UART at this baud rate
+static int pty_flag;                    // relay UART via pseudo-terminal
+static const char *uart_capture;        // file to record UART traffic
+static int binary_flag;                 // binary output format
 
 extern char *optarg;
 extern int optind;
@@ -44,9 +57,50 @@ void usage()
     fprintf(stderr, "MCP2221 Tool, Version %s, %s\n", version, copyright);
     fprintf(stderr, "Usage:\n");
     fprintf(stderr, "    mcptool [options]\n");
+    fprintf(stderr, "    mcptool -R [-A 16] addr reg count\n");
+    fprintf(stderr, "    mcptool -W [-A 16] addr reg byte...\n");
+    fprintf(stderr, "    mcptool -q file [-D ratio] [from-sec [to-sec]]\n");
+    fprintf(stderr, "    mcptool -S sck,mosi,miso,cs [-m mode] byte...\n");
     fprintf(stderr, "Options:\n");
-    fprintf(stderr, "    -r     Read confguration from device.\n");
-    fprintf(stderr, "    -t     Trace USB protocol.\n");
+    fprintf(stderr, "    -r         Read confguration from device.\n");
+    fprintf(stderr, "    -x port    Export metrics via HTTP on local port.\n");
+    fprintf(stderr, "    -s name    Publish device state in shared memory.\n");
+    fprintf(stderr, "    -b path    Serve I2C transactions on Unix socket.\n");
+    fprintf(stderr, "    -p file    Poll I2C registers listed in config file.\n");
+    fprintf(stderr, "    -w         Watch pins and inputs, print only changes.\n");
+    fprintf(stderr, "    -l file    Log ADC and GPIO samples into compact file.\n");
+    fprintf(stderr, "    -q file    Print samples from log file within time range.\n");
+    fprintf(stderr, "    -D ratio   Decimate ADC samples; alone, capture from the chip.\n");
+    fprintf(stderr, "    -C order   Decimation filter: 1 = boxcar (default), 2-4 = CIC.\n");
+    fprintf(stderr, "    -V volts   Supply voltage, for ADC reference Vdd, default 5.0.\n");
+    fprintf(stderr, "    -g trigger Capture ADC around events, like adc0>600,hyst=4,pre=100,post=100.\n");
+    fprintf(stderr, "    -K control Control DAC or GPx from ADC, like adc0,set=512,out=dac,kp=0.1,ki=0.5.\n");
+    fprintf(stderr, "    -a         Monitor ADC inputs of all attached chips.\n");
+    fprintf(stderr, "    -N chips   Acquire ADC of several chips in sync: all, or serial,serial...\n");
+    fprintf(stderr, "    -u baud    Relay UART data to stdio; combines with other modes, except -a and -N.\n");
+    fprintf(stderr, "    -P         Relay UART data via pseudo-terminal.\n");
+    fprintf(stderr, "    -c file    Capture UART traffic with timestamps.\n");
+    fprintf(stderr, "    -o file    Output file, default stdout.\n");
+    fprintf(stderr, "    -f format  Output format: csv (default) or bin.\n");
+    fprintf(stderr, "    -R         Read block of I2C registers.\n");
+    fprintf(stderr, "    -W         Write block of I2C registers.\n");
+    fprintf(stderr, "    -A bits    Register address width: 8 (default) or 16.\n");
+    fprintf(stderr, "    -S pins    Bit-bang SPI on GPx pins, '-' for unused MISO or CS.\n");
+    fprintf(stderr, "    -m mode    SPI mode 0-3, default 0.\n");
+    fprintf(stderr, "    -B spec    Soak test, like status=4,gpio=2,sram=1,i2c=1,addr=0x50,hours=8.\n");
+    fprintf(stderr, "    -M file    Save SRAM settings and GPIO state into profile file.\n");
+    fprintf(stderr, "    -L file    Restore profile, sending only changed settings.\n");
+    fprintf(stderr, "    -z         Reset the chip and wait until it is ready.\n");
+    fprintf(stderr, "    -i msec    Polling interval, default 1000 msec.\n");
+    fprintf(stderr, "    -T msec[,first,max] Time limit for USB request, default 500 msec\n");
+    fprintf(stderr, "               (status 100, flash 2000); delay between retries,\n");
+    fprintf(stderr, "               default 100 to 10000 usec.\n");
+    fprintf(stderr, "    -Y file    Record USB session into file.\n");
+    fprintf(stderr, "    -y file    Replay recorded session, without a device.\n");
+    fprintf(stderr, "    -F factor  Scale of replayed latencies, default 1; 0 = no delay.\n");
+    fprintf(stderr, "    -E cpus    Real-time mode: lock memory, pin threads to CPUs main[,worker].\n");
+    fprintf(stderr, "    -k         Keep session: reconnect when device is lost.\n");
+    fprintf(stderr, "    -t         Trace USB protocol.\n");
     exit(-1);
 }
 
@@ -61,6 +115,11 @@ static void mcp_connect()
         exit(-1);
     }
     fprintf(stderr, "Connect to MCP2221 chip.\n");
+
+    // UART relay runs in parallel with the HID mode.
+    if (uart_baud)
+        uart_start(MCP2221_VID, MCP2221_PID, hid_get_serial(),
+            uart_baud, pty_flag, uart_capture, binary_flag);
 }
 
 //
@@ -68,11 +127,13 @@ static void mcp_connect()
 //
 static void mcp_disconnect()
 {
+    if (uart_baud)
+        uart_stop();
     fprintf(stderr, "Close device.\n");
     hid_close();
 }
 
-static void mcp_print_status(mcp_reply_status_t *status)
+static void mcp_print_status(const mcp_reply_status_t *status)
 {
     printf("Hardware Revision: %c%c\n", status->hardware_rev_major, status->hardware_rev_minor);
     printf("Firmware Revision: %c.%c\n", status->firmware_rev_major, status->firmware_rev_minor);
@@ -86,7 +147,7 @@ static void mcp_print_status(mcp_reply_status_t *status)
     }
 }
 
-static void mcp_print_chip_settings(mcp_reply_chip_settings_t *settings)
+static void mcp_print_chip_settings(const mcp_reply_chip_settings_t *settings)
 {
     printf("USB Vendor ID: 0x%04x\n", settings->usb_vid);
     printf("USB Product ID: 0x%04x\n", settings->usb_pid);
@@ -156,7 +217,7 @@ static void mcp_print_chip_settings(mcp_reply_chip_settings_t *settings)
     }
 }
 
-static void mcp_print_gpio_settings(mcp_gpio_config_t *cfg, int index)
+static void mcp_print_gpio_settings(const mcp_gpio_config_t *cfg, int index)
 {
     if (cfg->function == 0) {
         if (cfg->dir_input) {
@@ -261,7 +322,7 @@ static void mcp_print_ascii(const char *title, const unsigned char *text, unsign
     printf("\n");
 }
 
-static void mcp_print_gpio(mcp_reply_gpio_t *gpio)
+static void mcp_print_gpio(const mcp_reply_gpio_t *gpio)
 {
     printf("GP0 pin: %s %d\n", gpio->gp0_direction == 0 ? "Output" :
         gpio->gp0_direction == 1 ? "Input" : "Unused", gpio->gp0_pin);
@@ -273,160 +334,327 @@ static void mcp_print_gpio(mcp_reply_gpio_t *gpio)
         gpio->gp3_direction == 1 ? "Input" : "Unused", gpio->gp3_pin);
 }
 
+//
+// Print string descriptor from flash.
+//
+static void mcp_print_string(const char *title, int req)
+{
+    const unsigned char *reply = mcp_execute(req);
+
+    mcp_print_unicode(title, &reply[4], reply[2] / 2 - 1);
+}
+
 //
 // Read information from MCP2221 chip.
+// Every reply is used in place, before the next request.
 //
 static void mcp_download()
 {
+    const mcp_reply_status_t *status = mcp_execute(MCP_REQ_STATUS);
+    mcp_print_status(status);
+
     //
-    // Get chip status.
+    // Get Flash data.
     //
-    unsigned char get_status[1]  = { MCP_CMD_STATUSSET };
-    mcp_reply_status_t status;
-    hid_send_recv(get_status, sizeof(get_status), &status, sizeof(status));
-    if (status.command_code != get_status[0] ||
-        status.status != 0)
-    {
-        fprintf(stderr, "Bad reply from STATUSSET request!\n");
-        exit(-1);
-    }
-    mcp_print_status(&status);
+    const mcp_reply_chip_settings_t *chip_settings = mcp_execute(MCP_REQ_CHIPSETTINGS);
+    printf("--- Flash ---\n");
+    mcp_print_chip_settings(chip_settings);
+
+    const mcp_reply_gpio_settings_t *gpio_settings = mcp_execute(MCP_REQ_GPIOSETTINGS);
+    mcp_print_gpio_settings(&gpio_settings->gp0, 0);
+    mcp_print_gpio_settings(&gpio_settings->gp1, 1);
+    mcp_print_gpio_settings(&gpio_settings->gp2, 2);
+    mcp_print_gpio_settings(&gpio_settings->gp3, 3);
+
+    mcp_print_string("USB Manufacturer", MCP_REQ_USBMANUFACTURER);
+    mcp_print_string("USB Product", MCP_REQ_USBPRODUCT);
+    mcp_print_string("USB Serial", MCP_REQ_USBSERIAL);
+
+    const unsigned char *reply = mcp_execute(MCP_REQ_FACTORYSERIAL);
+    mcp_print_ascii("Factory Serial", &reply[4], reply[2]);
 
     //
-    // Get Flash data: chip settings.
+    // Get SRAM settings.
     //
-    unsigned char get_chip_settings[2]  = { MCP_CMD_READFLASH, MCP_FLASH_CHIPSETTINGS };
-    mcp_reply_chip_settings_t chip_settings;
-    hid_send_recv(get_chip_settings, sizeof(get_chip_settings), &chip_settings, sizeof(chip_settings));
-    if (chip_settings.command_code != get_chip_settings[0] ||
-        chip_settings.status != 0 ||
-        chip_settings.nbytes + 4 != sizeof(chip_settings))
-    {
-        fprintf(stderr, "Bad reply from READFLASH CHIPSETTINGS request!\n");
-        exit(-1);
-    }
-    printf("--- Flash ---\n");
-    mcp_print_chip_settings(&chip_settings);
+    const mcp_reply_sram_data_t *sram = mcp_execute(MCP_REQ_GETSRAM);
+    printf("--- SRAM ---\n");
+    mcp_print_chip_settings((const mcp_reply_chip_settings_t*) sram);
+    printf("Password: %02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x\n",
+        sram->password[0], sram->password[1], sram->password[2], sram->password[3],
+        sram->password[4], sram->password[5], sram->password[6], sram->password[7]);
+
+    mcp_print_gpio_settings(&sram->gp0, 0);
+    mcp_print_gpio_settings(&sram->gp1, 1);
+    mcp_print_gpio_settings(&sram->gp2, 2);
+    mcp_print_gpio_settings(&sram->gp3, 3);
 
     //
-    // Get Flash data: GPIO settings.
+    // Get GPIO values.
     //
-    unsigned char get_gpio_settings[2]  = { MCP_CMD_READFLASH, MCP_FLASH_GPIOSETTINGS };
-    mcp_reply_gpio_settings_t gpio_settings;
-    hid_send_recv(get_gpio_settings, sizeof(get_gpio_settings), &gpio_settings, sizeof(gpio_settings));
-    if (gpio_settings.command_code != get_gpio_settings[0] ||
-        gpio_settings.status != 0 ||
-        gpio_settings.nbytes + 4 != sizeof(gpio_settings))
-    {
-        fprintf(stderr, "Bad reply from READFLASH GPIOSETTINGS request!\n");
+    const mcp_reply_gpio_t *gpio = mcp_execute(MCP_REQ_GETGPIO);
+    printf("--- GPIO ---\n");
+    mcp_print_gpio(gpio);
+}
+
+//
+// Parse a number from command line.
+//
+static int parse_number(const char *str, int min, int max)
+{
+    char *end;
+    long value = strtol(str, &end, 0);
+
+    if (*str == 0 || *end != 0 || value < min || value > max) {
+        fprintf(stderr, "Bad value: %s\n", str);
         exit(-1);
     }
-    mcp_print_gpio_settings(&gpio_settings.gp0, 0);
-    mcp_print_gpio_settings(&gpio_settings.gp1, 1);
-    mcp_print_gpio_settings(&gpio_settings.gp2, 2);
-    mcp_print_gpio_settings(&gpio_settings.gp3, 3);
+    return value;
+}
 
-    //
-    // Get Flash data: USB Manufacturer string.
-    //
-    unsigned char get_usb_manufecturer[2]  = { MCP_CMD_READFLASH, MCP_FLASH_USBMANUFACTURER };
-    unsigned char reply[64];
-    hid_send_recv(get_usb_manufecturer, sizeof(get_usb_manufecturer), reply, sizeof(reply));
-    if (reply[0] != get_usb_manufecturer[0] ||
-        reply[1] != 0 ||
-        reply[2] + 2 > sizeof(reply) ||
-        reply[3] != 3)
-    {
-        fprintf(stderr, "Bad reply from READFLASH USBMANUFACTURER request!\n");
+//
+// Parse retry policy "msec[,first[,max]]": time limit of a request
+// in milliseconds, first and max delay between retries in microseconds.
+//
+static void parse_retry_policy(char *spec)
+{
+    char *first = strchr(spec, ','), *max = 0;
+
+    if (first) {
+        *first++ = 0;
+        max = strchr(first, ',');
+        if (max)
+            *max++ = 0;
+    }
+    hid_set_retry_policy(parse_number(spec, 1, 60000),
+        first ? parse_number(first, 1, 1000000) : 0,
+        max ? parse_number(max, 1, 1000000) : 0);
+}
+
+//
+// Read a block of registers from I2C slave, and print in hex.
+//
+static void mcp_read_registers(char **argv, int reg_width)
+{
+    int addr = parse_number(argv[0], 0, 0x7f);
+    int reg = parse_number(argv[1], 0, (1 << reg_width) - 1);
+    int count = parse_number(argv[2], 1, MCP_I2C_MAXREGS);
+    uint8_t data[MCP_I2C_MAXREGS];
+    int i;
+
+    if (mcp_i2c_read_regs(addr, reg, reg_width, data, count) < 0) {
+        fprintf(stderr, "Cannot read registers of I2C slave %#x\n", addr);
         exit(-1);
     }
-    mcp_print_unicode("USB Manufacturer", &reply[4], reply[2] / 2 - 1);
-
-    unsigned char get_usb_product[2]  = { MCP_CMD_READFLASH, MCP_FLASH_USBPRODUCT };
-    hid_send_recv(get_usb_product, sizeof(get_usb_product), reply, sizeof(reply));
-    if (reply[0] != get_usb_manufecturer[0] ||
-        reply[1] != 0 ||
-        reply[2] + 2 > sizeof(reply) ||
-        reply[3] != 3)
-    {
-        fprintf(stderr, "Bad reply from READFLASH USBPRODUCT request!\n");
+    for (i=0; i<count; i++) {
+        if (i % 16 == 0)
+            printf(reg_width == 16 ? "%04x:" : "%02x:", reg + i);
+        printf(" %02x", data[i]);
+        if (i % 16 == 15 || i == count-1)
+            printf("\n");
+    }
+}
+
+//
+// Write a block of registers of I2C slave.
+//
+static void mcp_write_registers(int argc, char **argv, int reg_width)
+{
+    int addr = parse_number(argv[0], 0, 0x7f);
+    int reg = parse_number(argv[1], 0, (1 << reg_width) - 1);
+    uint8_t data[MCP_I2C_MAXREGS];
+    int i, count = argc - 2;
+
+    if (count > MCP_I2C_MAXREGS) {
+        fprintf(stderr, "Too many bytes to write\n");
         exit(-1);
     }
-    mcp_print_unicode("USB Product", &reply[4], reply[2] / 2 - 1);
-
-    unsigned char get_usb_serial[2]  = { MCP_CMD_READFLASH, MCP_FLASH_USBSERIAL };
-    hid_send_recv(get_usb_serial, sizeof(get_usb_serial), reply, sizeof(reply));
-    if (reply[0] != get_usb_manufecturer[0] ||
-        reply[1] != 0 ||
-        reply[2] + 2 > sizeof(reply) ||
-        reply[3] != 3)
-    {
-        fprintf(stderr, "Bad reply from READFLASH USBSERIAL request!\n");
+    for (i=0; i<count; i++)
+        data[i] = parse_number(argv[2+i], 0, 0xff);
+
+    if (mcp_i2c_write_regs(addr, reg, reg_width, data, count) < 0) {
+        fprintf(stderr, "Cannot write registers of I2C slave %#x\n", addr);
         exit(-1);
     }
-    mcp_print_unicode("USB Serial", &reply[4], reply[2] / 2 - 1);
-
-    unsigned char get_factory_serial[2]  = { MCP_CMD_READFLASH, MCP_FLASH_FACTORYSERIAL };
-    hid_send_recv(get_factory_serial, sizeof(get_factory_serial), reply, sizeof(reply));
-    if (reply[0] != get_usb_manufecturer[0] ||
-        reply[1] != 0 ||
-        reply[2] + 4 > sizeof(reply))
-    {
-        fprintf(stderr, "Bad reply from READFLASH FACTORYSERIAL request!\n");
+}
+
+//
+// Parse SPI pin list: sck,mosi,miso,cs.
+// Pin is a GPx number, or '-' when not used.
+//
+static void parse_spi_pins(const char *str, mcp_spi_pins_t *pins)
+{
+    int pin[4], used = 0, i;
+
+    for (i=0; i<4; i++) {
+        if (*str == '-')
+            pin[i] = -1;
+        else if (*str >= '0' && *str <= '3')
+            pin[i] = *str - '0';
+        else
+            break;
+        str++;
+        if (pin[i] >= 0) {
+            if (used & (1 << pin[i]))
+                break;
+            used |= 1 << pin[i];
+        }
+        if (i < 3 && *str++ != ',')
+            break;
+    }
+    if (i < 4 || *str != 0 || pin[0] < 0 || pin[1] < 0) {
+        fprintf(stderr, "Bad SPI pins: expected sck,mosi,miso,cs\n");
         exit(-1);
     }
-    mcp_print_ascii("Factory Serial", &reply[4], reply[2]);
+    pins->sck = pin[0];
+    pins->mosi = pin[1];
+    pins->miso = pin[2];
+    pins->cs = pin[3];
+}
 
-    //
-    // Get SRAM settings.
-    //
-    unsigned char get_sram[1] = { MCP_CMD_GETSRAM };
-    mcp_reply_sram_data_t sram;
-    hid_send_recv(get_sram, sizeof(get_sram), &sram, sizeof(sram));
-    if (sram.command_code != get_sram[0] ||
-        sram.status != 0 ||
-        sram.nbytes_sram + sram.nbytes_gp + 4 != sizeof(sram))
-    {
-        fprintf(stderr, "Bad reply from GETSRAM request!\n");
+//
+// Transfer bytes via bit-bang SPI, and print received data in hex.
+//
+static void mcp_spi(int argc, char **argv, const char *pin_list, int mode)
+{
+    mcp_spi_pins_t pins;
+    mcp_bitbang_stats_t stats;
+    uint8_t *tx, *rx;
+    int i;
+
+    parse_spi_pins(pin_list, &pins);
+    tx = malloc(argc);
+    rx = malloc(argc);
+    if (!tx || !rx) {
+        fprintf(stderr, "Out of memory!\n");
         exit(-1);
     }
-    printf("--- SRAM ---\n");
-    mcp_print_chip_settings((mcp_reply_chip_settings_t*) &sram);
-    printf("Password: %02x-%02x-%02x-%02x-%02x-%02x-%02x-%02x\n",
-        sram.password[0], sram.password[1], sram.password[2], sram.password[3],
-        sram.password[4], sram.password[5], sram.password[6], sram.password[7]);
+    for (i=0; i<argc; i++)
+        tx[i] = parse_number(argv[i], 0, 0xff);
 
-    mcp_print_gpio_settings(&sram.gp0, 0);
-    mcp_print_gpio_settings(&sram.gp1, 1);
-    mcp_print_gpio_settings(&sram.gp2, 2);
-    mcp_print_gpio_settings(&sram.gp3, 3);
+    mcp_spi_transfer(&pins, mode, tx, rx, argc, &stats);
 
-    //
-    // Get GPIO values.
-    //
-    unsigned char get_gpio[1] = { MCP_CMD_GETGPIO };
-    mcp_reply_gpio_t gpio;
-    hid_send_recv(get_gpio, sizeof(get_gpio), &gpio, sizeof(gpio));
-    if (gpio.command_code != get_gpio[0] ||
-        gpio.status != 0)
-    {
-        fprintf(stderr, "Bad reply from GETGPIO request!\n");
+    if (pins.miso >= 0) {
+        for (i=0; i<argc; i++) {
+            printf("%s%02x", (i % 16 == 0) ? "" : " ", rx[i]);
+            if (i % 16 == 15 || i == argc-1)
+                printf("\n");
+        }
+    }
+    fprintf(stderr, "Transferred %u bits in %u reports (%u redundant updates dropped), %.0f bit/s.\n",
+        stats.nbits, stats.nreports, stats.nredundant,
+        stats.nsec ? stats.nbits * 1e9 / stats.nsec : 0.0);
+    free(tx);
+    free(rx);
+}
+
+//
+// Reset the chip, wait until it comes back, and check it responds.
+// New flash settings take effect after reset.
+//
+static void mcp_reset()
+{
+    unsigned char reset[4] = { MCP_CMD_RESET, 0xab, 0xcd, 0xef };
+    mcp_reply_status_t status;
+    unsigned long long t0 = time_nsec();
+
+    if (hid_reset(reset, sizeof(reset), RESET_MSEC) < 0) {
+        fprintf(stderr, "Device did not come back after reset!\n");
         exit(-1);
     }
-    printf("--- GPIO ---\n");
-    mcp_print_gpio(&gpio);
+    mcp_get_status(&status);
+    printf("Reset completed in %.1f msec.\n", (time_nsec() - t0) / 1e6);
 }
 
 int main(int argc, char **argv)
 {
-    int read_flag = 0;
+    int read_flag = 0, export_port = 0, interval_msec = 1000;
+    const char *shm_name = 0, *broker_path = 0, *poll_config = 0;
+    const char *output = 0, *log_file = 0, *query_file = 0;
+    int regread_flag = 0, regwrite_flag = 0, reg_width = 8;
+    int reset_flag = 0, monitor_flag = 0, watch_flag = 0;
+    int decimate_ratio = 0, decimate_order = 1, vdd_mvolt = 5000;
+    const char *spi_pins = 0;
+    int spi_mode = 0;
+    const char *record_file = 0, *replay_file = 0;
+    double latency_scale = 1;
+    const char *rt_cpus = 0, *trigger = 0, *control = 0;
+    const char *profile_save = 0, *profile_restore = 0, *soak = 0;
+    const char *acquire = 0;
 
     copyright = "Copyright (C) 2019 Serge Vakulenko";
     trace_flag = 0;
+
+    // Status is answered at once; flash is written for tens of milliseconds.
+    hid_set_deadline(MCP_CMD_STATUSSET, 100);
+    hid_set_deadline(MCP_CMD_READFLASH, 1000);
+    hid_set_deadline(MCP_CMD_WRITEFLASH, 2000);
+    hid_set_deadline(MCP_CMD_FLASHPASS, 2000);
     for (;;) {
-        switch (getopt(argc, argv, "tr")) {
+        switch (getopt(argc, argv, "trx:s:b:p:o:f:i:RWA:T:kzau:Pc:wl:q:D:C:V:S:m:Y:y:F:E:g:K:M:L:B:N:")) {
         case 'r': ++read_flag;  continue;
         case 't': ++trace_flag;  continue;
+        case 'x':
+            export_port = strtol(optarg, 0, 0);
+            if (export_port <= 0 || export_port > 65535)
+                usage();
+            continue;
+        case 's': shm_name = optarg; continue;
+        case 'b': broker_path = optarg; continue;
+        case 'p': poll_config = optarg; continue;
+        case 'o': output = optarg; continue;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0)
+                binary_flag = 0;
+            else if (strcmp(optarg, "bin") == 0)
+                binary_flag = 1;
+            else
+                usage();
+            continue;
+        case 'R': ++regread_flag; continue;
+        case 'W': ++regwrite_flag; continue;
+        case 'A':
+            reg_width = strtol(optarg, 0, 0);
+            if (reg_width != 8 && reg_width != 16)
+                usage();
+            continue;
+        case 'T': parse_retry_policy(optarg); continue;
+        case 'k': hid_set_reconnect(1); continue;
+        case 'z': ++reset_flag; continue;
+        case 'a': ++monitor_flag; continue;
+        case 'u': uart_baud = parse_number(optarg, 300, 1000000); continue;
+        case 'P': ++pty_flag; continue;
+        case 'c': uart_capture = optarg; continue;
+        case 'w': ++watch_flag; continue;
+        case 'l': log_file = optarg; continue;
+        case 'q': query_file = optarg; continue;
+        case 'D': decimate_ratio = parse_number(optarg, 1, DSP_MAX_RATIO); continue;
+        case 'C': decimate_order = parse_number(optarg, 1, DSP_MAX_ORDER); continue;
+        case 'S': spi_pins = optarg; continue;
+        case 'Y': record_file = optarg; continue;
+        case 'E': rt_cpus = optarg; continue;
+        case 'g': trigger = optarg; continue;
+        case 'K': control = optarg; continue;
+        case 'M': profile_save = optarg; continue;
+        case 'L': profile_restore = optarg; continue;
+        case 'B': soak = optarg; continue;
+        case 'N': acquire = optarg; continue;
+        case 'y': replay_file = optarg; continue;
+        case 'F':
+            latency_scale = strtod(optarg, 0);
+            if (latency_scale < 0)
+                usage();
+            continue;
+        case 'm': spi_mode = parse_number(optarg, 0, 3); continue;
+        case 'V':
+            vdd_mvolt = strtod(optarg, 0) * 1000;
+            if (vdd_mvolt < 1000 || vdd_mvolt > 6000)
+                usage();
+            continue;
+        case 'i':
+            interval_msec = strtol(optarg, 0, 0);
+            if (interval_msec <= 0)
+                usage();
+            continue;
         default:
             usage();
         case EOF:
@@ -439,6 +667,15 @@ int main(int argc, char **argv)
     setvbuf(stdout, 0, _IOLBF, 0);
     setvbuf(stderr, 0, _IOLBF, 0);
 
+    if (record_file && replay_file)
+        usage();
+    if (record_file)
+        hid_record_open(record_file);
+    if (replay_file)
+        hid_replay_open(replay_file, latency_scale);
+    if (rt_cpus)
+        rt_start(rt_cpus);
+
     if (read_flag) {
         if (argc != 0)
             usage();
@@ -446,8 +683,143 @@ int main(int argc, char **argv)
         mcp_connect();
         mcp_download();
         mcp_disconnect();
+    } else if (export_port) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_export(export_port, interval_msec);
+        mcp_disconnect();
+    } else if (shm_name) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_publish(shm_name, interval_msec);
+        mcp_disconnect();
+    } else if (broker_path) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_broker(broker_path);
+        mcp_disconnect();
+    } else if (poll_config) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_poll_sensors(poll_config, output, binary_flag);
+        mcp_disconnect();
+    } else if (watch_flag) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_watch(output, interval_msec);
+        mcp_disconnect();
+    } else if (trigger) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_trigger(trigger, output, interval_msec);
+        mcp_disconnect();
+    } else if (control) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_control(control, output, interval_msec);
+        mcp_disconnect();
+    } else if (log_file) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_log(log_file, interval_msec, vdd_mvolt);
+        mcp_disconnect();
+    } else if (query_file) {
+        if (argc > 2)
+            usage();
+
+        mcp_query(query_file, argc > 0 ? strtod(argv[0], 0) : 0,
+            argc > 1 ? strtod(argv[1], 0) : 1e12, decimate_ratio, decimate_order);
+    } else if (decimate_ratio) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_capture(output, interval_msec, decimate_ratio, decimate_order, vdd_mvolt);
+        mcp_disconnect();
+    } else if (regread_flag) {
+        if (argc != 3)
+            usage();
+
+        mcp_connect();
+        mcp_read_registers(argv, reg_width);
+        mcp_disconnect();
+    } else if (regwrite_flag) {
+        if (argc < 3)
+            usage();
+
+        mcp_connect();
+        mcp_write_registers(argc, argv, reg_width);
+        mcp_disconnect();
+    } else if (spi_pins) {
+        if (argc < 1)
+            usage();
+
+        mcp_connect();
+        mcp_spi(argc, argv, spi_pins, spi_mode);
+        mcp_disconnect();
+    } else if (soak) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_soak(soak, output);
+        mcp_disconnect();
+    } else if (profile_save) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_profile_save(profile_save);
+        mcp_disconnect();
+    } else if (profile_restore) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_profile_restore(profile_restore);
+        mcp_disconnect();
+    } else if (reset_flag) {
+        if (argc != 0)
+            usage();
+
+        mcp_connect();
+        mcp_reset();
+        mcp_disconnect();
+    } else if (monitor_flag) {
+        // Several chips: no single UART to relay.
+        if (argc != 0 || uart_baud)
+            usage();
+
+        mcp_monitor(MCP2221_VID, MCP2221_PID, interval_msec);
+    } else if (acquire) {
+        if (argc != 0 || uart_baud)
+            usage();
+
+        mcp_acquire(MCP2221_VID, MCP2221_PID, acquire, output, interval_msec);
+    } else if (uart_baud) {
+        if (argc != 0)
+            usage();
+
+        mcp_uart(MCP2221_VID, MCP2221_PID, uart_baud, pty_flag, uart_capture, binary_flag);
     } else {
         usage();
     }
+    rt_report();
     return 0;
 }
@@ -21,6 +21,9 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#ifndef MCP2221_H
+#define MCP2221_H
+
 #include <stdint.h>
 #pragma pack(1)
 
@@ -57,6 +60,29 @@ enum {
     MCP_FLASH_FACTORYSERIAL         = 0x05,
 };
 
+//
+// Internal state of I2C engine, reported in byte 8 of STATUSSET reply,
+// and in byte 2 of I2C replies.
+//
+enum {
+    MCP_I2C_STATE_IDLE              = 0x00,
+    MCP_I2C_STATE_START_TIMEOUT     = 0x12,
+    MCP_I2C_STATE_RSTART_TIMEOUT    = 0x17,
+    MCP_I2C_STATE_WRADDR_TIMEOUT    = 0x23,
+    MCP_I2C_STATE_ADDR_NACK         = 0x25,
+    MCP_I2C_STATE_PARTIAL_DATA      = 0x41,
+    MCP_I2C_STATE_WRDATA_TIMEOUT    = 0x44,
+    MCP_I2C_STATE_WRITING_NOSTOP    = 0x45,
+    MCP_I2C_STATE_RDDATA_TIMEOUT    = 0x52,
+    MCP_I2C_STATE_STOP_TIMEOUT      = 0x62,
+};
+
+#define MCP_I2C_MAXDATA     60      // Max data bytes in one I2C report
+#define MCP_I2C_MAXREGS     4096    // Max registers in one block transfer
+#define MCP_I2C_READ_ERROR  0x7f    // Data length in I2CREAD_GET reply on error
+#define MCP_I2C_ADDR_NACK   0x40    // Bit in i2c_ack_status of STATUSSET reply
+#define MCP_I2C_CANCEL      0x10    // Cancel current I2C transfer in STATUSSET
+
 //
 // Status/Set Parameters
 //
@@ -90,7 +116,7 @@ typedef struct {
     uint16_t i2c_address;           // I2C address being used
     uint8_t  unused18;              // Don’t care
     uint8_t  unused19;              // Don’t care
-    uint8_t  unused20;              // Don’t care
+    uint8_t  i2c_ack_status;        // Bit 6 = slave address was not acknowledged
     uint8_t  unused21;              // Don’t care
     uint8_t  scl_input;             // SCL line value, as read from the pin
     uint8_t  sda_input;             // SDA line value, as read from the pin
@@ -273,6 +299,85 @@ typedef struct {
     mcp_gpio_config_t gp3;          // GP3 Power-Up Settings
 } mcp_reply_sram_data_t;
 
+//
+// Set SRAM Settings.
+// Every field is applied only when its bit 7 (MCP_SRAM_ALTER) is set.
+//
+typedef struct {
+    uint8_t  command_code;          // 0x60 = MCP_CMD_SETSRAM
+    uint8_t  unused1;               // Don’t care
+    uint8_t  clock_output;          // Clock output duty cycle and divider
+    uint8_t  dac_reference;         // Bits 2-1: Vrm option, bit 0: 1 = Vrm, 0 = Vdd
+    uint8_t  dac_value;             // Bits 4-0: DAC output value
+    uint8_t  adc_reference;         // Bits 2-1: Vrm option, bit 0: 1 = Vrm, 0 = Vdd
+    uint8_t  interrupt;             // Bit 4: alter positive edge, bit 3: enable it
+                                    // Bit 2: alter negative edge, bit 1: enable it
+                                    // Bit 0: clear interrupt flag
+    uint8_t  alter_gpio;            // Bit 7: apply GPx settings below
+    mcp_gpio_config_t gp[4];        // GPx settings
+} mcp_cmd_set_sram_t;
+
+#define MCP_SRAM_ALTER      0x80    // Apply the field of SETSRAM command
+
+//
+// Set GPIO Output Values.
+// Value and direction of a pin are applied only when
+// the corresponding alter byte is non-zero.
+//
+typedef struct {
+    uint8_t  command_code;          // 0x50 = MCP_CMD_SETGPIO
+    uint8_t  unused1;               // Don’t care
+    struct {
+        uint8_t alter_value;        // 1 = apply the output value
+        uint8_t value;              // Output value
+        uint8_t alter_direction;    // 1 = apply the direction
+        uint8_t direction;          // Direction (0 output, 1 input)
+    } gp[4];
+} mcp_cmd_set_gpio_t;
+
+typedef struct {
+    uint8_t  command_code;          // 0x50 = MCP_CMD_SETGPIO
+    uint8_t  status;                // 0x00 = Command completed successfully
+    struct {
+        uint8_t unused1;            // Don’t care
+        uint8_t value;              // Output value, or MCP_GPIO_NOT_GPIO
+        uint8_t unused2;            // Don’t care
+        uint8_t direction;          // Direction, or MCP_GPIO_NOT_GPIO
+    } gp[4];
+} mcp_reply_set_gpio_t;
+
+#define MCP_GPIO_NOT_GPIO   0xee    // Pin value or direction in GETGPIO and
+                                    // SETGPIO replies, when pin is not GPIO
+
+//
+// I2C Write Data, I2C Read Data
+//
+typedef struct {
+    uint8_t  command_code;          // MCP_CMD_I2CWRITE* or MCP_CMD_I2CREAD*
+    uint16_t length;                // Requested I2C transfer length
+    uint8_t  address;               // Slave address shifted left, bit 0 = read
+    uint8_t  data[MCP_I2C_MAXDATA]; // Data to write
+} mcp_cmd_i2c_t;
+
+typedef struct {
+    uint8_t  command_code;          // MCP_CMD_I2CWRITE* or MCP_CMD_I2CREAD*
+    uint8_t  status;                // 0x00 = Command completed successfully
+                                    // 0x01 = I2C engine is busy
+    uint8_t  i2c_state;             // Internal I2C state machine state value
+} mcp_reply_i2c_t;
+
+//
+// Get I2C Data
+//
+typedef struct {
+    uint8_t  command_code;          // 0x40 = MCP_CMD_I2CREAD_GET
+    uint8_t  status;                // 0x00 = Command completed successfully
+                                    // 0x41 = Error reading data from I2C engine
+    uint8_t  i2c_state;             // Internal I2C state machine state value
+    uint8_t  nbytes;                // Number of data bytes, 0x7f = read error
+    uint8_t  data[MCP_I2C_MAXDATA]; // Data received from the slave
+} mcp_reply_i2c_data_t;
+
 //
 // Get GPIO Values
 //
@@ -290,3 +395,96 @@ typedef struct {
 } mcp_reply_gpio_t;
 
 #pragma pack()
+
+//
+// Descriptor of a request: contents of the command
+// and rules to validate the reply.  Requests longer than
+// two bytes carry data, which is filled by the caller.
+//
+typedef struct {
+    const char *name;               // for error messages
+    uint8_t  code;                  // command code
+    uint8_t  subcode;               // second byte of command
+    uint8_t  length;                // number of command bytes
+    uint8_t  check;                 // validation rules
+    uint8_t  size;                  // expected size of reply
+} mcp_command_t;
+
+//
+// Validation rules of reply.
+//
+#define MCP_CHECK_STATUS    0x01    // status byte must be zero
+#define MCP_CHECK_NBYTES    0x02    // byte 2 is the size, minus 4
+#define MCP_CHECK_SRAM      0x04    // bytes 2 and 3 are sizes of two areas
+#define MCP_CHECK_STRING    0x08    // byte 2 is the length of string descriptor
+#define MCP_CHECK_DATA      0x10    // byte 2 is the length of data
+#define MCP_CHECK_GPIO      0x20    // pins altered by SETGPIO must be GPIO
+
+//
+// Known requests, index in mcp_commands[] table.
+//
+enum {
+    MCP_REQ_STATUS,
+    MCP_REQ_CHIPSETTINGS,
+    MCP_REQ_GPIOSETTINGS,
+    MCP_REQ_USBMANUFACTURER,
+    MCP_REQ_USBPRODUCT,
+    MCP_REQ_USBSERIAL,
+    MCP_REQ_FACTORYSERIAL,
+    MCP_REQ_GETSRAM,
+    MCP_REQ_GETGPIO,
+    MCP_REQ_SETSRAM,
+    MCP_REQ_SETGPIO,
+    MCP_NREQUESTS
+};
+
+extern const mcp_command_t mcp_commands[MCP_NREQUESTS];
+
+//
+// Execute a request from the table, and validate the reply.
+// Return pointer to the reply, which stays valid until the next request.
+// Terminate in case of bad reply.
+//
+const void *mcp_execute(int req);
+
+//
+// Send prepared reports (64 bytes each) back to back, and validate
+// every reply against the table entry of its command.
+// Terminate in case of unknown request or bad reply.
+//
+void mcp_execute_batch(const unsigned char *reqs, unsigned count, unsigned char *replies);
+
+//
+// Requests to the MCP2221 chip.
+//
+void mcp_get_status(mcp_reply_status_t *status);
+void mcp_get_gpio(mcp_reply_gpio_t *gpio);
+
+//
+// I2C transfers: return 0 on success, -1 on failure.
+// Address is 7-bit.
+//
+int mcp_i2c_write(int cmd, int addr, const uint8_t *data, int nbytes);
+int mcp_i2c_read(int cmd, int addr, uint8_t *data, int nbytes);
+int mcp_i2c_read_regs(int addr, int reg, int reg_width, uint8_t *data, int nbytes);
+int mcp_i2c_write_regs(int addr, int reg, int reg_width, const uint8_t *data, int nbytes);
+void mcp_i2c_cancel(void);
+
+//
+// Bit-bang SPI on GPIO pins.
+//
+typedef struct {
+    int sck, mosi, miso, cs;        // GPx pin numbers, -1 when not used
+} mcp_spi_pins_t;
+
+typedef struct {
+    unsigned nbits;                 // bits transferred
+    unsigned nreports;              // reports sent to the chip
+    unsigned nredundant;            // pin updates dropped as redundant
+    unsigned long long nsec;        // time of the batch
+} mcp_bitbang_stats_t;
+
+void mcp_spi_transfer(const mcp_spi_pins_t *pins, int mode,
+    const uint8_t *tx, uint8_t *rx, int nbytes, mcp_bitbang_stats_t *stats);
+
+#endif /* MCP2221_H */
@@ -0,0 +1,334 @@
+/*
+ * C++20 coroutine interface to MCP2221 chips.
+ *
+ * Every operation is an awaitable object, which embeds the request
+ * and the reply buffer.  Awaiting it submits the request through
+ * the asynchronous API (async.h), and the coroutine is resumed
+ * from hid_async_dispatch() when the reply arrives.  Nothing is
+ * allocated per operation, so many conversations with many devices
+ * run on one thread:
+ *
+ *      mcp::task watch(hid_device_t *dev)
+ *      {
+ *          for (;;) {
+ *              auto status = co_await mcp::get_status(dev);
+ *              if (!status)
+ *                  break;
+ *              printf("ADC0 = %u\n", status->adc_ch0);
+ *          }
+ *      }
+ *
+ *      watch(dev);
+ *      for (;;)
+ *          mcp::poll_once(-1);
+ *
+ * The result of co_await is std::optional of the reply structure
+ * from mcp2221.h; it is empty when the USB transfer failed, or
+ * when the chip reported an error.  I2C replies are returned as is:
+ * the caller should check status and I2C engine state.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MCP2221_HPP
+#define MCP2221_HPP
+
+#include <coroutine>
+#include <optional>
+#include <cstring>
+#include <cstdint>
+#include <exception>
+#include <poll.h>
+#include "mcp2221.h"
+#include "async.h"
+
+namespace mcp {
+
+//
+// Generic reply, for commands which return only the status.
+//
+#pragma pack(1)
+struct reply_t {
+    uint8_t command_code;           // same as in request
+    uint8_t status;                 // 0x00 = Command completed successfully
+    uint8_t data[62];               // depends on command
+};
+#pragma pack()
+
+//
+// Check of reply contents, beyond the status byte.
+// Return false when the reply means failure.
+//
+typedef bool (*reply_check_t)(const uint8_t *data, const uint8_t *reply);
+
+//
+// Awaitable request with reply of type Reply.
+// When check_status is set, non-zero status byte of the reply
+// is treated as failure.  Null data means invalid parameters:
+// the request fails at once, without I/O.
+//
+template <typename Reply, bool check_status = true>
+class request {
+public:
+    request(hid_device_t *dev, const uint8_t *data, size_t nbytes,
+        reply_check_t check = nullptr) : dev_(dev), check_(check)
+    {
+        static_assert(sizeof(Reply) <= sizeof(req_.reply), "reply too large");
+        std::memset(&req_, 0, sizeof(req_));
+        if (data)
+            std::memcpy(req_.data, data, nbytes);
+        else
+            req_.status = -1;
+        req_.arg = this;
+        req_.callback = &request::done;
+    }
+
+    // The request is linked into device queue while in flight.
+    request(const request&) = delete;
+    request &operator=(const request&) = delete;
+
+    bool await_ready() const noexcept { return req_.status < 0; }
+
+    void await_suspend(std::coroutine_handle<> caller)
+    {
+        caller_ = caller;
+        hid_async_submit(dev_, &req_);
+    }
+
+    std::optional<Reply> await_resume() const
+    {
+        if (req_.status < 0 || req_.reply[0] != req_.data[0] ||
+            (check_status && req_.reply[1] != 0) ||
+            (check_ && !check_(req_.data, req_.reply)))
+            return std::nullopt;
+
+        Reply reply;
+        std::memcpy(&reply, req_.reply, sizeof(reply));
+        return reply;
+    }
+
+private:
+    static void done(hid_request_t *req)
+    {
+        static_cast<request*>(req->arg)->caller_.resume();
+    }
+
+    hid_device_t *dev_;
+    reply_check_t check_;
+    hid_request_t req_;
+    std::coroutine_handle<> caller_;
+};
+
+//
+// Get status and ADC values.
+//
+inline request<mcp_reply_status_t> get_status(hid_device_t *dev)
+{
+    const uint8_t cmd[] = { MCP_CMD_STATUSSET };
+    return { dev, cmd, sizeof(cmd) };
+}
+
+//
+// Cancel current I2C transfer.
+//
+inline request<mcp_reply_status_t> i2c_cancel(hid_device_t *dev)
+{
+    const uint8_t cmd[] = { MCP_CMD_STATUSSET, 0, MCP_I2C_CANCEL };
+    return { dev, cmd, sizeof(cmd) };
+}
+
+//
+// Read flash data.  Reply type depends on subcode:
+// mcp_reply_chip_settings_t for MCP_FLASH_CHIPSETTINGS,
+// mcp_reply_gpio_settings_t for MCP_FLASH_GPIOSETTINGS,
+// reply_t for strings.
+//
+template <typename Reply = reply_t>
+inline request<Reply> read_flash(hid_device_t *dev, int subcode)
+{
+    const uint8_t cmd[] = { MCP_CMD_READFLASH, (uint8_t) subcode };
+    return { dev, cmd, sizeof(cmd) };
+}
+
+//
+// Write flash data: up to 62 bytes of parameters after subcode.
+//
+inline request<reply_t> write_flash(hid_device_t *dev, int subcode,
+    const void *data, size_t nbytes)
+{
+    uint8_t cmd[64] = { MCP_CMD_WRITEFLASH, (uint8_t) subcode };
+
+    std::memcpy(cmd + 2, data, nbytes < 62 ? nbytes : 62);
+    return { dev, cmd, sizeof(cmd) };
+}
+
+//
+// Get SRAM settings.
+//
+inline request<mcp_reply_sram_data_t> get_sram(hid_device_t *dev)
+{
+    const uint8_t cmd[] = { MCP_CMD_GETSRAM };
+    return { dev, cmd, sizeof(cmd) };
+}
+
+//
+// Set SRAM settings: up to 63 bytes of parameters after the command code.
+//
+inline request<reply_t> set_sram(hid_device_t *dev, const void *data, size_t nbytes)
+{
+    uint8_t cmd[64] = { MCP_CMD_SETSRAM };
+
+    std::memcpy(cmd + 1, data, nbytes < 63 ? nbytes : 63);
+    return { dev, cmd, sizeof(cmd) };
+}
+
+//
+// Get GPIO values.
+//
+inline request<mcp_reply_gpio_t> get_gpio(hid_device_t *dev)
+{
+    const uint8_t cmd[] = { MCP_CMD_GETGPIO };
+    return { dev, cmd, sizeof(cmd) };
+}
+
+//
+// Reply to SETGPIO fails when an altered pin is not configured as GPIO.
+//
+inline bool set_gpio_ok(const uint8_t *data, const uint8_t *reply)
+{
+    const mcp_cmd_set_gpio_t *set = (const mcp_cmd_set_gpio_t*) data;
+    const mcp_reply_set_gpio_t *r = (const mcp_reply_set_gpio_t*) reply;
+
+    for (int pin = 0; pin < 4; pin++) {
+        if ((set->gp[pin].alter_value && r->gp[pin].value == MCP_GPIO_NOT_GPIO) ||
+            (set->gp[pin].alter_direction && r->gp[pin].direction == MCP_GPIO_NOT_GPIO))
+            return false;
+    }
+    return true;
+}
+
+//
+// Set output value of one GPIO pin 0-3.
+// Fails when the pin is not configured as GPIO.
+//
+inline request<mcp_reply_set_gpio_t> set_gpio(hid_device_t *dev, int pin, int value)
+{
+    mcp_cmd_set_gpio_t cmd = {};
+
+    if (pin < 0 || pin > 3)
+        return { dev, nullptr, 0 };
+    cmd.command_code = MCP_CMD_SETGPIO;
+    cmd.gp[pin].alter_value = 1;
+    cmd.gp[pin].value = (value != 0);
+    return { dev, (const uint8_t*) &cmd, sizeof(cmd), set_gpio_ok };
+}
+
+//
+// Set direction of one GPIO pin 0-3: 0 = output, 1 = input.
+// Fails when the pin is not configured as GPIO.
+//
+inline request<mcp_reply_set_gpio_t> set_gpio_direction(hid_device_t *dev, int pin, int input)
+{
+    mcp_cmd_set_gpio_t cmd = {};
+
+    if (pin < 0 || pin > 3)
+        return { dev, nullptr, 0 };
+    cmd.command_code = MCP_CMD_SETGPIO;
+    cmd.gp[pin].alter_direction = 1;
+    cmd.gp[pin].direction = (input != 0);
+    return { dev, (const uint8_t*) &cmd, sizeof(cmd), set_gpio_ok };
+}
+
+//
+// Send one report of I2C write: up to 60 bytes.
+// Command is MCP_CMD_I2CWRITE, MCP_CMD_I2CWRITE_NOSTOP
+// or MCP_CMD_I2CWRITE_REPEATSTART; total is the length
+// of the whole transfer.  Address is 7-bit.
+//
+inline request<mcp_reply_i2c_t, false> i2c_write(hid_device_t *dev, int cmd,
+    int addr, const uint8_t *data, size_t nbytes, size_t total)
+{
+    mcp_cmd_i2c_t req = {};
+
+    req.command_code = cmd;
+    req.length = total;
+    req.address = addr << 1;
+    std::memcpy(req.data, data, nbytes < MCP_I2C_MAXDATA ? nbytes : MCP_I2C_MAXDATA);
+    return { dev, (const uint8_t*) &req, sizeof(req) };
+}
+
+//
+// Start I2C read of given length.
+// Command is MCP_CMD_I2CREAD or MCP_CMD_I2CREAD_REPEATSTART.
+//
+inline request<mcp_reply_i2c_t, false> i2c_read(hid_device_t *dev, int cmd,
+    int addr, size_t nbytes)
+{
+    mcp_cmd_i2c_t req = {};
+
+    req.command_code = cmd;
+    req.length = nbytes;
+    req.address = addr << 1 | 1;
+    return { dev, (const uint8_t*) &req, 4 };
+}
+
+//
+// Fetch data of I2C read, up to 60 bytes per report.
+//
+inline request<mcp_reply_i2c_data_t, false> i2c_get_data(hid_device_t *dev)
+{
+    const uint8_t cmd[] = { MCP_CMD_I2CREAD_GET };
+    return { dev, cmd, sizeof(cmd) };
+}
+
+//
+// Minimal coroutine type: starts immediately, runs detached,
+// and frees its frame on completion.  Use your own task type
+// when results or cancellation are needed.
+//
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+//
+// Wait for USB events up to given time (-1 = forever),
+// and resume the coroutines with completed requests.
+//
+inline void poll_once(int timeout_msec)
+{
+    struct pollfd fds[16];
+    int nfds = hid_async_pollfds(fds, 16);
+    int usb_timeout = hid_async_timeout();
+
+    if (usb_timeout >= 0 && (timeout_msec < 0 || usb_timeout < timeout_msec))
+        timeout_msec = usb_timeout;
+    poll(fds, nfds, timeout_msec);
+    hid_async_dispatch();
+}
+
+} // namespace mcp
+
+#endif /* MCP2221_HPP */
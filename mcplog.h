@@ -0,0 +1,230 @@
+/*
+ * Compact log of MCP2221 samples: ADC channels and GPIO pins.
+ *
+ * File layout:
+ *      mcplog_header_t
+ *      block 0, block 1, ...       each MCPLOG_BLOCK_SIZE bytes
+ *      index: mcplog_block_t for every block
+ *      mcplog_footer_t
+ *
+ * Every block starts with mcplog_block_t (time range and min/max
+ * of every ADC channel), followed by samples.  A sample is encoded
+ * as differences from the previous one:
+ *
+ *      varint  time jitter: zigzag(dt - interval), in microseconds
+ *      byte    mask: bits 0-2 = ADC channel changed, bit 3 = GPIO changed,
+ *              bit 4 = uncertainty changed
+ *      varint  zigzag(delta) of every changed ADC channel
+ *      byte    GPIO state, when changed: pins in bits 0-3, directions in 4-7
+ *      varint  zigzag(delta) of time uncertainty in microseconds, when changed
+ *
+ * The first sample of a block is encoded against zero state,
+ * so every block can be decoded independently.  The index at the end
+ * is a copy of all block headers, so a reader can find the blocks
+ * of interest without touching the rest of the file.  When the writer
+ * was killed before writing the index, a reader can still walk
+ * the block headers.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MCPLOG_H
+#define MCPLOG_H
+
+#include <stdint.h>
+
+#define MCPLOG_MAGIC        0x4c50434d  // 'MCPL'
+#define MCPLOG_VERSION      2
+#define MCPLOG_BLOCK_SIZE   4096        // size of one block in bytes
+#define MCPLOG_MAX_SAMPLE   24          // max size of encoded sample
+
+#define MCPLOG_CHANGED_GPIO 0x08        // bits in sample mask
+#define MCPLOG_CHANGED_ERR  0x10
+
+typedef struct {
+    uint32_t magic;                     // MCPLOG_MAGIC
+    uint32_t version;                   // MCPLOG_VERSION
+    uint32_t interval_usec;             // nominal sampling interval
+    uint32_t vref_mvolt;                // ADC reference, 0 when unknown
+    uint64_t start_realtime_nsec;       // wall clock time of t = 0
+} mcplog_header_t;
+
+typedef struct {
+    uint64_t t_first;                   // time of first sample, usec
+    uint64_t t_last;                    // time of last sample, usec
+    uint32_t nsamples;                  // number of samples in block
+    uint16_t nbytes;                    // bytes of encoded samples
+    uint16_t adc_min[3];                // min value of every ADC channel
+    uint16_t adc_max[3];                // max value of every ADC channel
+} mcplog_block_t;
+
+typedef struct {
+    uint64_t index_offset;              // file offset of the index
+    uint64_t nsamples;                  // total number of samples
+    uint32_t nblocks;                   // number of blocks
+    uint32_t magic;                     // MCPLOG_MAGIC
+} mcplog_footer_t;
+
+//
+// Decoded sample.
+//
+typedef struct {
+    uint64_t t;                         // time since start, usec
+    uint16_t adc[3];                    // ADC channels
+    uint8_t  gpio;                      // pins in bits 0-3, directions in 4-7
+    uint32_t err;                       // uncertainty of time, usec
+} mcplog_sample_t;
+
+#define MCPLOG_PAYLOAD  (MCPLOG_BLOCK_SIZE - sizeof(mcplog_block_t))
+
+static inline unsigned mcplog_put_varint(uint8_t *p, uint64_t v)
+{
+    unsigned n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+//
+// Get varint, not reading at or past the end.
+// Return -1 when the data is truncated or malformed.
+//
+static inline int mcplog_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    unsigned shift = 0;
+    uint8_t byte;
+
+    *v = 0;
+    do {
+        if (*p >= end || shift >= 64)
+            return -1;
+        byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return 0;
+}
+
+static inline uint64_t mcplog_zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t mcplog_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+//
+// Encode sample as difference from the previous one.
+// Return number of bytes stored.
+//
+static inline unsigned mcplog_encode(uint8_t *p, const mcplog_sample_t *s,
+    const mcplog_sample_t *prev, uint32_t interval_usec)
+{
+    unsigned n, i, mask = 0;
+
+    n = mcplog_put_varint(p, mcplog_zigzag((int64_t)(s->t - prev->t) - interval_usec));
+    for (i=0; i<3; i++)
+        if (s->adc[i] != prev->adc[i])
+            mask |= 1 << i;
+    if (s->gpio != prev->gpio)
+        mask |= MCPLOG_CHANGED_GPIO;
+    if (s->err != prev->err)
+        mask |= MCPLOG_CHANGED_ERR;
+    p[n++] = mask;
+    for (i=0; i<3; i++)
+        if (mask & (1 << i))
+            n += mcplog_put_varint(p + n, mcplog_zigzag((int)s->adc[i] - prev->adc[i]));
+    if (mask & MCPLOG_CHANGED_GPIO)
+        p[n++] = s->gpio;
+    if (mask & MCPLOG_CHANGED_ERR)
+        n += mcplog_put_varint(p + n, mcplog_zigzag((int64_t)s->err - prev->err));
+    return n;
+}
+
+//
+// Decode next sample, updating the previous one in place.
+// Return -1 when the data ends before the sample does.
+//
+static inline int mcplog_decode(const uint8_t **p, const uint8_t *end,
+    mcplog_sample_t *s, uint32_t interval_usec)
+{
+    unsigned i, mask;
+    uint64_t v;
+
+    if (mcplog_get_varint(p, end, &v) < 0 || *p >= end)
+        return -1;
+    s->t += mcplog_unzigzag(v) + interval_usec;
+    mask = *(*p)++;
+    for (i=0; i<3; i++) {
+        if (mask & (1 << i)) {
+            if (mcplog_get_varint(p, end, &v) < 0)
+                return -1;
+            s->adc[i] += mcplog_unzigzag(v);
+        }
+    }
+    if (mask & MCPLOG_CHANGED_GPIO) {
+        if (*p >= end)
+            return -1;
+        s->gpio = *(*p)++;
+    }
+    if (mask & MCPLOG_CHANGED_ERR) {
+        if (mcplog_get_varint(p, end, &v) < 0)
+            return -1;
+        s->err += mcplog_unzigzag(v);
+    }
+    return 0;
+}
+
+//
+// Decode all samples of a block.
+// Call func for every sample; stop when it returns non-zero.
+// Return the value from func, 0, or -1 when the block is damaged
+// (torn write of the last block, when the log was not closed).
+//
+static inline int mcplog_scan_block(const mcplog_block_t *block, uint32_t interval_usec,
+    int (*func)(const mcplog_sample_t *s, void *arg), void *arg)
+{
+    const uint8_t *p = (const uint8_t*) (block + 1);
+    const uint8_t *end = p + block->nbytes;
+    mcplog_sample_t s = { block->t_first - interval_usec };
+    uint32_t i;
+    int result;
+
+    if (block->nbytes > MCPLOG_PAYLOAD)
+        return -1;
+
+    // First sample has zero time jitter, relative to t_first - interval.
+    for (i=0; i<block->nsamples; i++) {
+        if (mcplog_decode(&p, end, &s, interval_usec) < 0)
+            return -1;
+        result = func(&s, arg);
+        if (result)
+            return result;
+    }
+    return 0;
+}
+
+#endif /* MCPLOG_H */
@@ -0,0 +1,150 @@
+/*
+ * Shared memory segment with live state of MCP2221 chip.
+ *
+ * One process (mcptool -s name) polls the device and publishes
+ * the decoded replies under a sequence lock.  Any number of readers
+ * can map the segment and take consistent snapshots without locks
+ * and, unless they meet an update in progress, without system calls:
+ *
+ *      mcpshm_t *shm = mcpshm_open("/mcp2221");
+ *      mcpshm_sample_t sample;
+ *
+ *      if (mcpshm_read(shm, &sample) == 0)
+ *          printf("ADC0 = %u\n", sample.status.adc_ch0);
+ *      mcpshm_close(shm);
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef MCPSHM_H
+#define MCPSHM_H
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "mcp2221.h"
+
+#define MCPSHM_MAGIC    0x4d435032      // 'MCP2'
+#define MCPSHM_VERSION  3
+#define MCPSHM_RETRIES  1000            // attempts to get a consistent sample
+
+//
+// One sample of device state.
+//
+typedef struct {
+    uint64_t nsamples;                  // number of this sample, from 1
+    uint64_t realtime_nsec;             // wall clock time of the sample
+    uint64_t monotonic_nsec;            // monotonic time of the sample
+    uint32_t latency_nsec;              // time spent for USB requests
+    uint32_t interval_usec;             // polling interval
+    uint32_t reconnects;                // changes when data have a gap
+    uint32_t err_nsec;                  // uncertainty of the time of sample
+    mcp_reply_status_t status;          // reply to STATUSSET request
+    mcp_reply_gpio_t gpio;              // reply to GETGPIO request
+} mcpshm_sample_t;
+
+//
+// Layout of shared memory segment.
+//
+typedef struct {
+    uint32_t magic;                     // MCPSHM_MAGIC
+    uint32_t version;                   // MCPSHM_VERSION
+    uint32_t seq;                       // odd while the sample is updated
+    uint32_t writer_pid;                // process id of the publisher
+    mcpshm_sample_t sample;             // latest data
+} mcpshm_t;
+
+//
+// Map the segment for reading.
+// Return NULL when the publisher is not running.
+//
+static inline mcpshm_t *mcpshm_open(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+
+    void *ptr = mmap(0, sizeof(mcpshm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return 0;
+
+    mcpshm_t *shm = (mcpshm_t*) ptr;
+    if (shm->magic != MCPSHM_MAGIC || shm->version != MCPSHM_VERSION) {
+        munmap(ptr, sizeof(mcpshm_t));
+        return 0;
+    }
+    return shm;
+}
+
+static inline void mcpshm_close(mcpshm_t *shm)
+{
+    munmap(shm, sizeof(mcpshm_t));
+}
+
+//
+// Get consistent copy of the latest sample.
+// Return 0 on success, or -1 when no data has been published yet,
+// or the publisher is stuck in the middle of an update.
+//
+static inline int mcpshm_read(const mcpshm_t *shm, mcpshm_sample_t *sample)
+{
+    uint32_t seq1, seq2;
+    int retries = 0;
+
+    do {
+        if (retries++ >= MCPSHM_RETRIES)
+            return -1;
+        seq1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq1 & 1) {
+            // Writer is active, try again, unless it was killed
+            // between the two updates of seq.
+            if (kill(shm->writer_pid, 0) < 0 && errno == ESRCH)
+                return -1;
+            sched_yield();
+            seq2 = seq1 + 1;
+            continue;
+        }
+        memcpy(sample, (const void*) &shm->sample, sizeof(*sample));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    } while (seq1 != seq2);
+
+    return (seq1 == 0) ? -1 : 0;
+}
+
+//
+// Update the sample; only one writer is allowed.
+//
+static inline void mcpshm_write(mcpshm_t *shm, const mcpshm_sample_t *sample)
+{
+    uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((void*) &shm->sample, sample, sizeof(*sample));
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#endif /* MCPSHM_H */
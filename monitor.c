@@ -0,0 +1,116 @@
+/*
+ * Monitor ADC inputs of all attached MCP2221 chips from one thread.
+ *
+ * Every device has its own STATUSSET request in flight; a single
+ * poll() loop waits for all of them, via the asynchronous API.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcp2221.h"
+#include "async.h"
+#include "util.h"
+
+typedef struct {
+    hid_device_t *dev;
+    hid_request_t req;                  // STATUSSET request
+    int pending;                        // request is in flight
+    unsigned long nfailed;              // failed requests
+} chip_t;
+
+static chip_t chips[HID_ASYNC_MAXDEV];
+static int nchips;
+static unsigned long long start_time;
+
+//
+// Reply to STATUSSET has been received.
+//
+static void status_done(hid_request_t *req)
+{
+    chip_t *chip = req->arg;
+    mcp_reply_status_t *status = (mcp_reply_status_t*) req->reply;
+
+    chip->pending = 0;
+    if (req->status < 0 || status->command_code != MCP_CMD_STATUSSET) {
+        chip->nfailed++;
+        return;
+    }
+    printf("%.3f %s %u %u %u\n", (time_nsec() - start_time) / 1e9,
+        hid_async_serial(chip->dev),
+        status->adc_ch0, status->adc_ch1, status->adc_ch2);
+}
+
+//
+// Open all chips with given VID/PID, and print ADC values
+// of every chip at given interval.
+//
+void mcp_monitor(int vid, int pid, int interval_msec)
+{
+    hid_device_t *devs[HID_ASYNC_MAXDEV];
+    unsigned long long next;
+    int i;
+
+    nchips = hid_async_open_all(vid, pid, devs, HID_ASYNC_MAXDEV);
+    if (nchips == 0) {
+        fprintf(stderr, "No MCP2221 chip detected.\n");
+        exit(-1);
+    }
+    for (i=0; i<nchips; i++) {
+        chips[i].dev = devs[i];
+        chips[i].req.callback = status_done;
+        chips[i].req.arg = &chips[i];
+        chips[i].req.data[0] = MCP_CMD_STATUSSET;
+        fprintf(stderr, "Monitor chip %s\n", hid_async_serial(devs[i]));
+    }
+
+    catch_stop_signals();
+    start_time = time_nsec();
+    next = start_time;
+    printf("# time serial adc0 adc1 adc2\n");
+    while (!stop_flag) {
+        unsigned long long now = time_nsec();
+
+        if (now >= next) {
+            // Skip the chips which did not answer the previous request.
+            for (i=0; i<nchips; i++) {
+                if (!chips[i].pending) {
+                    chips[i].pending = 1;
+                    hid_async_submit(chips[i].dev, &chips[i].req);
+                }
+            }
+            next += interval_msec * 1000000ULL;
+            if (next < now)
+                next = now + interval_msec * 1000000ULL;
+        }
+
+        // Wait for USB events, or for the next interval.
+        hid_async_wait(next);
+    }
+
+    for (i=0; i<nchips; i++) {
+        if (chips[i].nfailed > 0)
+            fprintf(stderr, "%s: %lu requests failed\n",
+                hid_async_serial(chips[i].dev), chips[i].nfailed);
+        hid_async_close(chips[i].dev);
+    }
+}
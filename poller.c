@@ -0,0 +1,332 @@
+/*
+ * Periodic polling of I2C sensor registers.
+ *
+ * Configuration file lists the registers to read, one per line:
+ *
+ *      # addr  reg     length  period_msec
+ *      0x48    0x00    2       100
+ *      0x48    0x02    2       100
+ *      0x76    0xf7    8       50
+ *
+ * Reads are scheduled on a timing wheel.  Reads which are due at the
+ * same tick and target adjacent registers of the same slave are merged
+ * into a single burst: register address written without stop, then
+ * data read with repeated start.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcp2221.h"
+#include "util.h"
+
+#define MAX_ENTRIES     64              // registers in configuration
+#define WHEEL_SIZE      1024            // slots of timing wheel
+#define TICK_NSEC       1000000ULL      // one slot is 1 msec
+#define MERGE_GAP       4               // read up to 4 unneeded bytes to merge
+
+typedef struct entry {
+    struct entry *next;                 // next in the same slot
+    int addr;                           // 7-bit slave address
+    int reg;                            // first register
+    int len;                            // number of bytes
+    int period;                         // period in ticks
+    int rounds;                         // full turns of wheel to wait
+} entry_t;
+
+static entry_t entries[MAX_ENTRIES];
+static int nentries;
+
+static entry_t *wheel[WHEEL_SIZE];
+static int slot_count[WHEEL_SIZE];
+
+//
+// Binary record of output stream, followed by data bytes.
+//
+#pragma pack(1)
+typedef struct {
+    uint64_t nsec;                      // time since start
+    uint8_t  addr;                      // slave address
+    uint8_t  reg;                       // first register
+    uint8_t  len;                       // number of data bytes
+    uint8_t  status;                    // 0 = success, 1 = failed,
+                                        // 2 = gap: device was reconnected
+} record_t;
+#pragma pack()
+
+static FILE *out;
+static int binary_output;
+static unsigned long long start_time;
+static unsigned long nreads, ntransactions, nfailed;
+static unsigned long nreconnects;
+
+//
+// Read configuration file.
+//
+static void read_config(const char *filename)
+{
+    char line[256];
+    int lineno = 0;
+    FILE *fd;
+
+    fd = fopen(filename, "r");
+    if (!fd) {
+        perror(filename);
+        exit(-1);
+    }
+    while (fgets(line, sizeof(line), fd)) {
+        char *p = strchr(line, '#');
+        int addr, reg, len, period;
+
+        lineno++;
+        if (p)
+            *p = 0;
+        p = line + strspn(line, " \t\r\n");
+        if (*p == 0)
+            continue;
+
+        if (sscanf(p, "%i %i %i %i", &addr, &reg, &len, &period) != 4 ||
+            addr < 0 || addr > 0x7f || reg < 0 || len <= 0 ||
+            reg + len > 256 || len > MCP_I2C_MAXDATA || period <= 0)
+        {
+            fprintf(stderr, "%s:%d: Bad line, need: addr reg length period_msec\n",
+                filename, lineno);
+            exit(-1);
+        }
+        if (nentries >= MAX_ENTRIES) {
+            fprintf(stderr, "%s:%d: Too many registers\n", filename, lineno);
+            exit(-1);
+        }
+        entry_t *e = &entries[nentries++];
+        e->addr = addr;
+        e->reg = reg;
+        e->len = len;
+        e->period = period * 1000000ULL / TICK_NSEC;
+    }
+    fclose(fd);
+    if (nentries == 0) {
+        fprintf(stderr, "%s: No registers to poll\n", filename);
+        exit(-1);
+    }
+}
+
+//
+// Put entry on the wheel, to be due after given number of ticks.
+//
+static void schedule(entry_t *e, unsigned long long now, int delay)
+{
+    int slot = (now + delay) % WHEEL_SIZE;
+
+    e->rounds = (delay - 1) / WHEEL_SIZE;
+    e->next = wheel[slot];
+    wheel[slot] = e;
+    slot_count[slot]++;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const entry_t *x = *(const entry_t**) a;
+    const entry_t *y = *(const entry_t**) b;
+
+    if (x->addr != y->addr)
+        return x->addr - y->addr;
+    return x->reg - y->reg;
+}
+
+//
+// Output data of one entry.
+//
+static void emit(entry_t *e, unsigned long long now, const uint8_t *data, int failed)
+{
+    int i;
+
+    if (binary_output) {
+        record_t rec;
+
+        rec.nsec = now - start_time;
+        rec.addr = e->addr;
+        rec.reg = e->reg;
+        rec.len = failed ? 0 : e->len;
+        rec.status = failed;
+        fwrite(&rec, sizeof(rec), 1, out);
+        fwrite(data, rec.len, 1, out);
+        return;
+    }
+
+    fprintf(out, "%.6f,0x%02x,0x%02x,%d,", (now - start_time) / 1e9,
+        e->addr, e->reg, e->len);
+    if (failed) {
+        fprintf(out, "failed\n");
+        return;
+    }
+    for (i=0; i<e->len; i++)
+        fprintf(out, "%02x", data[i]);
+    fprintf(out, "\n");
+}
+
+//
+// Mark a gap in the output stream, when the device has been reconnected.
+//
+static void check_gap(unsigned long long now)
+{
+    hid_stats_t stats;
+
+    hid_get_stats(&stats);
+    if (stats.reconnects == nreconnects)
+        return;
+    nreconnects = stats.reconnects;
+
+    if (binary_output) {
+        record_t rec;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.nsec = now - start_time;
+        rec.status = 2;
+        fwrite(&rec, sizeof(rec), 1, out);
+    } else {
+        fprintf(out, "# gap at %.6f: device reconnected\n", (now - start_time) / 1e9);
+    }
+}
+
+//
+// Read a burst of registers, and distribute data to the entries.
+//
+static void read_burst(entry_t **due, int n, int start, int end)
+{
+    uint8_t data[MCP_I2C_MAXDATA];
+    unsigned long long now;
+    int i, failed;
+
+    failed = mcp_i2c_read_regs(due[0]->addr, start, 8, data, end - start) < 0;
+    now = time_nsec();
+    ntransactions++;
+    if (failed)
+        nfailed++;
+    check_gap(now);
+
+    for (i=0; i<n; i++)
+        emit(due[i], now, data + due[i]->reg - start, failed);
+}
+
+//
+// Process all entries, which are due at the current tick.
+//
+static void process_slot(unsigned long long tick)
+{
+    entry_t *due[MAX_ENTRIES], **link;
+    int slot = tick % WHEEL_SIZE;
+    int i, n, first, start, end;
+
+    // Take due entries from the slot.
+    n = 0;
+    for (link = &wheel[slot]; *link; ) {
+        entry_t *e = *link;
+        if (e->rounds > 0) {
+            e->rounds--;
+            link = &e->next;
+            continue;
+        }
+        *link = e->next;
+        slot_count[slot]--;
+        due[n++] = e;
+    }
+    if (n == 0)
+        return;
+    nreads += n;
+
+    // Merge adjacent registers of the same slave.
+    qsort(due, n, sizeof(due[0]), compare_entries);
+    first = 0;
+    start = due[0]->reg;
+    end = start + due[0]->len;
+    for (i=1; i<n; i++) {
+        entry_t *e = due[i];
+        int e_end = e->reg + e->len;
+        if (e_end < end)
+            e_end = end;
+
+        if (e->addr == due[first]->addr &&
+            e->reg <= end + MERGE_GAP &&
+            e_end - start <= MCP_I2C_MAXDATA)
+        {
+            end = e_end;
+            continue;
+        }
+        read_burst(&due[first], i - first, start, end);
+        first = i;
+        start = e->reg;
+        end = e->reg + e->len;
+    }
+    read_burst(&due[first], n - first, start, end);
+
+    for (i=0; i<n; i++)
+        schedule(due[i], tick, due[i]->period);
+}
+
+//
+// Poll I2C registers listed in the configuration file.
+// Write results to the output file in CSV or binary format.
+//
+void mcp_poll_sensors(const char *config, const char *output, int binary)
+{
+    unsigned long long tick;
+    int i, k;
+
+    read_config(config);
+
+    out = stdout;
+    if (output) {
+        out = fopen(output, binary ? "wb" : "w");
+        if (!out) {
+            perror(output);
+            exit(-1);
+        }
+    }
+    binary_output = binary;
+    if (!binary)
+        fprintf(out, "# time,addr,reg,length,data\n");
+
+    // All entries are due at the first tick.
+    for (i=0; i<nentries; i++)
+        schedule(&entries[i], 0, WHEEL_SIZE);
+
+    catch_stop_signals();
+    start_time = time_nsec();
+    tick = 0;
+    while (!stop_flag) {
+        process_slot(tick);
+
+        // Skip empty slots.
+        for (k=1; k<WHEEL_SIZE; k++)
+            if (slot_count[(tick + k) % WHEEL_SIZE] > 0)
+                break;
+        tick += k;
+        sleep_until(start_time + tick * TICK_NSEC);
+    }
+
+    if (out != stdout)
+        fclose(out);
+    else
+        fflush(out);
+    fprintf(stderr, "Polled %lu registers in %lu transactions, %lu failed.\n",
+        nreads, ntransactions, nfailed);
+}
@@ -0,0 +1,206 @@
+/*
+ * Runtime profiles: snapshot of SRAM settings and GPIO state,
+ * saved into a file and restored later.
+ *
+ * Restore compares the profile with the live state of the chip,
+ * and sends only the fields which differ: at most one SETSRAM report
+ * (clock output, DAC and ADC references, DAC value, interrupt edges,
+ * GP designations) and one SETGPIO report (pin directions and
+ * output values).  Both go to the chip as one batch.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcp2221.h"
+#include "util.h"
+
+#define PROFILE_MAGIC   0x5350434d  // 'MCPS'
+#define PROFILE_VERSION 1
+
+#define NPINS           4
+
+typedef struct {
+    uint32_t magic;                 // PROFILE_MAGIC
+    uint32_t version;               // PROFILE_VERSION
+    mcp_reply_sram_data_t sram;     // reply of GETSRAM
+    mcp_reply_gpio_t gpio;          // reply of GETGPIO
+} profile_t;
+
+//
+// Read the live state of the chip.
+//
+static void profile_read(profile_t *prof)
+{
+    memset(prof, 0, sizeof(*prof));
+    prof->magic = PROFILE_MAGIC;
+    prof->version = PROFILE_VERSION;
+    memcpy(&prof->sram, mcp_execute(MCP_REQ_GETSRAM), sizeof(prof->sram));
+    mcp_get_gpio(&prof->gpio);
+}
+
+//
+// Convert the state into SETSRAM command, with every field altered.
+// Current direction and value of GPIO pins are taken from GETGPIO.
+//
+static void profile_command(const profile_t *prof, mcp_cmd_set_sram_t *cmd)
+{
+    const mcp_reply_sram_data_t *s = &prof->sram;
+    const uint8_t *pins = &prof->gpio.gp0_pin;
+    const mcp_gpio_config_t *gp[NPINS] = { &s->gp0, &s->gp1, &s->gp2, &s->gp3 };
+    int i;
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->command_code = MCP_CMD_SETSRAM;
+    cmd->clock_output = MCP_SRAM_ALTER | s->config1.clko_divider;
+    cmd->dac_reference = MCP_SRAM_ALTER | s->config2.dac_ref_sel << 1 | s->config2.dac_ref_en;
+    cmd->dac_value = MCP_SRAM_ALTER | s->config2.dac_power_up;
+    cmd->adc_reference = MCP_SRAM_ALTER | s->config3.adc_ref_sel << 1 | s->config3.adc_ref_en;
+    cmd->interrupt = MCP_SRAM_ALTER | 0x10 | s->config3.intr_pos << 3 |
+                                      0x04 | s->config3.intr_neg << 1;
+    cmd->alter_gpio = MCP_SRAM_ALTER;
+    for (i=0; i<NPINS; i++) {
+        cmd->gp[i] = *gp[i];
+        if (gp[i]->function == 0 && pins[2*i] != MCP_GPIO_NOT_GPIO) {
+            cmd->gp[i].output_val = pins[2*i] & 1;
+            cmd->gp[i].dir_input = pins[2*i + 1] & 1;
+        }
+    }
+}
+
+//
+// Save the live state of the chip into a profile file.
+//
+void mcp_profile_save(const char *filename)
+{
+    profile_t prof;
+    FILE *f;
+
+    profile_read(&prof);
+    f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        exit(-1);
+    }
+    if (fwrite(&prof, sizeof(prof), 1, f) != 1 || fclose(f) != 0) {
+        perror(filename);
+        exit(-1);
+    }
+    fprintf(stderr, "Profile saved to %s.\n", filename);
+}
+
+//
+// Restore the profile from file, sending only the differences.
+//
+void mcp_profile_restore(const char *filename)
+{
+    static const char *field_name[] = {
+        0, 0, "clock output", "DAC reference", "DAC value",
+        "ADC reference", "interrupt", "GP designation",
+    };
+    profile_t want, live;
+    mcp_cmd_set_sram_t want_cmd, live_cmd;
+    unsigned char reqs[2 * 64], replies[2 * 64], *sram;
+    mcp_cmd_set_gpio_t *gpio;
+    const uint8_t *w, *l;
+    int i, nreqs = 0, nfields = 0, npins = 0, designation = 0;
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(-1);
+    }
+    if (fread(&want, sizeof(want), 1, f) != 1 ||
+        want.magic != PROFILE_MAGIC || want.version != PROFILE_VERSION) {
+        fprintf(stderr, "%s: Not a profile.\n", filename);
+        exit(-1);
+    }
+    fclose(f);
+
+    profile_read(&live);
+    profile_command(&want, &want_cmd);
+    profile_command(&live, &live_cmd);
+
+    // SETSRAM: only the fields which differ.
+    sram = &reqs[0];
+    memset(sram, 0, 64);
+    sram[0] = MCP_CMD_SETSRAM;
+    w = (const uint8_t*) &want_cmd;
+    l = (const uint8_t*) &live_cmd;
+    for (i=2; i<=6; i++) {
+        if (w[i] != l[i]) {
+            sram[i] = w[i];
+            fprintf(stderr, "Restore %s.\n", field_name[i]);
+            nfields++;
+        }
+    }
+    for (i=0; i<NPINS; i++)
+        if (want_cmd.gp[i].function != live_cmd.gp[i].function)
+            designation = 1;
+    if (designation) {
+        // New designations bring pin directions and values along.
+        memcpy(&sram[7], &w[7], 1 + NPINS);
+        fprintf(stderr, "Restore %s.\n", field_name[7]);
+        nfields++;
+    }
+    if (nfields > 0)
+        nreqs++;
+
+    // SETGPIO: directions and output values, when designations stay.
+    gpio = (mcp_cmd_set_gpio_t*) &reqs[nreqs * 64];
+    memset(gpio, 0, 64);
+    gpio->command_code = MCP_CMD_SETGPIO;
+    if (!designation) {
+        for (i=0; i<NPINS; i++) {
+            const mcp_gpio_config_t *wp = &want_cmd.gp[i], *lp = &live_cmd.gp[i];
+
+            if (wp->function != 0)
+                continue;
+            if (wp->dir_input != lp->dir_input) {
+                gpio->gp[i].alter_direction = 1;
+                gpio->gp[i].direction = wp->dir_input;
+            }
+            // Value of input pin is what the pin sees, not ours.
+            if (!wp->dir_input && (wp->output_val != lp->output_val || gpio->gp[i].alter_direction)) {
+                gpio->gp[i].alter_value = 1;
+                gpio->gp[i].value = wp->output_val;
+            }
+            if (gpio->gp[i].alter_value || gpio->gp[i].alter_direction) {
+                fprintf(stderr, "Restore GP%d %s%s.\n", i,
+                    wp->dir_input ? "input" : "output",
+                    wp->dir_input ? "" : wp->output_val ? " high" : " low");
+                npins++;
+            }
+        }
+        if (npins > 0)
+            nreqs++;
+    }
+
+    if (nreqs == 0) {
+        fprintf(stderr, "Profile %s is already active.\n", filename);
+        return;
+    }
+    mcp_execute_batch(reqs, nreqs, replies);
+    fprintf(stderr, "Profile %s restored: %d fields, %d pins in %d reports.\n",
+        filename, nfields, npins, nreqs);
+}
@@ -0,0 +1,217 @@
+/*
+ * Real-time execution: memory locking, CPU pinning, SCHED_FIFO,
+ * and histogram of USB round trips.
+ *
+ * The main thread, which runs USB transfers of the HID interface,
+ * is pinned to the first CPU in the list; worker threads
+ * (UART relay) go to the second one, when given.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifdef __linux__
+#   define _GNU_SOURCE
+#   include <sched.h>
+#   include <malloc.h>
+#   include <sys/mman.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "util.h"
+
+//
+// Priority of our threads: below the kernel threads
+// which serve USB interrupts (priority 50 by default).
+//
+#define RT_PRIORITY     40
+
+#define PREFAULT_STACK  (256*1024)  // bytes of stack to touch in advance
+
+//
+// Round trips are counted with 1 usec resolution up to this limit.
+//
+#define HIST_USEC       20000
+
+static int rt_enabled;
+static int main_cpu = -1;
+static int worker_cpu = -1;
+
+static unsigned hist[HIST_USEC];    // count per microsecond of round trip
+static unsigned long hist_count;    // total round trips
+static unsigned long hist_overflow; // round trips above the limit
+static unsigned long long hist_sum; // sum of round trips, usec
+static unsigned long long hist_max; // longest round trip, usec
+
+//
+// Touch the stack, so that it is mapped before time-critical work.
+//
+static void prefault_stack()
+{
+    char buf[PREFAULT_STACK];
+    volatile char *p = buf;
+    int i;
+
+    // Store through a volatile pointer, one byte per page:
+    // a plain memset() is removed by the optimizer as a dead store.
+    for (i = 0; i < PREFAULT_STACK; i += 4096)
+        p[i] = 0;
+}
+
+//
+// Pin the calling thread to given CPU and make it real-time.
+//
+static void setup_thread(int cpu, const char *name)
+{
+#ifdef __linux__
+    struct sched_param param = { .sched_priority = RT_PRIORITY };
+    int error;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error)
+            fprintf(stderr, "Cannot pin %s thread to CPU %d: %s\n", name, cpu, strerror(error));
+    }
+    error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error)
+        fprintf(stderr, "Cannot set real-time priority of %s thread: %s\n", name, strerror(error));
+#endif
+    prefault_stack();
+}
+
+//
+// Enable real-time mode for the process.
+// CPU list is "main[,worker]"; empty means no pinning.
+//
+void rt_start(const char *cpus)
+{
+    char *end;
+
+    if (*cpus) {
+        main_cpu = strtol(cpus, &end, 0);
+        if (*end == ',')
+            worker_cpu = strtol(end + 1, &end, 0);
+        if (*end != 0 || main_cpu < 0) {
+            fprintf(stderr, "Bad CPU list: %s\n", cpus);
+            exit(-1);
+        }
+    }
+#ifdef __linux__
+    // Keep all memory resident: heap is never trimmed
+    // and never served by fresh mmap() regions.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        fprintf(stderr, "Cannot lock memory: %s\n", strerror(errno));
+#else
+    fprintf(stderr, "Warning: Real-time mode is not supported on this platform.\n");
+#endif
+    setup_thread(main_cpu, "main");
+    rt_enabled = 1;
+}
+
+//
+// Called by worker threads at start.
+//
+void rt_worker_thread()
+{
+    if (rt_enabled)
+        setup_thread(worker_cpu, "worker");
+}
+
+//
+// Account one round trip of USB request.
+//
+void rt_latency(unsigned long long nsec)
+{
+    unsigned long long usec = nsec / 1000;
+
+    if (usec < HIST_USEC)
+        hist[usec]++;
+    else
+        hist_overflow++;
+    hist_count++;
+    hist_sum += usec;
+    if (usec > hist_max)
+        hist_max = usec;
+}
+
+//
+// Find the round trip below which the given fraction of requests lies.
+//
+static unsigned long percentile(double fraction)
+{
+    unsigned long target = hist_count * fraction;
+    unsigned long seen = 0;
+    unsigned usec;
+
+    for (usec=0; usec<HIST_USEC; usec++) {
+        seen += hist[usec];
+        if (seen > target)
+            return usec;
+    }
+    return hist_max;
+}
+
+//
+// Print histogram of round trips, in power-of-two buckets.
+//
+void rt_report()
+{
+    unsigned long bucket, count, peak = 0;
+    unsigned usec, lo, hi;
+
+    if (!rt_enabled || hist_count == 0)
+        return;
+
+    fprintf(stderr, "Round trips: %lu, mean %.0f usec, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %llu usec\n",
+        hist_count, (double) hist_sum / hist_count, percentile(0.5), percentile(0.9),
+        percentile(0.99), percentile(0.999), hist_max);
+
+    for (lo=0; lo<HIST_USEC; lo=hi) {
+        hi = lo ? lo * 2 : 64;
+        for (count=0, usec=lo; usec<hi && usec<HIST_USEC; usec++)
+            count += hist[usec];
+        if (count > peak)
+            peak = count;
+    }
+    if (hist_overflow > peak)
+        peak = hist_overflow;
+
+    for (lo=0; lo<HIST_USEC; lo=hi) {
+        hi = lo ? lo * 2 : 64;
+        for (count=0, usec=lo; usec<hi && usec<HIST_USEC; usec++)
+            count += hist[usec];
+        if (count == 0)
+            continue;
+        fprintf(stderr, "  %6u-%-6u usec %8lu ", lo, hi, count);
+        for (bucket=0; bucket < (count * 40 + peak - 1) / peak; bucket++)
+            fputc('#', stderr);
+        fputc('\n', stderr);
+    }
+    if (hist_overflow > 0)
+        fprintf(stderr, "  %6u+       usec %8lu\n", HIST_USEC, hist_overflow);
+}
@@ -0,0 +1,173 @@
+/*
+ * Record USB session into a file, and replay it without hardware.
+ *
+ * In record mode, every hid_send_recv() request is saved together
+ * with the reply, the time it was sent and the time until the reply.
+ * In replay mode, the HID layer does not open any device: requests
+ * are compared with the recording, and recorded replies are served
+ * after the recorded latency, optionally scaled.  A session captured
+ * on a real board becomes a repeatable benchmark on any machine.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "util.h"
+
+#define RECORD_MAGIC    0x5250434d  // 'MCPR'
+#define RECORD_VERSION  1
+
+typedef struct {
+    uint32_t magic;                 // RECORD_MAGIC
+    uint32_t version;               // RECORD_VERSION
+} record_header_t;
+
+typedef struct {
+    uint64_t t_nsec;                // time of request since start of recording
+    uint32_t latency_nsec;          // time until the reply
+    uint32_t unused;
+    uint8_t  request[64];
+    uint8_t  reply[64];
+} record_entry_t;
+
+static FILE *record_file;           // recording in progress
+static FILE *replay_file;           // replay in progress
+static double latency_scale;        // multiplier for recorded latencies
+static unsigned long long start_time;
+static unsigned long nentries;      // requests recorded or replayed
+static unsigned long long recorded_nsec; // duration of replayed part of recording
+
+static FILE *open_file(const char *filename, const char *mode)
+{
+    FILE *f = fopen(filename, mode);
+
+    if (!f) {
+        perror(filename);
+        exit(-1);
+    }
+    return f;
+}
+
+void hid_record_open(const char *filename)
+{
+    record_header_t header = { RECORD_MAGIC, RECORD_VERSION };
+
+    record_file = open_file(filename, "wb");
+    if (fwrite(&header, sizeof(header), 1, record_file) != 1) {
+        perror(filename);
+        exit(-1);
+    }
+    start_time = time_nsec();
+}
+
+void hid_replay_open(const char *filename, double scale)
+{
+    record_header_t header;
+
+    replay_file = open_file(filename, "rb");
+    if (fread(&header, sizeof(header), 1, replay_file) != 1 ||
+        header.magic != RECORD_MAGIC || header.version != RECORD_VERSION) {
+        fprintf(stderr, "%s: Not a session recording.\n", filename);
+        exit(-1);
+    }
+    latency_scale = scale;
+    start_time = time_nsec();
+}
+
+int hid_recording()
+{
+    return record_file != 0;
+}
+
+int hid_replaying()
+{
+    return replay_file != 0;
+}
+
+//
+// Save the request and the reply.
+//
+void hid_record(const unsigned char *request, const unsigned char *reply,
+    unsigned long long t_send, unsigned long long t_recv)
+{
+    record_entry_t entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.t_nsec = t_send - start_time;
+    entry.latency_nsec = t_recv - t_send;
+    memcpy(entry.request, request, 64);
+    memcpy(entry.reply, reply, 64);
+    if (fwrite(&entry, sizeof(entry), 1, record_file) != 1) {
+        perror("Recording");
+        exit(-1);
+    }
+    nentries++;
+}
+
+//
+// Serve the next recorded reply.
+// Terminate when the request differs from the recording.
+//
+void hid_replay(const unsigned char *request, unsigned char *reply)
+{
+    static uint64_t first_nsec;
+    record_entry_t entry;
+    unsigned long long t0 = time_nsec();
+
+    if (fread(&entry, sizeof(entry), 1, replay_file) != 1) {
+        fprintf(stderr, "Replay: end of recording after %lu requests.\n", nentries);
+        exit(-1);
+    }
+    if (memcmp(entry.request, request, 64) != 0) {
+        fprintf(stderr, "Replay: request %lu differs from recording: %02x instead of %02x\n",
+            nentries, request[0], entry.request[0]);
+        exit(-1);
+    }
+    if (nentries == 0)
+        first_nsec = entry.t_nsec;
+    recorded_nsec = entry.t_nsec + entry.latency_nsec - first_nsec;
+    nentries++;
+
+    if (latency_scale > 0)
+        sleep_until(t0 + (unsigned long long) (entry.latency_nsec * latency_scale));
+    memcpy(reply, entry.reply, 64);
+}
+
+//
+// Finish recording or replay, and print a summary.
+//
+void hid_record_close()
+{
+    if (record_file) {
+        fclose(record_file);
+        record_file = 0;
+        fprintf(stderr, "Recorded %lu requests in %.3f seconds.\n",
+            nentries, (time_nsec() - start_time) / 1e9);
+    }
+    if (replay_file) {
+        fclose(replay_file);
+        replay_file = 0;
+        fprintf(stderr, "Replayed %lu requests in %.3f seconds, recorded %.3f seconds.\n",
+            nentries, (time_nsec() - start_time) / 1e9, recorded_nsec / 1e9);
+    }
+}
@@ -0,0 +1,153 @@
+/*
+ * Publish state of MCP2221 chip via shared memory.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mcp2221.h"
+#include "mcpshm.h"
+#include "timestamp.h"
+#include "util.h"
+
+//
+// Find the process which publishes to existing segment.
+// Return its pid, or 0 when the segment is stale.
+//
+static pid_t get_publisher(const char *name)
+{
+    struct stat st;
+    mcpshm_t *shm;
+    pid_t pid = 0;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(mcpshm_t)) {
+        shm = mmap(0, sizeof(mcpshm_t), PROT_READ, MAP_SHARED, fd, 0);
+        if (shm != MAP_FAILED) {
+            if (shm->magic == MCPSHM_MAGIC)
+                pid = shm->writer_pid;
+            munmap(shm, sizeof(mcpshm_t));
+        }
+    }
+    close(fd);
+
+    if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH)
+        pid = 0;
+    return pid;
+}
+
+//
+// Poll the device with given interval, and publish
+// the replies in a shared memory segment with given name.
+// Readers use the API from mcpshm.h.
+//
+void mcp_publish(const char *name, int interval_msec)
+{
+    unsigned long long interval = interval_msec * 1000000ULL;
+    unsigned long long deadline, t0, t, err;
+    mcpshm_sample_t sample;
+    hid_stats_t stats;
+    struct timespec now;
+    mcpshm_t *shm;
+    pid_t pid;
+    int fd;
+    tstamp_t *ts = ts_create("chip");
+
+    // Only one writer is allowed: the segment of a running publisher
+    // must not be touched.  A stale one, left by a killed process,
+    // is replaced.
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        pid = get_publisher(name);
+        if (pid > 0) {
+            fprintf(stderr, "%s: Already published by process %d.\n", name, (int) pid);
+            exit(-1);
+        }
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "%s: Cannot create shared memory: %s\n", name, strerror(errno));
+        exit(-1);
+    }
+    if (ftruncate(fd, sizeof(mcpshm_t)) < 0) {
+        fprintf(stderr, "%s: Cannot resize shared memory: %s\n", name, strerror(errno));
+        exit(-1);
+    }
+    shm = mmap(0, sizeof(mcpshm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "%s: Cannot map shared memory: %s\n", name, strerror(errno));
+        exit(-1);
+    }
+
+    // Readers check magic and version, so set them last.
+    memset(shm, 0, sizeof(*shm));
+    shm->writer_pid = getpid();
+    shm->version = MCPSHM_VERSION;
+    __atomic_store_n(&shm->magic, MCPSHM_MAGIC, __ATOMIC_RELEASE);
+
+    catch_stop_signals();
+    fprintf(stderr, "Publishing device state to shared memory %s\n", name);
+
+    memset(&sample, 0, sizeof(sample));
+    sample.interval_usec = interval_msec * 1000;
+    deadline = time_nsec();
+    while (!stop_flag) {
+        t0 = time_nsec();
+        mcp_get_status(&sample.status);
+        ts_last(ts, &t, &err);
+        mcp_get_gpio(&sample.gpio);
+
+        // Timestamp is the moment of ADC sample.
+        clock_gettime(CLOCK_REALTIME, &now);
+        sample.nsamples++;
+        sample.monotonic_nsec = t;
+        sample.realtime_nsec = now.tv_sec * 1000000000ULL + now.tv_nsec - (time_nsec() - t);
+        sample.latency_nsec = time_nsec() - t0;
+        sample.err_nsec = err;
+        hid_get_stats(&stats);
+        sample.reconnects = stats.reconnects;
+        mcpshm_write(shm, &sample);
+
+        deadline += interval;
+        if (deadline < time_nsec())
+            deadline = time_nsec();
+        sleep_until(deadline);
+    }
+
+    ts_destroy(ts);
+
+    // Existing readers keep their mapping; new readers will not find it.
+    munmap(shm, sizeof(mcpshm_t));
+    shm_unlink(name);
+}
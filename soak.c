@@ -0,0 +1,467 @@
+/*
+ * Soak test: run a mixed workload for hours, and track degradation.
+ *
+ * Operations are issued back to back, in proportion to their weights.
+ * Every period (one minute by default) the throughput, latency
+ * percentiles and counts of faults are printed, and appended to
+ * a time-series file as one fixed-size record.  After each period,
+ * every metric is checked for a monotonic trend with Mann-Kendall
+ * test; drift is flagged when the trend is significant (|Z| >= 3)
+ * in the bad direction, and the metric changed by at least 10%
+ * between the first and the last quarter of the run.
+ *
+ * Workload is specified as a list of parameters, all optional:
+ *
+ *      status=4,gpio=2,sram=1,i2c=1,addr=0x50,hours=8,period=60
+ *
+ * Weights status, gpio, sram and i2c give the mix of operations;
+ * by default status, gpio and sram are used equally.  The i2c
+ * operation reads 8 registers of the device at given address.
+ * Duration 0 (default) means to run until interrupted.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "mcp2221.h"
+#include "util.h"
+
+#define SOAK_MAGIC      0x4b50434d  // 'MCPK'
+#define SOAK_VERSION    1
+
+#define HIST_STEP_USEC  10          // resolution of latency histogram
+#define HIST_SIZE       10000       // up to 100 msec
+#define MIN_INTERVALS   10          // before drift is evaluated
+#define MAX_WINDOW      1440        // intervals used for trend, one day of minutes
+#define DRIFT_Z         3.0         // significance of trend
+#define DRIFT_CHANGE    0.1         // relative change of metric
+
+//
+// Time-series file: header, then one record per period.
+//
+typedef struct {
+    uint32_t magic;                 // SOAK_MAGIC
+    uint32_t version;               // SOAK_VERSION
+    uint32_t period_sec;            // length of period
+    uint32_t unused;
+    uint64_t start_time;            // realtime at start, seconds since epoch
+} soak_header_t;
+
+typedef struct {
+    uint32_t t_sec;                 // end of period since start
+    uint32_t duration_msec;         // actual length of period
+    uint32_t nops;                  // operations completed
+    uint32_t nrequests;             // USB requests completed
+    uint32_t p50_usec;              // latency percentiles of operations
+    uint32_t p90_usec;
+    uint32_t p99_usec;
+    uint32_t max_usec;
+    uint32_t retries;               // counts of faults during the period
+    uint32_t errors;
+    uint32_t timeouts;
+    uint32_t stalls;
+    uint32_t reconnects;
+    uint32_t i2c_failures;
+    uint32_t drift;                 // bit mask of metrics with drift detected
+    uint32_t unused;
+} soak_record_t;
+
+enum { OP_STATUS, OP_GPIO, OP_SRAM, OP_I2C, NOPS };
+
+//
+// Metrics checked for drift, and the direction of degradation.
+//
+enum { M_THROUGHPUT, M_P50, M_P99, M_FAULTS, NMETRICS };
+
+static const struct {
+    const char *name;
+    int worse;                      // +1 when growth is bad, -1 when decline is bad
+} metrics[NMETRICS] = {
+    [M_THROUGHPUT] = { "throughput", -1 },
+    [M_P50]        = { "p50 latency", +1 },
+    [M_P99]        = { "p99 latency", +1 },
+    [M_FAULTS]     = { "fault rate", +1 },
+};
+
+typedef struct {
+    int weight[NOPS];               // relative number of operations
+    int addr;                       // I2C device address
+    double hours;                   // duration, 0 = until interrupted
+    int period;                     // seconds per record
+} soak_config_t;
+
+static unsigned hist[HIST_SIZE];    // latency histogram of the current period
+static unsigned long hist_count;
+static unsigned long long hist_max;
+
+//
+// Parse workload specification.
+//
+static void parse_soak(const char *spec, soak_config_t *cfg)
+{
+    static const char *op_name[NOPS] = { "status=", "gpio=", "sram=", "i2c=" };
+    const char *p = spec;
+    char *end;
+    int i, total = 0;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->addr = 0x50;
+    cfg->period = 60;
+
+    while (*p) {
+        for (i=0; i<NOPS; i++)
+            if (strncmp(p, op_name[i], strlen(op_name[i])) == 0)
+                break;
+        if (i < NOPS) {
+            p += strlen(op_name[i]);
+            cfg->weight[i] = strtol(p, &end, 0);
+            if (end == p || cfg->weight[i] < 0 || cfg->weight[i] > 1000)
+                goto bad;
+        } else if (strncmp(p, "addr=", 5) == 0) {
+            p += 5;
+            cfg->addr = strtol(p, &end, 0);
+            if (end == p || cfg->addr < 0 || cfg->addr > 127)
+                goto bad;
+        } else if (strncmp(p, "hours=", 6) == 0) {
+            p += 6;
+            cfg->hours = strtod(p, &end);
+            if (end == p || cfg->hours < 0)
+                goto bad;
+        } else if (strncmp(p, "period=", 7) == 0) {
+            p += 7;
+            cfg->period = strtol(p, &end, 0);
+            if (end == p || cfg->period < 1 || cfg->period > 86400)
+                goto bad;
+        } else
+            goto bad;
+
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p != 0)
+            goto bad;
+    }
+
+    for (i=0; i<NOPS; i++)
+        total += cfg->weight[i];
+    if (total == 0)
+        cfg->weight[OP_STATUS] = cfg->weight[OP_GPIO] = cfg->weight[OP_SRAM] = 1;
+    return;
+bad:
+    fprintf(stderr, "Bad workload: %s\n", spec);
+    exit(-1);
+}
+
+static void hist_add(unsigned long long nsec)
+{
+    unsigned long long usec = nsec / 1000;
+    unsigned bin = usec / HIST_STEP_USEC;
+
+    hist[bin < HIST_SIZE ? bin : HIST_SIZE-1]++;
+    hist_count++;
+    if (usec > hist_max)
+        hist_max = usec;
+}
+
+static unsigned hist_percentile(double fraction)
+{
+    unsigned long target = hist_count * fraction;
+    unsigned long seen = 0;
+    unsigned bin;
+
+    for (bin=0; bin<HIST_SIZE-1; bin++) {
+        seen += hist[bin];
+        if (seen > target)
+            return bin * HIST_STEP_USEC;
+    }
+    return hist_max;
+}
+
+//
+// Execute one operation of the workload.
+// Return 0 on success, -1 when I2C transaction failed.
+//
+static int soak_op(int op, int addr)
+{
+    mcp_reply_status_t status;
+    mcp_reply_gpio_t gpio;
+    uint8_t data[8];
+
+    switch (op) {
+    case OP_STATUS:
+        mcp_get_status(&status);
+        break;
+    case OP_GPIO:
+        mcp_get_gpio(&gpio);
+        break;
+    case OP_SRAM:
+        mcp_execute(MCP_REQ_GETSRAM);
+        break;
+    case OP_I2C:
+        if (mcp_i2c_read_regs(addr, 0, 8, data, sizeof(data)) < 0)
+            return -1;
+        break;
+    }
+    return 0;
+}
+
+//
+// Value of the metric in the record.
+//
+static double metric_value(const soak_record_t *r, int m)
+{
+    switch (m) {
+    default:
+    case M_THROUGHPUT:
+        return r->duration_msec ? r->nops * 1000.0 / r->duration_msec : 0;
+    case M_P50:
+        return r->p50_usec;
+    case M_P99:
+        return r->p99_usec;
+    case M_FAULTS:
+        return r->retries + r->errors + r->timeouts + r->stalls +
+               r->reconnects + r->i2c_failures;
+    }
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+//
+// Mann-Kendall test for monotonic trend: return Z statistic,
+// positive for growth.  Variance is corrected for ties, which are
+// common in counts of faults.
+//
+static double mann_kendall(const double *x, int n)
+{
+    double *sorted, var, s = 0;
+    int i, j, t;
+
+    for (i=0; i<n-1; i++)
+        for (j=i+1; j<n; j++)
+            s += (x[j] > x[i]) - (x[j] < x[i]);
+
+    sorted = malloc(n * sizeof(double));
+    if (!sorted) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    memcpy(sorted, x, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_double);
+    var = (double) n * (n-1) * (2*n+5);
+    for (i=0; i<n; i=j) {
+        for (j=i+1; j<n && sorted[j] == sorted[i]; j++)
+            continue;
+        t = j - i;
+        var -= (double) t * (t-1) * (2*t+5);
+    }
+    free(sorted);
+    var /= 18;
+
+    if (var <= 0 || s == 0)
+        return 0;
+    return (s > 0 ? s - 1 : s + 1) / sqrt(var);
+}
+
+//
+// Check every metric for drift over the recent records.
+// Return bit mask of metrics which degrade.
+//
+static unsigned check_drift(const soak_record_t *records, int nrecords, unsigned reported)
+{
+    int first = nrecords > MAX_WINDOW ? nrecords - MAX_WINDOW : 0;
+    int n = nrecords - first, quarter = n / 4, m, i;
+    double x[MAX_WINDOW], z, early, late, change;
+    unsigned drift = 0;
+
+    if (n < MIN_INTERVALS)
+        return 0;
+
+    for (m=0; m<NMETRICS; m++) {
+        for (i=0; i<n; i++)
+            x[i] = metric_value(&records[first + i], m);
+        z = mann_kendall(x, n) * metrics[m].worse;
+        if (z < DRIFT_Z)
+            continue;
+
+        // Significant is not enough: ignore tiny changes.
+        early = late = 0;
+        for (i=0; i<quarter; i++) {
+            early += x[i];
+            late += x[n - quarter + i];
+        }
+        early /= quarter;
+        late /= quarter;
+        change = (late - early) / (early > 1 ? early : 1);
+        if (change * metrics[m].worse < DRIFT_CHANGE)
+            continue;
+
+        drift |= 1 << m;
+        if (!(reported & (1 << m)))
+            fprintf(stderr, "Drift: %s %s, Z = %.1f, %+.0f%% since start.\n",
+                metrics[m].name, metrics[m].worse > 0 ? "rising" : "falling",
+                z * metrics[m].worse, change * 100);
+    }
+    return drift;
+}
+
+//
+// Run the workload, and write one record per period into file.
+//
+void mcp_soak(const char *spec, const char *output)
+{
+    soak_config_t cfg;
+    soak_header_t header;
+    soak_record_t *records = 0, *r;
+    hid_stats_t before, after;
+    unsigned long long start_time, period_start, period_end, stop_time, t0, t1;
+    unsigned reported = 0, allocated = 0, nrecords = 0, i2c_failures = 0, nops = 0;
+    int schedule[NOPS * 1000], nschedule = 0, next = 0, op, i;
+    FILE *out = 0;
+
+    parse_soak(spec, &cfg);
+
+    // Interleave the operations: one of each while weight remains.
+    for (i=0; i<1000; i++)
+        for (op=0; op<NOPS; op++)
+            if (cfg.weight[op] > i)
+                schedule[nschedule++] = op;
+
+    if (output) {
+        out = fopen(output, "wb");
+        if (!out) {
+            perror(output);
+            exit(-1);
+        }
+        memset(&header, 0, sizeof(header));
+        header.magic = SOAK_MAGIC;
+        header.version = SOAK_VERSION;
+        header.period_sec = cfg.period;
+        header.start_time = time(0);
+        if (fwrite(&header, sizeof(header), 1, out) != 1) {
+            perror(output);
+            exit(-1);
+        }
+        fflush(out);
+    }
+    fprintf(stderr, "Soak test: status=%d, gpio=%d, sram=%d, i2c=%d, period %d sec, ",
+        cfg.weight[OP_STATUS], cfg.weight[OP_GPIO], cfg.weight[OP_SRAM],
+        cfg.weight[OP_I2C], cfg.period);
+    if (cfg.hours > 0)
+        fprintf(stderr, "%.1f hours.\n", cfg.hours);
+    else
+        fprintf(stderr, "until interrupted.\n");
+
+    catch_stop_signals();
+    start_time = period_start = time_nsec();
+    stop_time = cfg.hours > 0 ? start_time + (unsigned long long) (cfg.hours * 3600e9) : 0;
+    period_end = period_start + cfg.period * 1000000000ULL;
+    hid_get_stats(&before);
+
+    for (;;) {
+        t0 = time_nsec();
+        if (t0 >= period_end || stop_flag || (stop_time && t0 >= stop_time)) {
+            if (nrecords >= allocated) {
+                allocated = allocated ? allocated * 2 : 256;
+                records = realloc(records, allocated * sizeof(soak_record_t));
+                if (!records) {
+                    fprintf(stderr, "Out of memory!\n");
+                    exit(-1);
+                }
+            }
+            hid_get_stats(&after);
+            r = &records[nrecords++];
+            memset(r, 0, sizeof(*r));
+            r->t_sec = (t0 - start_time) / 1000000000ULL;
+            r->duration_msec = (t0 - period_start) / 1000000;
+            r->nops = nops;
+            r->nrequests = after.requests - before.requests;
+            r->p50_usec = hist_percentile(0.5);
+            r->p90_usec = hist_percentile(0.9);
+            r->p99_usec = hist_percentile(0.99);
+            r->max_usec = hist_max;
+            r->retries = after.retries - before.retries;
+            r->errors = after.errors - before.errors;
+            r->timeouts = after.timeouts - before.timeouts;
+            r->stalls = after.stalls - before.stalls;
+            r->reconnects = after.reconnects - before.reconnects;
+            r->i2c_failures = i2c_failures;
+            r->drift = check_drift(records, nrecords, reported);
+            reported |= r->drift;
+
+            fprintf(stderr, "[%5u sec] %.1f ops/sec, %u requests, latency p50 %u p90 %u p99 %u max %u usec, %.0f faults\n",
+                r->t_sec, metric_value(r, M_THROUGHPUT), r->nrequests,
+                r->p50_usec, r->p90_usec, r->p99_usec, r->max_usec,
+                metric_value(r, M_FAULTS));
+            if (out) {
+                if (fwrite(r, sizeof(*r), 1, out) != 1) {
+                    perror(output);
+                    exit(-1);
+                }
+                fflush(out);
+            }
+
+            if (stop_flag || (stop_time && t0 >= stop_time))
+                break;
+
+            // Start next period.
+            before = after;
+            memset(hist, 0, sizeof(hist));
+            hist_count = hist_max = 0;
+            nops = i2c_failures = 0;
+            period_start = t0;
+            period_end += cfg.period * 1000000000ULL;
+        }
+
+        op = schedule[next];
+        next = (next + 1) % nschedule;
+        if (soak_op(op, cfg.addr) < 0)
+            i2c_failures++;
+        t1 = time_nsec();
+        hist_add(t1 - t0);
+        nops++;
+    }
+
+    if (out)
+        fclose(out);
+    if (reported == 0) {
+        fprintf(stderr, "Soak test: %u periods, no significant drift.\n", nrecords);
+    } else {
+        const char *sep = " ";
+        int m;
+
+        fprintf(stderr, "Soak test: %u periods, drift detected:", nrecords);
+        for (m=0; m<NMETRICS; m++)
+            if (reported & (1 << m)) {
+                fprintf(stderr, "%s%s", sep, metrics[m].name);
+                sep = ", ";
+            }
+        fprintf(stderr, ".\n");
+    }
+    free(records);
+}
@@ -0,0 +1,133 @@
+/*
+ * Timestamps of samples, compensated for USB latency.
+ *
+ * Round trip of a request consists of the minimal time, spent in
+ * the host stack, on the bus and in the chip, and the queueing above it:
+ * waiting for the next USB frame, for the scheduler, and so on.
+ * The minimal round trip is assumed to be split evenly around
+ * the sample moment; this offset is common to all samples of the
+ * device, and cancels when devices of the same kind are compared.
+ *
+ * When the backend knows the time the write transfer completed,
+ * the queueing before the request reached the device is at most
+ * the excess of the write time over its minimum, which is usually
+ * much less than the excess of the whole round trip.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "timestamp.h"
+#include "util.h"
+
+#define WINDOW  256                 // transactions to learn the minimums
+
+struct tstamp {
+    const char *name;               // device name for report
+    unsigned long long rtt[WINDOW]; // recent round trips
+    unsigned long long write[WINDOW]; // recent write times, 0 when unknown
+    unsigned head;                  // next slot in the window
+    unsigned count;                 // transactions seen
+    unsigned long long rtt_min;     // minimal round trip in the window
+    unsigned long long write_min;   // minimal write time in the window
+    double err_sum;                 // for report: sum of bounds
+    unsigned long long err_max;     // for report: largest bound
+};
+
+tstamp_t *ts_create(const char *name)
+{
+    tstamp_t *ts = calloc(1, sizeof(tstamp_t));
+
+    if (!ts) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    ts->name = name;
+    return ts;
+}
+
+void ts_destroy(tstamp_t *ts)
+{
+    free(ts);
+}
+
+//
+// Update the minimums over the window.
+//
+static void learn(tstamp_t *ts, unsigned long long rtt, unsigned long long write)
+{
+    unsigned n, i;
+
+    ts->rtt[ts->head] = rtt;
+    ts->write[ts->head] = write;
+    ts->head = (ts->head + 1) % WINDOW;
+    ts->count++;
+
+    n = (ts->count < WINDOW) ? ts->count : WINDOW;
+    ts->rtt_min = ts->rtt[0];
+    ts->write_min = 0;
+    for (i=0; i<n; i++) {
+        if (ts->rtt[i] < ts->rtt_min)
+            ts->rtt_min = ts->rtt[i];
+        if (ts->write[i] && (ts->write_min == 0 || ts->write[i] < ts->write_min))
+            ts->write_min = ts->write[i];
+    }
+}
+
+void ts_update(tstamp_t *ts, unsigned long long t_send,
+    unsigned long long t_written, unsigned long long t_recv,
+    unsigned long long *t, unsigned long long *err)
+{
+    unsigned long long rtt = t_recv - t_send;
+    unsigned long long write = t_written ? t_written - t_send : 0;
+    unsigned long long queued;
+
+    learn(ts, rtt, write);
+
+    // Range of queueing before the request reached the device.
+    queued = rtt - ts->rtt_min;
+    if (write && ts->write_min && write - ts->write_min < queued)
+        queued = write - ts->write_min;
+
+    *t = t_send + ts->rtt_min / 2 + queued / 2;
+    *err = queued / 2;
+
+    ts->err_sum += *err;
+    if (*err > ts->err_max)
+        ts->err_max = *err;
+}
+
+void ts_last(tstamp_t *ts, unsigned long long *t, unsigned long long *err)
+{
+    unsigned long long t_send, t_written, t_recv;
+
+    hid_get_times(&t_send, &t_written, &t_recv);
+    ts_update(ts, t_send, t_written, t_recv, t, err);
+}
+
+void ts_report(const tstamp_t *ts)
+{
+    if (ts->count == 0)
+        return;
+    fprintf(stderr, "Timestamps of %s: round trip %.0f usec minimum, uncertainty %.0f usec mean, %.0f usec max.\n",
+        ts->name, ts->rtt_min / 1e3, ts->err_sum / ts->count / 1e3, ts->err_max / 1e3);
+}
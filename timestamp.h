@@ -0,0 +1,69 @@
+/*
+ * Timestamps of samples, compensated for USB latency.
+ *
+ * The chip takes a sample (ADC, GPIO) at some moment between
+ * sending the request and receiving the reply.  For every device,
+ * the minimal round trip and the minimal time to deliver the request
+ * are learned online, over a window of recent transactions.  Any
+ * delay above the minimum is queueing, and the sample moment is
+ * placed in the middle of the range left by it, with half of that
+ * range as the uncertainty bound.
+ *
+ *      tstamp_t *ts = ts_create("chip");
+ *      mcp_get_status(&status);
+ *      ts_last(ts, &t, &err);
+ *      ...
+ *      ts_report(ts);
+ *      ts_destroy(ts);
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+typedef struct tstamp tstamp_t;
+
+//
+// Create estimator for one device; name is used in the report.
+//
+tstamp_t *ts_create(const char *name);
+void ts_destroy(tstamp_t *ts);
+
+//
+// Learn one transaction, and estimate the moment of the sample.
+// Times are in nsec, by time_nsec(); t_written is zero when unknown.
+// Result: estimated time, and the uncertainty bound, plus or minus.
+//
+void ts_update(tstamp_t *ts, unsigned long long t_send,
+    unsigned long long t_written, unsigned long long t_recv,
+    unsigned long long *t, unsigned long long *err);
+
+//
+// Same for the last request sent to the chip.
+//
+void ts_last(tstamp_t *ts, unsigned long long *t, unsigned long long *err);
+
+//
+// Print the learned latencies and the uncertainty of timestamps.
+//
+void ts_report(const tstamp_t *ts);
+
+#endif /* TIMESTAMP_H */
@@ -0,0 +1,291 @@
+/*
+ * Triggered capture of ADC inputs.
+ *
+ * The chip is sampled continuously into a ring of recent samples.
+ * Every sample is checked against the trigger; when it fires,
+ * the history before the trigger and the samples after it
+ * are written out, and everything else is discarded.
+ *
+ * Trigger is specified as a condition on one ADC channel,
+ * optionally followed by parameters:
+ *
+ *      adc0>600            level crosses 600 upwards
+ *      adc1<200            level crosses 200 downwards
+ *      adc2/+20            rises by 20 or more in one sample
+ *      adc2/-20            falls by 20 or more in one sample
+ *      adc0>600,hyst=8,pre=500,post=1000
+ *
+ * After firing, the trigger re-arms only when the condition is
+ * cleared by the hysteresis margin, so noise around the threshold
+ * does not produce a burst of events.  For a level near the end
+ * of the ADC range, the margin is limited by the range.
+ * An event which fires while the samples after the previous one
+ * are written is not captured, only counted.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mcp2221.h"
+#include "timestamp.h"
+#include "util.h"
+
+#define DEFAULT_HYST    4
+#define DEFAULT_PRE     100
+#define DEFAULT_POST    100
+#define MAX_SAMPLES     1000000     // limit for pre and post
+#define ADC_MAX         1023
+
+enum { LEVEL_ABOVE, LEVEL_BELOW, SLOPE_UP, SLOPE_DOWN };
+
+typedef struct {
+    int channel;                    // ADC channel 0-2
+    int kind;                       // LEVEL_* or SLOPE_*
+    int threshold;                  // level, or change per sample
+    int hyst;                       // margin to re-arm
+    int pre, post;                  // samples before and after trigger
+    int armed;                      // ready to fire
+} trigger_t;
+
+typedef struct {
+    unsigned long long t;           // nsec since start
+    unsigned long long err;         // uncertainty of time, nsec
+    uint16_t adc[3];
+} sample_t;
+
+//
+// Parse trigger specification.
+//
+static void parse_trigger(const char *spec, trigger_t *trig)
+{
+    const char *p = spec;
+    char *end;
+
+    memset(trig, 0, sizeof(*trig));
+    trig->hyst = DEFAULT_HYST;
+    trig->pre = DEFAULT_PRE;
+    trig->post = DEFAULT_POST;
+
+    if (strncmp(p, "adc", 3) != 0 || p[3] < '0' || p[3] > '2')
+        goto bad;
+    trig->channel = p[3] - '0';
+    p += 4;
+
+    if (*p == '>')
+        trig->kind = LEVEL_ABOVE;
+    else if (*p == '<')
+        trig->kind = LEVEL_BELOW;
+    else if (p[0] == '/' && p[1] == '+')
+        trig->kind = SLOPE_UP, p++;
+    else if (p[0] == '/' && p[1] == '-')
+        trig->kind = SLOPE_DOWN, p++;
+    else
+        goto bad;
+    p++;
+
+    trig->threshold = strtol(p, &end, 0);
+    if (end == p || trig->threshold < 0 || trig->threshold > 1023)
+        goto bad;
+    p = end;
+
+    while (*p == ',') {
+        int *param;
+        long value;
+
+        p++;
+        if (strncmp(p, "hyst=", 5) == 0)
+            param = &trig->hyst, p += 5;
+        else if (strncmp(p, "pre=", 4) == 0)
+            param = &trig->pre, p += 4;
+        else if (strncmp(p, "post=", 5) == 0)
+            param = &trig->post, p += 5;
+        else
+            goto bad;
+
+        value = strtol(p, &end, 0);
+        if (end == p || value < 0 || value > MAX_SAMPLES)
+            goto bad;
+        *param = value;
+        p = end;
+    }
+    if (*p == 0)
+        return;
+bad:
+    fprintf(stderr, "Bad trigger: %s\n", spec);
+    exit(-1);
+}
+
+//
+// Evaluate trigger on a new sample.
+// Return 1 when it fires.
+//
+static int trigger_fires(trigger_t *trig, const sample_t *s, const sample_t *prev)
+{
+    int value = s->adc[trig->channel];
+    int delta = prev ? value - prev->adc[trig->channel] : 0;
+    int active, cleared, level;
+
+    switch (trig->kind) {
+    default:
+    case LEVEL_ABOVE:
+        // Clear level must be reachable by the ADC.
+        level = trig->threshold - trig->hyst;
+        active = value > trig->threshold;
+        cleared = (level > 0) ? value < level : value == 0;
+        break;
+    case LEVEL_BELOW:
+        level = trig->threshold + trig->hyst;
+        active = value < trig->threshold;
+        cleared = (level < ADC_MAX) ? value > level : value == ADC_MAX;
+        break;
+    case SLOPE_UP:
+        active = prev && delta >= trig->threshold;
+        cleared = delta < trig->threshold - trig->hyst;
+        break;
+    case SLOPE_DOWN:
+        active = prev && -delta >= trig->threshold;
+        cleared = -delta < trig->threshold - trig->hyst;
+        break;
+    }
+
+    // Level triggers must see the clear state first,
+    // so that a signal already above the level does not fire.
+    if (!trig->armed) {
+        if (cleared)
+            trig->armed = 1;
+        return 0;
+    }
+    if (!active)
+        return 0;
+    trig->armed = 0;
+    return 1;
+}
+
+static void print_sample(FILE *out, unsigned event, const sample_t *s, unsigned long long t_trigger)
+{
+    fprintf(out, "%u,%.6f,%.6f,%u,%u,%u,%.6f\n", event, s->t / 1e9,
+        ((long long) s->t - (long long) t_trigger) / 1e9,
+        s->adc[0], s->adc[1], s->adc[2], s->err / 1e9);
+}
+
+//
+// Sample the chip with given interval, and write out
+// the samples around every trigger event.
+//
+void mcp_trigger(const char *spec, const char *output, int interval_msec)
+{
+    unsigned long long interval = interval_msec * 1000000ULL;
+    unsigned long long start_time, deadline, t, t_trigger = 0;
+    unsigned long nsamples = 0, nwritten = 0;
+    unsigned nevents = 0, noverlap = 0, head = 0, nstored = 0, i;
+    int post_left = 0, written, fired;
+    mcp_reply_status_t status;
+    trigger_t trig;
+    sample_t *ring, s, prev;
+    FILE *out = stdout;
+    tstamp_t *ts = ts_create("chip");
+
+    parse_trigger(spec, &trig);
+
+    // Ring holds the history before the trigger.
+    ring = malloc((trig.pre + 1) * sizeof(sample_t));
+    if (!ring) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            perror(output);
+            exit(-1);
+        }
+    }
+    fprintf(out, "event,time,dt,adc0,adc1,adc2,err\n");
+    fprintf(stderr, "Waiting for trigger %s: %d samples before, %d after.\n",
+        spec, trig.pre, trig.post);
+
+    catch_stop_signals();
+    start_time = deadline = time_nsec();
+    while (!stop_flag) {
+        mcp_get_status(&status);
+        ts_last(ts, &t, &s.err);
+        s.t = t - start_time;
+        s.adc[0] = status.adc_ch0;
+        s.adc[1] = status.adc_ch1;
+        s.adc[2] = status.adc_ch2;
+
+        // Trigger is evaluated on every sample, so hysteresis
+        // tracks the signal even while the tail is written.
+        written = 0;
+        fired = trigger_fires(&trig, &s, nsamples ? &prev : 0);
+        if (fired && post_left > 0) {
+            // Samples after the previous event are still written.
+            noverlap++;
+        }
+        if (fired && post_left == 0) {
+            // Dump the history, oldest first.
+            nevents++;
+            t_trigger = s.t;
+            for (i=0; i<nstored; i++)
+                print_sample(out, nevents, &ring[(head + trig.pre - nstored + i) % trig.pre], t_trigger);
+            print_sample(out, nevents, &s, t_trigger);
+            nwritten += nstored + 1;
+            post_left = trig.post;
+            written = 1;
+            fflush(out);
+        } else if (post_left > 0) {
+            print_sample(out, nevents, &s, t_trigger);
+            nwritten++;
+            written = 1;
+            if (--post_left == 0)
+                fflush(out);
+        }
+
+        // Samples already written are not history for the next event.
+        if (written) {
+            nstored = 0;
+        } else if (trig.pre > 0) {
+            ring[head] = s;
+            head = (head + 1) % trig.pre;
+            if (nstored < trig.pre)
+                nstored++;
+        }
+        prev = s;
+        nsamples++;
+
+        deadline += interval;
+        if (deadline < time_nsec())
+            deadline = time_nsec();
+        sleep_until(deadline);
+    }
+
+    if (out != stdout)
+        fclose(out);
+    free(ring);
+    fprintf(stderr, "Captured %u events: %lu of %lu samples written.\n",
+        nevents, nwritten, nsamples);
+    if (noverlap > 0)
+        fprintf(stderr, "Skipped %u events within %d samples after the previous one.\n",
+            noverlap, trig.post);
+    ts_report(ts);
+    ts_destroy(ts);
+}
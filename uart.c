@@ -0,0 +1,616 @@
+/*
+ * UART bridge via CDC interfaces of MCP2221 chip.
+ *
+ * The CDC data interface is claimed through libusb, bypassing
+ * the kernel tty layer.  Several bulk IN transfers are kept queued,
+ * so the chip always has a buffer to fill.  Completed transfers
+ * wait in order, and the relay loop writes their data to stdout or
+ * to a pseudo-terminal directly from the transfer buffers, with no
+ * extra copy, when the reader is ready; optionally the data are
+ * recorded with timestamps.  A transfer is requeued only when its
+ * data are written out, so a slow reader holds the transfers instead
+ * of blocking the event loop.  After a transfer error, the transfer
+ * is requeued with a growing delay, and the relay stops when errors
+ * repeat.
+ *
+ * The relay can run in its own thread, together with any HID mode
+ * on the same chip: CDC and HID interfaces are claimed through
+ * separate handles, each with its own transfer queue.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <signal.h>
+#include <pthread.h>
+#include <limits.h>
+#include <libusb.h>
+#include "usbdev.h"
+#include "util.h"
+
+#define CDC_COMM_INTERFACE  0               // CDC control interface
+#define CDC_DATA_INTERFACE  1               // CDC data interface
+#define CDC_WRITE_ENDPOINT  0x02            // output to UART
+#define CDC_READ_ENDPOINT   0x82            // input from UART
+
+#define CDC_SET_LINE_CODING         0x20    // class-specific requests
+#define CDC_SET_CONTROL_LINE_STATE  0x22
+
+#define NREADS              8               // bulk IN transfers kept queued
+#define READ_SIZE           512             // buffer of one IN transfer
+#define WRITE_SIZE          512             // buffer of OUT transfer
+#define MAX_POLLFDS         16
+
+#define BACKOFF_MSEC        10              // delay after first read error
+#define BACKOFF_MAX_MSEC    1000            // max delay between attempts
+#define MAX_ERRORS          10              // read errors in a row to give up
+
+static libusb_context *ctx;
+static libusb_device_handle *dev;
+
+static struct libusb_transfer *rx[NREADS];
+static unsigned char rx_buf[NREADS][READ_SIZE];
+static int rx_active;                       // number of queued IN transfers
+static struct libusb_transfer *rx_ready[NREADS];   // received, not yet relayed, in order
+static int rx_nready;
+static int rx_written;                      // bytes of rx_ready[0] already relayed
+static struct libusb_transfer *rx_parked[NREADS];  // relayed, or waiting after error
+static int rx_nparked;
+static int rx_failures;                     // read errors in a row
+static int rx_stalled;                      // endpoint needs clear halt
+static unsigned rx_backoff;                 // current delay, msec
+static unsigned long long rx_resume;        // requeue not before this time
+
+static int out_flags = -1;                  // saved flags of pty, when made non-blocking
+
+static struct libusb_transfer *tx;
+static unsigned char tx_buf[WRITE_SIZE];
+static int tx_busy;                         // OUT transfer is in flight
+
+static int in_fd, out_fd;                   // relay: stdio or pty master
+static int pty_master = -1;
+static int pty_slave = -1;                  // keep pty open for reading
+static struct termios saved_tty;
+static int tty_saved;
+
+static int wake_pipe[2];                    // to interrupt poll() of UART thread
+static pthread_t uart_tid;
+static volatile int uart_stopping;
+
+static FILE *capture;                       // optional timestamped capture
+static int capture_binary;
+static unsigned long long start_time;
+static unsigned long rx_bytes, tx_bytes, rx_errors, tx_errors;
+
+//
+// Binary record of capture file, followed by data bytes.
+//
+#pragma pack(1)
+typedef struct {
+    uint64_t nsec;                          // time since start
+    uint16_t len;                           // number of data bytes
+    uint8_t  dir;                           // 0 = received, 1 = sent
+    uint8_t  unused;
+} uart_record_t;
+#pragma pack()
+
+//
+// Save data into capture file.
+//
+static void record(int dir, const unsigned char *data, int len)
+{
+    unsigned long long now = time_nsec() - start_time;
+    int i;
+
+    if (capture_binary) {
+        uart_record_t rec = { now, len, dir, 0 };
+
+        fwrite(&rec, sizeof(rec), 1, capture);
+        fwrite(data, len, 1, capture);
+        return;
+    }
+    fprintf(capture, "%.6f %s", now / 1e9, dir ? "tx" : "rx");
+    for (i=0; i<len; i++)
+        fprintf(capture, " %02x", data[i]);
+    fprintf(capture, "\n");
+}
+
+//
+// Write received data to the relay, as much as it takes now,
+// straight from the transfer buffers.  A drained transfer is parked
+// for requeue.  Stdout is shared with the rest of the program and
+// stays blocking: after POLLOUT, one write of PIPE_BUF bytes does not wait.
+//
+static void flush_output()
+{
+    while (rx_nready > 0) {
+        struct libusb_transfer *t = rx_ready[0];
+        int len = t->actual_length - rx_written;
+        int n;
+
+        if (out_flags < 0 && len > PIPE_BUF)
+            len = PIPE_BUF;
+        n = write(out_fd, t->buffer + rx_written, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                perror("UART output");
+                stop_flag = 1;
+            }
+            return;
+        }
+        rx_written += n;
+        if (rx_written == t->actual_length) {
+            rx_written = 0;
+            rx_nready--;
+            memmove(rx_ready, rx_ready + 1, rx_nready * sizeof(rx_ready[0]));
+            rx_parked[rx_nparked++] = t;
+        }
+        if (out_flags < 0)
+            return;
+    }
+}
+
+//
+// Read transfer failed: delay the next attempt, twice longer
+// every time, and give up when errors repeat.
+//
+static void rx_failed()
+{
+    rx_errors++;
+    rx_backoff = rx_backoff ? rx_backoff * 2 : BACKOFF_MSEC;
+    if (rx_backoff > BACKOFF_MAX_MSEC)
+        rx_backoff = BACKOFF_MAX_MSEC;
+    rx_resume = time_nsec() + rx_backoff * 1000000ULL;
+    if (++rx_failures >= MAX_ERRORS) {
+        fprintf(stderr, "UART: Too many read errors\n");
+        stop_flag = 1;
+    }
+}
+
+//
+// Queue parked IN transfers, unless an error delay is in effect.
+//
+static void requeue_rx()
+{
+    struct libusb_transfer *t;
+
+    if (rx_nparked == 0 || time_nsec() < rx_resume)
+        return;
+    if (rx_stalled) {
+        libusb_clear_halt(dev, CDC_READ_ENDPOINT);
+        rx_stalled = 0;
+    }
+    while (rx_nparked > 0) {
+        t = rx_parked[--rx_nparked];
+        if (libusb_submit_transfer(t) < 0) {
+            rx_parked[rx_nparked++] = t;
+            rx_failed();
+            return;
+        }
+        rx_active++;
+    }
+}
+
+//
+// Data received from UART: append the transfer to the ready list.
+// The relay loop writes the data out and requeues the transfer.
+// Nothing here waits for the reader.
+//
+static void rx_done(struct libusb_transfer *t)
+{
+    rx_active--;
+    if (t->status == LIBUSB_TRANSFER_COMPLETED) {
+        rx_failures = 0;
+        rx_backoff = 0;
+        if (t->actual_length > 0) {
+            rx_bytes += t->actual_length;
+            if (capture)
+                record(0, t->buffer, t->actual_length);
+            rx_ready[rx_nready++] = t;
+            return;
+        }
+    } else if (t->status != LIBUSB_TRANSFER_TIMED_OUT &&
+               t->status != LIBUSB_TRANSFER_CANCELLED) {
+        if (t->status == LIBUSB_TRANSFER_NO_DEVICE) {
+            fprintf(stderr, "UART: Device lost\n");
+            stop_flag = 1;
+        }
+
+        // Do not spin against a broken endpoint.
+        if (t->status == LIBUSB_TRANSFER_STALL)
+            rx_stalled = 1;
+        rx_failed();
+    }
+    if (stop_flag || uart_stopping || t->status == LIBUSB_TRANSFER_CANCELLED)
+        return;
+    rx_parked[rx_nparked++] = t;
+}
+
+//
+// Data sent to UART.
+//
+static void tx_done(struct libusb_transfer *t)
+{
+    tx_busy = 0;
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        tx_errors++;
+        return;
+    }
+    tx_bytes += t->actual_length;
+}
+
+//
+// Set baud rate, 8 data bits, no parity, one stop bit.
+// Raise DTR and RTS.
+//
+static void set_line_coding(int baud)
+{
+    unsigned char coding[7] = { baud, baud >> 8, baud >> 16, baud >> 24, 0, 0, 8 };
+    int result;
+
+    result = libusb_control_transfer(dev,
+        LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT,
+        CDC_SET_LINE_CODING, 0, CDC_COMM_INTERFACE, coding, sizeof(coding), 1000);
+    if (result < 0) {
+        fprintf(stderr, "UART: Cannot set baud rate %d: %s\n", baud, libusb_strerror(result));
+        exit(-1);
+    }
+    libusb_control_transfer(dev,
+        LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT,
+        CDC_SET_CONTROL_LINE_STATE, 3, CDC_COMM_INTERFACE, 0, 0, 1000);
+}
+
+//
+// Take both CDC interfaces from the kernel driver.
+//
+static void claim_cdc(int vid, int pid, const char *serial)
+{
+    int i, error;
+
+    error = libusb_init(&ctx);
+    if (error < 0) {
+        fprintf(stderr, "libusb init failed: %d: %s\n",
+            error, libusb_strerror(error));
+        exit(-1);
+    }
+    dev = usb_open_device(ctx, vid, pid, serial, 0, 0, 0);
+    if (!dev) {
+        fprintf(stderr, "No MCP2221 chip detected.\n");
+        exit(-1);
+    }
+    for (i = CDC_COMM_INTERFACE; i <= CDC_DATA_INTERFACE; i++) {
+        if (libusb_kernel_driver_active(dev, i))
+            libusb_detach_kernel_driver(dev, i);
+        error = libusb_claim_interface(dev, i);
+        if (error < 0) {
+            fprintf(stderr, "Failed to claim CDC interface %d: %s\n",
+                i, libusb_strerror(error));
+            exit(-1);
+        }
+    }
+}
+
+//
+// Give the CDC interfaces back to the kernel.
+//
+static void release_cdc()
+{
+    int i;
+
+    for (i = CDC_COMM_INTERFACE; i <= CDC_DATA_INTERFACE; i++) {
+        libusb_release_interface(dev, i);
+        libusb_attach_kernel_driver(dev, i);
+    }
+    libusb_close(dev);
+    libusb_exit(ctx);
+}
+
+//
+// Put terminal into raw mode, but keep Ctrl-C working.
+//
+static void set_raw(int fd, int keep_signals)
+{
+    struct termios t;
+
+    if (tcgetattr(fd, &t) < 0)
+        return;
+    cfmakeraw(&t);
+    if (keep_signals)
+        t.c_lflag |= ISIG;
+    tcsetattr(fd, TCSANOW, &t);
+}
+
+//
+// Create pseudo-terminal for the relay.
+//
+static void open_pty()
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        perror("UART: Cannot create pseudo-terminal");
+        exit(-1);
+    }
+    set_raw(fd, 0);
+
+    // Hold the slave side open, otherwise the master reports
+    // hangup while no application is connected.
+    pty_slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    fprintf(stderr, "UART is available at %s\n", ptsname(fd));
+    pty_master = fd;
+    in_fd = fd;
+    out_fd = fd;
+}
+
+//
+// Read from the relay, and send it to UART.
+//
+static void relay_input()
+{
+    int n = read(in_fd, tx_buf, sizeof(tx_buf));
+
+    if (n == 0) {
+        // End of input: keep receiving.
+        in_fd = -1;
+        return;
+    }
+    if (n < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            perror("UART input");
+            in_fd = -1;
+        }
+        return;
+    }
+    if (capture)
+        record(1, tx_buf, n);
+    libusb_fill_bulk_transfer(tx, dev, CDC_WRITE_ENDPOINT, tx_buf, n, tx_done, 0, 1000);
+    if (libusb_submit_transfer(tx) < 0) {
+        tx_errors++;
+        return;
+    }
+    tx_busy = 1;
+}
+
+//
+// Claim the interfaces, set up the relay, and queue transfers.
+//
+static void uart_open(int vid, int pid, const char *serial, int baud,
+    int use_pty, const char *capture_file, int binary)
+{
+    int i;
+
+    claim_cdc(vid, pid, serial);
+    set_line_coding(baud);
+
+    if (capture_file) {
+        capture = fopen(capture_file, binary ? "wb" : "w");
+        if (!capture) {
+            perror(capture_file);
+            exit(-1);
+        }
+        capture_binary = binary;
+    }
+    if (use_pty) {
+        open_pty();
+    } else {
+        in_fd = 0;
+        out_fd = 1;
+        if (isatty(0) && tcgetattr(0, &saved_tty) == 0) {
+            tty_saved = 1;
+            set_raw(0, 1);
+        }
+    }
+    if (pipe(wake_pipe) < 0) {
+        perror("pipe");
+        exit(-1);
+    }
+
+    // Pty is ours: write to it only as much as the reader takes.
+    if (pty_master >= 0) {
+        out_flags = fcntl(pty_master, F_GETFL);
+        if (out_flags >= 0)
+            fcntl(pty_master, F_SETFL, out_flags | O_NONBLOCK);
+    }
+
+    // Allocate and queue all transfers in advance.
+    tx = libusb_alloc_transfer(0);
+    for (i=0; i<NREADS; i++) {
+        rx[i] = libusb_alloc_transfer(0);
+        if (!rx[i] || !tx) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+        libusb_fill_bulk_transfer(rx[i], dev, CDC_READ_ENDPOINT,
+            rx_buf[i], READ_SIZE, rx_done, 0, 0);
+        if (libusb_submit_transfer(rx[i]) < 0) {
+            fprintf(stderr, "UART: Cannot queue read transfer\n");
+            exit(-1);
+        }
+        rx_active++;
+    }
+    start_time = time_nsec();
+}
+
+//
+// Relay data until stopped.
+// Only this loop handles events of the CDC interfaces.
+//
+static void uart_loop()
+{
+    int i;
+
+    while (!stop_flag && !uart_stopping) {
+        struct pollfd fds[MAX_POLLFDS + 3];
+        const struct libusb_pollfd **usb_fds;
+        struct timeval tv = { 0, 0 };
+        int nfds = 1, timeout = 1000, out_index = 0;
+        int want_input = (in_fd >= 0 && !tx_busy);
+        unsigned long long now;
+
+        fds[0].fd = wake_pipe[0];
+        fds[0].events = POLLIN;
+
+        // Take more input only when the previous chunk is sent.
+        if (want_input) {
+            fds[1].fd = in_fd;
+            fds[1].events = POLLIN;
+            nfds = 2;
+        }
+
+        // Relay received data when the reader is ready.
+        if (rx_nready > 0) {
+            out_index = nfds;
+            fds[nfds].fd = out_fd;
+            fds[nfds].events = POLLOUT;
+            nfds++;
+        }
+        usb_fds = libusb_get_pollfds(ctx);
+        for (i=0; usb_fds && usb_fds[i] && nfds < MAX_POLLFDS + 3; i++, nfds++) {
+            fds[nfds].fd = usb_fds[i]->fd;
+            fds[nfds].events = usb_fds[i]->events;
+        }
+        libusb_free_pollfds(usb_fds);
+        if (libusb_get_next_timeout(ctx, &tv) == 1)
+            timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+
+        // Wake up to requeue transfers after the error delay.
+        now = time_nsec();
+        if (rx_nparked > 0 && rx_resume > now &&
+            (rx_resume - now) / 1000000 + 1 < (unsigned long long) timeout)
+            timeout = (rx_resume - now) / 1000000 + 1;
+
+        if (poll(fds, nfds, timeout) < 0 && errno != EINTR)
+            break;
+        if (want_input && (fds[1].revents & (POLLIN | POLLHUP)))
+            relay_input();
+        if (out_index && fds[out_index].revents)
+            flush_output();
+        requeue_rx();
+
+        tv.tv_sec = tv.tv_usec = 0;
+        libusb_handle_events_timeout(ctx, &tv);
+        requeue_rx();
+    }
+}
+
+//
+// Wait for all transfers to finish, and release the device.
+//
+static void uart_close()
+{
+    int i;
+
+    for (i=0; i<NREADS; i++)
+        libusb_cancel_transfer(rx[i]);
+    if (tx_busy)
+        libusb_cancel_transfer(tx);
+    while (rx_active > 0 || tx_busy)
+        libusb_handle_events(ctx);
+
+    // Relay the rest: stdout waits for it, pty takes what it can.
+    while (rx_nready > 0) {
+        int left = rx_nready, written = rx_written;
+
+        flush_output();
+        if (rx_nready == left && rx_written == written)
+            break;
+    }
+    for (i=0; i<NREADS; i++)
+        libusb_free_transfer(rx[i]);
+    libusb_free_transfer(tx);
+
+    if (tty_saved)
+        tcsetattr(0, TCSANOW, &saved_tty);
+    if (pty_master >= 0) {
+        close(pty_slave);
+        close(pty_master);
+    }
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    if (capture)
+        fclose(capture);
+    release_cdc();
+    fprintf(stderr, "UART: %lu bytes received, %lu bytes sent, %lu errors.\n",
+        rx_bytes, tx_bytes, rx_errors + tx_errors);
+}
+
+//
+// Relay data between UART and stdio or pseudo-terminal,
+// until interrupted.
+//
+void mcp_uart(int vid, int pid, int baud, int use_pty, const char *capture_file, int binary)
+{
+    uart_open(vid, pid, "", baud, use_pty, capture_file, binary);
+    catch_stop_signals();
+    uart_loop();
+    uart_close();
+}
+
+static void *uart_thread(void *arg)
+{
+    sigset_t mask;
+
+    // Signals are handled by the main thread.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, 0);
+    rt_worker_thread();
+
+    uart_loop();
+    return 0;
+}
+
+//
+// Start UART relay in a separate thread, on the device with given serial.
+// HID interface stays free for the main thread: both have their own
+// libusb context, so neither one waits for events of the other.
+//
+void uart_start(int vid, int pid, const char *serial, int baud,
+    int use_pty, const char *capture_file, int binary)
+{
+    uart_open(vid, pid, serial, baud, use_pty, capture_file, binary);
+    if (pthread_create(&uart_tid, 0, uart_thread, 0) != 0) {
+        fprintf(stderr, "Cannot create UART thread\n");
+        exit(-1);
+    }
+}
+
+//
+// Stop the UART thread and release the CDC interfaces.
+//
+void uart_stop()
+{
+    uart_stopping = 1;
+    if (write(wake_pipe[1], "", 1) < 0)
+        perror("UART wakeup");
+    pthread_join(uart_tid, 0);
+    uart_close();
+}
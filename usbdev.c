@@ -0,0 +1,65 @@
+/*
+ * Search of USB devices by VID/PID and serial number.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "usbdev.h"
+
+libusb_device_handle *usb_open_device(libusb_context *ctx, int vid, int pid,
+    const char *serial, int (*skip)(libusb_device *device),
+    char *found, int found_size)
+{
+    libusb_device **list;
+    libusb_device_handle *handle = 0;
+    unsigned char str[64];
+    ssize_t count, i;
+
+    count = libusb_get_device_list(ctx, &list);
+    if (count < 0)
+        return 0;
+
+    for (i=0; i<count; i++) {
+        struct libusb_device_descriptor desc;
+
+        if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+            desc.idVendor != vid || desc.idProduct != pid ||
+            (skip && skip(list[i])))
+            continue;
+        if (libusb_open(list[i], &handle) < 0) {
+            handle = 0;
+            continue;
+        }
+        str[0] = 0;
+        if (desc.iSerialNumber &&
+            libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, str, sizeof(str)) < 0)
+            str[0] = 0;
+        if (serial[0] == 0 || strcmp((char*)str, serial) == 0)
+            break;
+        libusb_close(handle);
+        handle = 0;
+    }
+    libusb_free_device_list(list, 1);
+    if (handle && found)
+        snprintf(found, found_size, "%s", (char*)str);
+    return handle;
+}
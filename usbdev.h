@@ -0,0 +1,42 @@
+/*
+ * Search of USB devices by VID/PID and serial number,
+ * shared by the HID, async and UART modules.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef USBDEV_H
+#define USBDEV_H
+
+#include <libusb.h>
+
+//
+// Open the device with given VID/PID and serial number.
+// Empty serial matches any device.  Devices for which skip()
+// returns non-zero are ignored; skip can be NULL.
+// Serial number of the opened device is stored into found[],
+// when given.
+// Return NULL when not found.
+//
+libusb_device_handle *usb_open_device(libusb_context *ctx, int vid, int pid,
+    const char *serial, int (*skip)(libusb_device *device),
+    char *found, int found_size);
+
+#endif /* USBDEV_H */
@@ -0,0 +1,84 @@
+/*
+ * Auxiliary functions.
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include "util.h"
+
+volatile int stop_flag;
+
+//
+// Get monotonic time in nanoseconds.
+//
+unsigned long long time_nsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Sleep until the given monotonic time.
+// Return immediately when the time has already passed.
+//
+void sleep_until(unsigned long long nsec)
+{
+    for (;;) {
+        unsigned long long now = time_nsec();
+        if (now >= nsec)
+            return;
+
+        struct timespec ts;
+        ts.tv_sec = (nsec - now) / 1000000000ULL;
+        ts.tv_nsec = (nsec - now) % 1000000000ULL;
+        if (nanosleep(&ts, 0) == 0 || errno != EINTR)
+            return;
+    }
+}
+
+static void stop_handler(int sig)
+{
+    stop_flag = 1;
+}
+
+//
+// Set stop_flag on SIGINT or SIGTERM.
+// Blocking system calls get interrupted, so that
+// long-running loops could terminate gracefully.
+// Broken connections are reported as errors instead of SIGPIPE.
+//
+void catch_stop_signals()
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, 0);
+}
@@ -31,7 +31,7 @@ extern const char *copyright;
 //
 // Trace data i/o via the serial port.
 //
-int trace_flag;
+extern int trace_flag;
 
 //
 // HID functions.
@@ -39,8 +39,162 @@ int trace_flag;
 int hid_init(int vid, int pid);
 const char *hid_identify(void);
 void hid_close(void);
-void hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsigned rlength);
+int hid_send_recv(const unsigned char *data, unsigned nbytes, void *rdata, unsigned rlength);
 void hid_read_block(int bno, unsigned char *data, int nbytes);
 void hid_read_finish(void);
 void hid_write_block(int bno, unsigned char *data, int nbytes);
 void hid_write_finish(void);
+
+//
+// Statistics of USB transfers.
+//
+typedef struct {
+    unsigned long requests;         // number of completed requests
+    unsigned long retries;          // number of repeated transfers
+    unsigned long errors;           // number of failed transfers
+    unsigned long timeouts;         // transfers not completed in time
+    unsigned long stalls;           // cleared endpoint halts
+    unsigned long cancels;          // cancelled I2C operations
+    unsigned long reconnects;       // device lost and found again
+} hid_stats_t;
+
+void hid_get_stats(hid_stats_t *stats);
+
+//
+// Times of the last request, by time_nsec(): sent, delivered
+// to the device (zero when not known), and reply received.
+//
+void hid_get_times(unsigned long long *t_send, unsigned long long *t_written, unsigned long long *t_recv);
+
+//
+// Retry policy of USB transfers.
+//
+void hid_set_retry_policy(unsigned deadline_msec, unsigned backoff_usec, unsigned backoff_max_usec);
+void hid_set_deadline(int cmd, unsigned msec);
+unsigned hid_get_deadline(int cmd);
+
+//
+// Reconnect automatically, when the device is lost.
+//
+void hid_set_reconnect(int enable);
+
+//
+// Get serial number of the connected device.
+//
+const char *hid_get_serial(void);
+
+//
+// Send a sequence of 64-byte requests back to back.
+//
+void hid_send_batch(const unsigned char *reqs, unsigned count, unsigned char *replies);
+
+//
+// Record USB session into a file, or replay it without a device.
+// Latency scale 0 means to reply immediately.
+//
+void hid_record_open(const char *filename);
+void hid_replay_open(const char *filename, double latency_scale);
+int hid_recording(void);
+int hid_replaying(void);
+void hid_record(const unsigned char *request, const unsigned char *reply,
+    unsigned long long t_send, unsigned long long t_recv);
+void hid_replay(const unsigned char *request, unsigned char *reply);
+void hid_record_close(void);
+
+//
+// Send reset command and wait until the device comes back.
+//
+int hid_reset(const unsigned char *data, unsigned nbytes, unsigned timeout_msec);
+
+//
+// Real-time mode: lock memory, pin threads to CPUs,
+// and report histogram of USB round trips.
+//
+void rt_start(const char *cpus);
+void rt_worker_thread(void);
+void rt_latency(unsigned long long nsec);
+void rt_report(void);
+
+//
+// Time functions.
+//
+unsigned long long time_nsec(void);
+void sleep_until(unsigned long long nsec);
+
+//
+// Stop long-running modes on Ctrl-C.
+//
+extern volatile int stop_flag;
+void catch_stop_signals(void);
+
+//
+// Export metrics via HTTP.
+//
+void mcp_export(int port, int interval_msec);
+
+//
+// Publish device state via shared memory.
+//
+void mcp_publish(const char *name, int interval_msec);
+
+//
+// Serve I2C transactions for local clients.
+//
+void mcp_broker(const char *path);
+
+//
+// Poll I2C sensor registers.
+//
+void mcp_poll_sensors(const char *config, const char *output, int binary);
+
+//
+// Monitor ADC inputs of all attached chips.
+//
+void mcp_monitor(int vid, int pid, int interval_msec);
+
+//
+// Acquire ADC inputs of several chips, with aligned timestamps.
+//
+void mcp_acquire(int vid, int pid, const char *list, const char *output, int interval_msec);
+
+//
+// Watch the chip and print changed fields.
+//
+void mcp_watch(const char *output, int interval_msec);
+
+//
+// Log samples into compact file, and query the log.
+// Non-zero ratio enables decimation of ADC samples.
+//
+void mcp_log(const char *filename, int interval_msec, int vdd_mvolt);
+void mcp_query(const char *filename, double from_sec, double to_sec, int ratio, int order);
+void mcp_capture(const char *output, int interval_msec, int ratio, int order, int vdd_mvolt);
+
+//
+// Capture ADC samples around trigger events.
+//
+void mcp_trigger(const char *spec, const char *output, int interval_msec);
+
+//
+// Run closed-loop control of DAC or GPIO output from ADC input.
+//
+void mcp_control(const char *spec, const char *output, int interval_msec);
+
+//
+// Save runtime settings of the chip into profile file, and restore them.
+//
+void mcp_profile_save(const char *filename);
+void mcp_profile_restore(const char *filename);
+
+//
+// Run mixed workload for a long time, and track degradation.
+//
+void mcp_soak(const char *spec, const char *output);
+
+//
+// Relay UART data via CDC interfaces.
+//
+void mcp_uart(int vid, int pid, int baud, int use_pty, const char *capture_file, int binary);
+void uart_start(int vid, int pid, const char *serial, int baud,
+    int use_pty, const char *capture_file, int binary);
+void uart_stop(void);
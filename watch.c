@@ -0,0 +1,152 @@
+/*
+ * Watch pins and inputs of MCP2221 chip, and print only changes.
+ *
+ * Every poll is one STATUSSET and one GETGPIO request in the same
+ * session.  The replies are decoded into a flat list of fields,
+ * compared with the previous values, and each changed field is
+ * printed as one line of event log: time, its uncertainty
+ * in seconds, field, old and new value.
+ *
+ *      12.345678 0.000120 GP1 0 -> 1
+ *
+ * Copyright (c) 2019 Serge Vakulenko
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "mcp2221.h"
+#include "timestamp.h"
+#include "util.h"
+
+//
+// ADC inputs are noisy: changes within this range are not reported.
+//
+#define ADC_DEADBAND    2
+
+enum {
+    F_GP0, F_GP1, F_GP2, F_GP3,
+    F_DIR0, F_DIR1, F_DIR2, F_DIR3,
+    F_SCL, F_SDA, F_INTR, F_I2C,
+    F_ADC0, F_ADC1, F_ADC2,
+    NFIELDS
+};
+
+static const char *field_name[NFIELDS] = {
+    "GP0", "GP1", "GP2", "GP3",
+    "GP0.dir", "GP1.dir", "GP2.dir", "GP3.dir",
+    "SCL", "SDA", "INTR", "I2C.state",
+    "ADC0", "ADC1", "ADC2",
+};
+
+//
+// Decode the replies into a list of fields.
+//
+static void decode(int *field, const mcp_reply_status_t *status, const mcp_reply_gpio_t *gpio)
+{
+    field[F_GP0] = gpio->gp0_pin;
+    field[F_GP1] = gpio->gp1_pin;
+    field[F_GP2] = gpio->gp2_pin;
+    field[F_GP3] = gpio->gp3_pin;
+    field[F_DIR0] = gpio->gp0_direction;
+    field[F_DIR1] = gpio->gp1_direction;
+    field[F_DIR2] = gpio->gp2_direction;
+    field[F_DIR3] = gpio->gp3_direction;
+    field[F_SCL] = status->scl_input;
+    field[F_SDA] = status->sda_input;
+    field[F_INTR] = status->intr_edge;
+    field[F_I2C] = status->i2c_machine_state;
+    field[F_ADC0] = status->adc_ch0;
+    field[F_ADC1] = status->adc_ch1;
+    field[F_ADC2] = status->adc_ch2;
+}
+
+//
+// Is the change worth reporting?
+//
+static int changed(int index, int old, int new)
+{
+    if (index >= F_ADC0)
+        return abs(new - old) > ADC_DEADBAND;
+    return new != old;
+}
+
+//
+// Poll the chip with given interval, and print changed fields.
+// The first poll prints all fields, as the initial state.
+//
+void mcp_watch(const char *output, int interval_msec)
+{
+    unsigned long long interval = interval_msec * 1000000ULL;
+    unsigned long long start_time, deadline, t_status, t_gpio, err_status, err_gpio;
+    unsigned long npolls = 0, nevents = 0;
+    mcp_reply_status_t status;
+    mcp_reply_gpio_t gpio;
+    int field[NFIELDS], last[NFIELDS];
+    FILE *out = stdout;
+    tstamp_t *ts = ts_create("chip");
+    int i;
+
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            perror(output);
+            exit(-1);
+        }
+    }
+
+    catch_stop_signals();
+    start_time = deadline = time_nsec();
+    while (!stop_flag) {
+        mcp_get_status(&status);
+        ts_last(ts, &t_status, &err_status);
+        mcp_get_gpio(&gpio);
+        ts_last(ts, &t_gpio, &err_gpio);
+        decode(field, &status, &gpio);
+
+        // Pins are sampled by the second request.
+        for (i=0; i<NFIELDS; i++) {
+            double t = ((i < F_SCL ? t_gpio : t_status) - start_time) / 1e9;
+            double err = (i < F_SCL ? err_gpio : err_status) / 1e9;
+
+            if (npolls == 0) {
+                fprintf(out, "%.6f %.6f %s %d\n", t, err, field_name[i], field[i]);
+            } else if (changed(i, last[i], field[i])) {
+                fprintf(out, "%.6f %.6f %s %d -> %d\n", t, err, field_name[i], last[i], field[i]);
+                nevents++;
+            } else {
+                continue;
+            }
+            last[i] = field[i];
+        }
+        fflush(out);
+        npolls++;
+
+        deadline += interval;
+        if (deadline < time_nsec())
+            deadline = time_nsec();
+        sleep_until(deadline);
+    }
+
+    if (out != stdout)
+        fclose(out);
+    fprintf(stderr, "Watched %lu polls, %lu changes.\n", npolls, nevents);
+    ts_report(ts);
+    ts_destroy(ts);
+}